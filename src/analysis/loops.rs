@@ -0,0 +1,145 @@
+// Copyright (c) 2017-2021 Fabian Schuiki
+
+use crate::{
+    analysis::{DominatorTree, PredecessorTable},
+    ir::prelude::*,
+};
+use std::collections::{HashMap, HashSet};
+
+/// The natural loops of a function or process.
+///
+/// A natural loop is formed by one or more back edges, i.e. edges from a block
+/// to a block that dominates it. The target of the back edges is the header of
+/// the loop, and the loop contains all blocks that can reach one of the back
+/// edges without passing through the header. Back edges may be regular
+/// branches or `wait` instructions, such that the loop that a process executes
+/// once per wakeup is a natural loop as well.
+///
+/// All blocks and loops are listed in a deterministic order derived from the
+/// order of the branch targets in the CFG.
+#[derive(Debug, Clone)]
+pub struct LoopInfo {
+    /// The reachable blocks in reverse post-order.
+    rpo: Vec<Block>,
+    /// The loops, innermost first.
+    loops: Vec<Loop>,
+}
+
+/// A natural loop.
+#[derive(Debug, Clone)]
+pub struct Loop {
+    /// The block all back edges of the loop branch to.
+    pub header: Block,
+    /// The blocks in the loop, including the header, in reverse post-order.
+    pub blocks: Vec<Block>,
+    /// The blocks with a back edge to the header.
+    pub latches: Vec<Block>,
+    /// The only block outside the loop that branches to the header, if it does
+    /// not branch anywhere else.
+    pub preheader: Option<Block>,
+    /// The blocks in the loop, for fast lookup.
+    set: HashSet<Block>,
+}
+
+impl LoopInfo {
+    /// Compute the natural loops of a function or process.
+    pub fn new(unit: &Unit, pred: &PredecessorTable, dt: &DominatorTree) -> Self {
+        let rpo = reverse_post_order(unit);
+        let index: HashMap<Block, usize> = rpo.iter().enumerate().map(|(i, &bb)| (bb, i)).collect();
+
+        // Find the back edges, grouped by header.
+        let mut latches = HashMap::<Block, Vec<Block>>::new();
+        let mut headers = vec![];
+        for &bb in &rpo {
+            for &succ in unit[unit.terminator(bb)].blocks() {
+                if dt.dominates(succ, bb) {
+                    let entry = latches.entry(succ).or_insert_with(|| {
+                        headers.push(succ);
+                        vec![]
+                    });
+                    if !entry.contains(&bb) {
+                        entry.push(bb);
+                    }
+                }
+            }
+        }
+        headers.sort_by_key(|bb| index[bb]);
+
+        // Collect the blocks that reach the back edges without passing through
+        // the header.
+        let mut loops: Vec<Loop> = headers
+            .into_iter()
+            .map(|header| {
+                let latches = latches.remove(&header).unwrap();
+                let mut set = HashSet::new();
+                set.insert(header);
+                let mut todo = latches.clone();
+                while let Some(bb) = todo.pop() {
+                    if set.insert(bb) {
+                        todo.extend(pred.pred(bb).filter(|p| index.contains_key(p)));
+                    }
+                }
+                let mut blocks: Vec<_> = set.iter().cloned().collect();
+                blocks.sort_by_key(|bb| index[bb]);
+                let mut outside = pred.pred(header).filter(|p| !set.contains(p));
+                let preheader = match (outside.next(), outside.next()) {
+                    (Some(p), None) if pred.is_sole_succ(header, p) => Some(p),
+                    _ => None,
+                };
+                Loop {
+                    header,
+                    blocks,
+                    latches,
+                    preheader,
+                    set,
+                }
+            })
+            .collect();
+        loops.sort_by_key(|l| l.blocks.len());
+
+        Self { rpo, loops }
+    }
+
+    /// Get the reachable blocks in reverse post-order.
+    pub fn rpo(&self) -> &[Block] {
+        &self.rpo
+    }
+
+    /// Get the loops, with inner loops before the loops that contain them.
+    pub fn loops(&self) -> &[Loop] {
+        &self.loops
+    }
+}
+
+impl Loop {
+    /// Check whether a block is part of the loop.
+    pub fn contains(&self, bb: Block) -> bool {
+        self.set.contains(&bb)
+    }
+}
+
+/// Compute the reverse post-order of the blocks reachable from the entry.
+///
+/// The successors of a block are visited in the order in which they appear in
+/// its terminator, such that the order is deterministic.
+pub fn reverse_post_order(unit: &Unit) -> Vec<Block> {
+    let mut order = vec![];
+    let mut visited = HashSet::new();
+    let mut stack = vec![(unit.entry(), 0)];
+    visited.insert(unit.entry());
+    while let Some((bb, next)) = stack.last_mut() {
+        let succs = unit[unit.terminator(*bb)].blocks();
+        if *next < succs.len() {
+            let succ = succs[*next];
+            *next += 1;
+            if visited.insert(succ) {
+                stack.push((succ, 0));
+            }
+        } else {
+            order.push(*bb);
+            stack.pop();
+        }
+    }
+    order.reverse();
+    order
+}
@@ -5,9 +5,11 @@
 //! This module implements various analysis passes on the IR.
 
 mod domtree;
+mod loops;
 mod preds;
 mod trg;
 
 pub use self::domtree::*;
+pub use self::loops::*;
 pub use self::preds::*;
 pub use self::trg::*;
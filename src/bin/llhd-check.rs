@@ -32,6 +32,11 @@ fn main() {
                 .long("emit-trg")
                 .help("Analyze and emit the temporal regions"),
         )
+        .arg(
+            Arg::with_name("footprint")
+                .long("footprint")
+                .help("Report the memory used by each unit"),
+        )
         .get_matches();
 
     let mut num_errors = 0;
@@ -69,6 +74,15 @@ fn process_input(path: &str, matches: &ArgMatches) -> Result<()> {
         .finish()
         .map_err(|errs| anyhow!("Verification failed:\n{}", errs))?;
 
+    // Report the memory footprint if requested by the user.
+    if matches.is_present("footprint") {
+        println!("Memory Footprint:");
+        for u in module.units() {
+            println!("  {}: {}", u.name(), u.footprint());
+        }
+        println!("  total: {}", module.footprint());
+    }
+
     // Dump the temporal regions if requested by the user.
     if matches.is_present("emit-trg") {
         println!("Temporal Regions:");
@@ -166,6 +166,10 @@ fn main() -> Result<()> {
     )
     .with_context(|| format!("Failed to write output to {}", output_name))?;
 
+    // Don't bother freeing the module, which for large designs takes a
+    // considerable amount of time. The OS reclaims the memory at exit anyway.
+    std::mem::forget(module);
+
     Ok(())
 }
 
@@ -0,0 +1,102 @@
+// Copyright (c) 2017-2021 Fabian Schuiki
+
+//! A tool to merge and report the coverage databases written by `llhd-sim`.
+
+#[macro_use]
+extern crate clap;
+#[macro_use]
+extern crate log;
+
+use anyhow::{Context, Result};
+use clap::Arg;
+use llhd::cov::Database;
+use rayon::prelude::*;
+use std::{fs::File, io::BufReader};
+
+fn main() -> Result<()> {
+    // Configure the logger.
+    pretty_env_logger::init_custom_env("LLHD_LOG");
+
+    // Parse the command line arguments.
+    let matches = app_from_crate!()
+        .about("A tool to merge and report simulation coverage.")
+        .arg(
+            Arg::with_name("inputs")
+                .multiple(true)
+                .required(true)
+                .help("Coverage databases to merge"),
+        )
+        .arg(
+            Arg::with_name("output")
+                .short("o")
+                .long("output")
+                .takes_value(true)
+                .help("Write the merged database to a file"),
+        )
+        .arg(
+            Arg::with_name("report")
+                .short("r")
+                .long("report")
+                .help("List the signals and blocks that are not fully covered"),
+        )
+        .get_matches();
+
+    // Read and merge the databases in parallel.
+    let inputs: Vec<_> = matches.values_of("inputs").unwrap().collect();
+    debug!("Merging {} coverage databases", inputs.len());
+    let db = inputs
+        .par_iter()
+        .map(|path| -> Result<Database> {
+            let file = File::open(path).with_context(|| format!("failed to open {}", path))?;
+            Database::read(BufReader::new(file))
+                .with_context(|| format!("failed to read coverage from {}", path))
+        })
+        .try_reduce(Database::default, |a, b| Ok(a.merge(b)))?;
+
+    // Write the merged database if requested.
+    if let Some(path) = matches.value_of("output") {
+        let file = File::create(path).with_context(|| format!("failed to create {}", path))?;
+        db.write(std::io::BufWriter::new(file))
+            .with_context(|| format!("failed to write coverage to {}", path))?;
+    }
+
+    // Summarize the coverage.
+    let total_bits: usize = db.toggles.values().map(|t| t.width).sum();
+    let covered_bits: usize = db.toggles.values().map(|t| t.num_covered()).sum();
+    let covered_blocks = db.blocks.values().filter(|&&c| c > 0).count();
+    println!(
+        "Toggle coverage: {}/{} bits ({})",
+        covered_bits,
+        total_bits,
+        percent(covered_bits, total_bits)
+    );
+    println!(
+        "Block coverage: {}/{} blocks ({})",
+        covered_blocks,
+        db.blocks.len(),
+        percent(covered_blocks, db.blocks.len())
+    );
+    if matches.is_present("report") {
+        for (name, toggles) in &db.toggles {
+            let covered = toggles.num_covered();
+            if covered < toggles.width {
+                println!("  {}: {}/{} bits toggled", name, covered, toggles.width);
+            }
+        }
+        for (name, &count) in &db.blocks {
+            if count == 0 {
+                println!("  {}: never entered", name);
+            }
+        }
+    }
+
+    Ok(())
+}
+
+/// Format a ratio as percentage.
+fn percent(num: usize, den: usize) -> String {
+    if den == 0 {
+        return "n/a".to_string();
+    }
+    format!("{:.1}%", num as f64 * 100.0 / den as f64)
+}
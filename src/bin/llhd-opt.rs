@@ -73,6 +73,11 @@ fn main_inner() -> Result<(), String> {
                 .long("lower")
                 .help("Execute passes to lower behavioural to structural LLHD"),
         )
+        .arg(
+            Arg::with_name("keep-if-smaller")
+                .long("keep-if-smaller")
+                .help("Undo optimization passes that grow the module or break it"),
+        )
         .get_matches();
 
     // Configure rayon to be single-threaded if requested.
@@ -89,6 +94,7 @@ fn main_inner() -> Result<(), String> {
     let tinit = Instant::now();
 
     // Read the input.
+    reset_peak_rss();
     let t0 = Instant::now();
     let mut module = {
         let path = matches.value_of("input").unwrap();
@@ -104,15 +110,15 @@ fn main_inner() -> Result<(), String> {
         module
     };
     let t1 = Instant::now();
-    times.push(("parse".to_owned(), t1 - t0));
+    times.push(("parse".to_owned(), t1 - t0, peak_rss()));
 
     // Determine the optimization passes to be run.
     let passes: Vec<_> = if let Some(passes) = matches.values_of("passes") {
         passes.collect()
     } else {
         let mut v = vec![
-            "cf", "vtpp", "dce", "gcse", "ecm", "tcm", "ecm", "tcm", "gcse", "tcm", "cf", "ecm",
-            "gcse", "insim", "dce", "cfs", "insim", "dce",
+            "cf", "vtpp", "dce", "gcse", "ecm", "tcm", "ecm", "tcm", "gcse", "tcm", "dde", "cf",
+            "ecm", "gcse", "insim", "dce", "cfs", "insim", "dce", "wsm",
         ];
         if matches.is_present("lower") {
             v.extend(["proclower", "deseq"].iter().copied());
@@ -123,20 +129,39 @@ fn main_inner() -> Result<(), String> {
     // Apply optimization passes.
     debug!("Running {:?}", passes);
     let ctx = PassContext;
+    let keep_if_smaller = matches.is_present("keep-if-smaller");
     for &pass in &passes {
         trace!("Running pass {}", pass);
+        reset_peak_rss();
         let t0 = Instant::now();
+
+        // Take a snapshot of the module if the pass is to be undone in case it
+        // does not pay off. Lowering passes are always kept, as is process
+        // merging, which trades code size for fewer process instances.
+        let mut snapshot = match pass {
+            "verify" | "proclower" | "procmerge" | "deseq" => None,
+            _ if keep_if_smaller => Some((module.snapshot(), module_size(&module))),
+            _ => None,
+        };
+
         let _changes = match pass {
             "cf" => llhd::pass::ConstFolding::run_on_module(&ctx, &mut module),
             "cfs" => llhd::pass::ControlFlowSimplification::run_on_module(&ctx, &mut module),
             "dce" => llhd::pass::DeadCodeElim::run_on_module(&ctx, &mut module),
+            "dde" => llhd::pass::DeadDriveElimination::run_on_module(&ctx, &mut module),
             "deseq" => llhd::pass::Desequentialization::run_on_module(&ctx, &mut module),
             "ecm" => llhd::pass::EarlyCodeMotion::run_on_module(&ctx, &mut module),
             "gcse" => llhd::pass::GlobalCommonSubexprElim::run_on_module(&ctx, &mut module),
             "insim" => llhd::pass::InstSimplification::run_on_module(&ctx, &mut module),
+            "licm" => llhd::pass::LoopInvariantCodeMotion::run_on_module(&ctx, &mut module),
+            "lut" => llhd::pass::LookupTableConversion::run_on_module(&ctx, &mut module),
             "proclower" => llhd::pass::ProcessLowering::run_on_module(&ctx, &mut module),
+            "procmerge" => llhd::pass::ProcessMerging::run_on_module(&ctx, &mut module),
+            "sigcoal" => llhd::pass::SignalCoalescing::run_on_module(&ctx, &mut module),
+            "sigsplit" => llhd::pass::SignalSplitting::run_on_module(&ctx, &mut module),
             "tcm" => llhd::pass::TemporalCodeMotion::run_on_module(&ctx, &mut module),
             "vtpp" => llhd::pass::VarToPhiPromotion::run_on_module(&ctx, &mut module),
+            "wsm" => llhd::pass::WaitSensitivityMinimization::run_on_module(&ctx, &mut module),
             "verify" => {
                 let mut verifier = Verifier::new();
                 verifier.verify_module(&module);
@@ -148,14 +173,35 @@ fn main_inner() -> Result<(), String> {
             }
             _ => {
                 error!("Unknown pass `{}`", pass);
+                if let Some((snapshot, _)) = snapshot.take() {
+                    module.commit(snapshot);
+                }
                 continue;
             }
         };
+
+        // Undo the pass if it broke or grew the module.
+        if let Some((snapshot, size_before)) = snapshot {
+            let size_after = module_size(&module);
+            let mut verifier = Verifier::new();
+            verifier.verify_module(&module);
+            let broken = verifier.finish().is_err();
+            if broken || size_after > size_before {
+                debug!(
+                    "Undoing pass {} (broken: {}, {} -> {} insts)",
+                    pass, broken, size_before, size_after
+                );
+                module.rollback(snapshot);
+            } else {
+                module.commit(snapshot);
+            }
+        }
         let t1 = Instant::now();
-        times.push((pass.to_owned(), t1 - t0));
+        times.push((pass.to_owned(), t1 - t0, peak_rss()));
     }
 
     // Verify modified module.
+    reset_peak_rss();
     let t0 = Instant::now();
     let mut failed = false;
     let mut verifier = Verifier::new();
@@ -186,9 +232,10 @@ fn main_inner() -> Result<(), String> {
         }
     }
     let t1 = Instant::now();
-    times.push(("verify".to_owned(), t1 - t0));
+    times.push(("verify".to_owned(), t1 - t0, peak_rss()));
 
     // Write the output.
+    reset_peak_rss();
     let t0 = Instant::now();
     if let Some(path) = matches.value_of("output") {
         let output = File::create(path).map_err(|e| format!("{}", e))?;
@@ -198,18 +245,28 @@ fn main_inner() -> Result<(), String> {
         llhd::assembly::write_module(std::io::stdout().lock(), &module);
     }
     let t1 = Instant::now();
-    times.push(("output".to_owned(), t1 - t0));
+    times.push(("output".to_owned(), t1 - t0, peak_rss()));
 
     // Final time stat.
     let tfinal = Instant::now();
-    times.push(("total".to_owned(), tfinal - tinit));
+    let peak = times.iter().flat_map(|t| t.2).max();
+    times.push(("total".to_owned(), tfinal - tinit, peak));
 
     // Print execution time statistics if requested by the user.
     if matches.is_present("time-passes") {
         eprintln!("Execution Time Statistics:");
-        for (mut name, duration) in times {
+        for (mut name, duration, peak) in times {
             name.push(':');
-            eprintln!("  {:10}  {:8.3} ms", name, duration.as_secs_f64() / 1.0e-3);
+            let peak = match peak {
+                Some(peak) => format!("{:8.1} MiB peak RSS", peak as f64 / (1 << 20) as f64),
+                None => String::new(),
+            };
+            eprintln!(
+                "  {:10}  {:8.3} ms  {}",
+                name,
+                duration.as_secs_f64() / 1.0e-3,
+                peak
+            );
         }
         eprintln!("");
         eprintln!("Structure Statistics:");
@@ -217,8 +274,26 @@ fn main_inner() -> Result<(), String> {
             "  Dominator Tree Construction: {:8.3} ms",
             llhd::analysis::DOMINATOR_TREE_TIME.load(Ordering::SeqCst) as f64 * 1.0e-6
         );
+        let rules: Vec<_> = llhd::pass::InstSimplification::rule_statistics()
+            .into_iter()
+            .filter(|&(_, count)| count > 0)
+            .collect();
+        if !rules.is_empty() {
+            eprintln!("");
+            eprintln!("Instruction Simplification Rules:");
+            for (name, count) in rules {
+                eprintln!("  {:16}  {:8}", name, count);
+            }
+        }
+        eprintln!("");
+        eprintln!("Memory Footprint:");
+        eprintln!("  {}", module.footprint());
     }
 
+    // Don't bother freeing the module, which for large designs takes a
+    // considerable amount of time. The OS reclaims the memory at exit anyway.
+    std::mem::forget(module);
+
     // Dump some threading statistics.
     info!("Used {} rayon worker threads", rayon::current_num_threads());
 
@@ -237,12 +312,39 @@ passes are as follows:
 cf          Constant folding
 cfs         Control Flow Simplification
 dce         Dead Code Elimination
+dde         Dead Drive Elimination
 deseq       Desequentialization
 ecm         Early Code Motion
 gcse        Global Common Subexpression Elimination
 insim       Instruction Simplification
+licm        Loop-Invariant Code Motion
+lut         Lookup Table Conversion
 proclower   Process Lowering
+procmerge   Process Merging
+sigcoal     Signal Coalescing
+sigsplit    Signal Splitting
 tcm         Temporal Code Motion
 vtpp        Var-to-Phi Promotion
+wsm         Wait Sensitivity Minimization
 verify      Verify the IR
 ";
+
+/// Count the instructions in a module.
+fn module_size(module: &llhd::ir::Module) -> usize {
+    module.units().map(|u| u.all_insts().count()).sum()
+}
+
+/// Get the peak resident set size of the process in bytes, if the OS reports
+/// it.
+fn peak_rss() -> Option<usize> {
+    let status = std::fs::read_to_string("/proc/self/status").ok()?;
+    let line = status.lines().find(|l| l.starts_with("VmHWM:"))?;
+    let kib: usize = line.split_whitespace().nth(1)?.parse().ok()?;
+    Some(kib * 1024)
+}
+
+/// Reset the peak resident set size of the process, such that `peak_rss`
+/// reports the peak of the phase that follows.
+fn reset_peak_rss() {
+    let _ = std::fs::write("/proc/self/clear_refs", "5");
+}
@@ -9,44 +9,79 @@ use crate::{
     state::{Instance, InstanceKind, InstanceState, Scope, Signal, SignalRef, State, ValueSlot},
     value::{ArrayValue, IntValue, StructValue, TimeValue, Value},
 };
-use anyhow::{anyhow, Result};
-use num::bigint::ToBigInt;
-use std::{collections::HashMap, sync::Mutex};
+use anyhow::{anyhow, bail, Result};
+use rayon::prelude::*;
+use std::{
+    collections::HashMap,
+    sync::{Arc, Mutex},
+};
 
 struct Builder<'ll> {
     module: &'ll llhd::ir::Module,
     signals: Vec<Signal>,
-    probes: HashMap<SignalRef, Vec<String>>,
+    /// The union-find forest of signals connected with `con`. Each signal
+    /// points at its parent, and the roots at themselves.
+    aliases: Vec<SignalRef>,
+    delays: HashMap<SignalRef, Vec<(SignalRef, TimeValue)>>,
+    probes: HashMap<SignalRef, Vec<Arc<str>>>,
+    inputs: Vec<SignalRef>,
     insts: Vec<Instance<'ll>>,
     scope_stack: Vec<Scope>,
+    templates: Arc<HashMap<llhd::ir::UnitId, Template<'ll>>>,
 }
 
 impl<'ll> Builder<'ll> {
     /// Create a new builder for the given module.
-    fn new(module: &llhd::ir::Module) -> Builder {
-        Builder {
+    ///
+    /// The templates of all processes and entities in the module are created
+    /// up front, in parallel. Fails if any of the units cannot be simulated.
+    fn new(module: &llhd::ir::Module) -> Result<Builder> {
+        let units: Vec<_> = module
+            .units()
+            .filter(|unit| unit.is_process() || unit.is_entity())
+            .collect();
+        let templates = units
+            .into_par_iter()
+            .map(|unit| Ok((unit.id(), Template::new(module, unit)?)))
+            .collect::<Result<_>>()?;
+        Ok(Builder {
             module: module,
             signals: Vec::new(),
+            aliases: Vec::new(),
+            delays: HashMap::new(),
             probes: HashMap::new(),
+            inputs: Vec::new(),
             insts: Vec::new(),
             scope_stack: Vec::new(),
-        }
+            templates: Arc::new(templates),
+        })
     }
 
     /// Build the root unit for a simulation.
-    fn build_root(&mut self, unit: llhd::ir::Unit<'ll>) {
+    ///
+    /// If `four_state` is set, the top-level ports start out as all `X`
+    /// instead of void.
+    fn build_root(&mut self, unit: llhd::ir::Unit<'ll>, four_state: bool) {
         let sig = unit.sig();
+        let init = |ty: &llhd::Type| {
+            if four_state {
+                Value::unknown(ty)
+            } else {
+                Value::Void
+            }
+        };
 
         // Allocate the input and output signals for the top-level module.
         // TODO(fschuiki): Assign proper default signal values.
         let inputs: Vec<_> = sig
             .inputs()
-            .map(|arg| self.alloc_signal(sig.arg_type(arg), Value::Void))
+            .map(|arg| self.alloc_signal(sig.arg_type(arg), init(&sig.arg_type(arg))))
             .collect();
         let outputs: Vec<_> = sig
             .outputs()
-            .map(|arg| self.alloc_signal(sig.arg_type(arg), Value::Void))
+            .map(|arg| self.alloc_signal(sig.arg_type(arg), init(&sig.arg_type(arg))))
             .collect();
+        self.inputs = inputs.clone();
 
         // Instantiate the top-level module.
         self.push_scope(unit.name().to_string());
@@ -57,21 +92,60 @@ impl<'ll> Builder<'ll> {
     fn alloc_signal(&mut self, ty: llhd::Type, init: Value) -> SignalRef {
         let id = SignalRef::new(self.signals.len());
         self.signals.push(Signal::new(ty, init));
+        self.aliases.push(id);
         id
     }
 
+    /// Find the signal that represents all signals connected to a signal.
+    fn find_alias(&mut self, signal: SignalRef) -> SignalRef {
+        let parent = self.aliases[signal.as_usize()];
+        if parent == signal {
+            return signal;
+        }
+        let root = self.find_alias(parent);
+        self.aliases[signal.as_usize()] = root;
+        root
+    }
+
+    /// Connect two signals, such that they share their storage.
+    ///
+    /// The signal allocated first represents the connected signals, and keeps
+    /// its initial value unless it has none.
+    fn connect(&mut self, a: SignalRef, b: SignalRef) {
+        let a = self.find_alias(a);
+        let b = self.find_alias(b);
+        let (root, other) = if a <= b { (a, b) } else { (b, a) };
+        self.aliases[other.as_usize()] = root;
+        if self.signals[root.as_usize()].value() == &Value::Void {
+            let init = self.signals[other.as_usize()].value().clone();
+            self.signals[root.as_usize()].set_value(init);
+        }
+    }
+
     /// Allocate a new signal probe in the simulation. This essentially assigns
     /// a name to a signal which is also known to the user.
-    pub fn alloc_signal_probe(&mut self, signal: SignalRef, name: String) {
+    ///
+    /// The name is shared with the unit's template, such that every instance
+    /// merely bumps its reference count.
+    pub fn alloc_signal_probe(&mut self, signal: SignalRef, name: &Arc<str>) {
         self.probes
             .entry(signal)
             .or_insert(Vec::new())
             .push(name.clone());
-        self.scope_stack.last_mut().unwrap().add_probe(signal, name);
+        self.scope_stack
+            .last_mut()
+            .unwrap()
+            .add_probe(signal, name.clone());
     }
 
     /// Instantiate a process or entity for simulation. This recursively builds
     /// the simulation structure for all subunits as necessary.
+    ///
+    /// The unit's template provides everything that does not depend on the
+    /// instance, such that this merely allocates the unit's signals as a
+    /// contiguous block. The values that carry signals are resolved through
+    /// the template's offsets into the instance's signals, so no per-instance
+    /// value table is built.
     pub fn instantiate(
         &mut self,
         unit: llhd::ir::Unit<'ll>,
@@ -79,132 +153,134 @@ impl<'ll> Builder<'ll> {
         outputs: Vec<SignalRef>,
     ) {
         debug!("Instantiating {}", unit.name());
+        let templates = self.templates.clone();
+        let template = &templates[&unit.id()];
 
-        // Create signal probes for the input and output arguments of the unit.
-        let input_iter = unit.sig().inputs().zip(inputs.iter());
-        let output_iter = unit.sig().outputs().zip(outputs.iter());
-        let args_iter = input_iter.chain(output_iter);
-        let mut values: HashMap<llhd::ir::Value, ValueSlot> = args_iter
-            .map(|(arg, &sig)| {
-                let v = unit.arg_value(arg);
-                if let Some(name) = unit.get_name(v) {
-                    self.alloc_signal_probe(sig, name.to_string());
-                }
-                (v, ValueSlot::Signal(sig))
-            })
-            .collect();
-
-        // Make a list of signals that this instance is sensitive to.
+        // Make a list of signals that this instance is sensitive to, starting
+        // with the arguments of the unit.
         let mut signals = inputs;
         signals.extend(outputs);
+        assert_eq!(signals.len(), template.args.len());
 
-        // Gather the process-/entity-specific information.
-        let kind = if unit.is_process() {
-            // Allocate signals.
-            for block in unit.blocks() {
-                for inst in unit.insts(block) {
-                    if unit[inst].opcode() == llhd::ir::Opcode::Sig {
-                        let value = unit.inst_result(inst);
-                        let init = self.const_value(unit, unit[inst].args()[0]);
-                        let sig = self.alloc_signal(unit.value_type(value), init);
-                        signals.push(sig); // entity is re-evaluated when this signal changes
-                        if let Some(name) = unit.get_name(value) {
-                            self.alloc_signal_probe(sig, name.to_string());
-                        }
-                        values.insert(value, ValueSlot::Signal(sig));
-                    }
-                    // Hotfix for const insts in moore output not dominating their uses
-                    else if unit[inst].opcode() == llhd::ir::Opcode::ConstInt
-                        || unit[inst].opcode() == llhd::ir::Opcode::ConstTime
-                    {
-                        let value = unit.inst_result(inst);
-                        values.insert(value, ValueSlot::Const(self.const_value(unit, value)));
-                    }
-                }
+        // Allocate the signals declared by the unit.
+        let base = self.signals.len();
+        for (i, (_, ty, init, _)) in template.signals.iter().enumerate() {
+            let sig = self.alloc_signal(ty.clone(), init.clone());
+            debug_assert_eq!(sig, SignalRef::new(base + i));
+            signals.push(sig); // entity is re-evaluated when this signal changes
+        }
+
+        // Create the signal probes.
+        let names = template
+            .args
+            .iter()
+            .map(|(_, name)| name)
+            .chain(template.signals.iter().map(|(_, _, _, name)| name));
+        for (name, &sig) in names.zip(signals.iter()) {
+            if let Some(name) = name {
+                self.alloc_signal_probe(sig, name);
             }
+        }
+        let resolve_signal = |value: &llhd::ir::Value| signals[template.offsets[value]];
+
+        // Merge the signals connected with `con`, and register the delayed
+        // connections with the scheduler.
+        for (a, b) in &template.cons {
+            let a = resolve_signal(a);
+            let b = resolve_signal(b);
+            self.connect(a, b);
+        }
+        for (target, source, delay) in &template.dels {
+            let target = resolve_signal(target);
+            let source = resolve_signal(source);
+            self.delays
+                .entry(source)
+                .or_insert_with(Vec::new)
+                .push((target, delay.clone()));
+        }
 
+        // Instantiate the subunits.
+        for sub in &template.insts {
+            self.push_scope(sub.name.clone());
+            let inputs = sub.inputs.iter().map(|v| resolve_signal(v)).collect();
+            let outputs = sub.outputs.iter().map(|v| resolve_signal(v)).collect();
+            self.instantiate(sub.unit, inputs, outputs);
+            self.pop_scope();
+        }
+
+        // Create the unit instance.
+        let kind = if unit.is_process() {
             InstanceKind::Process {
                 prok: unit,
                 next_block: unit.first_block(),
             }
-        } else if unit.is_entity() {
-            // Allocate signals and instantiate subunits.
-            for inst in unit.all_insts() {
-                if unit[inst].opcode() == llhd::ir::Opcode::Sig {
-                    let value = unit.inst_result(inst);
-                    let init = self.const_value(unit, unit[inst].args()[0]);
-                    let sig = self.alloc_signal(unit.value_type(value), init);
-                    signals.push(sig); // entity is re-evaluated when this signal changes
-                    if let Some(name) = unit.get_name(value) {
-                        self.alloc_signal_probe(sig, name.to_string());
-                    }
-                    values.insert(value, ValueSlot::Signal(sig));
-                } else if unit[inst].opcode() == llhd::ir::Opcode::Inst {
-                    let ext_unit = unit[inst].get_ext_unit().unwrap();
-                    let name = &unit[ext_unit].name;
-                    let mod_subunit = match self.module.lookup_ext_unit(ext_unit, unit.id()) {
-                        Some(llhd::ir::LinkedUnit::Def(s)) => s,
-                        _ => panic!("external unit {} not linked", name),
-                    };
-                    self.push_scope(name.to_string());
-                    let resolve_signal = |v| match values[v] {
-                        ValueSlot::Signal(sig) => sig,
-                        _ => panic!("value does not resolve to a signal"),
-                    };
-                    let inputs = unit[inst]
-                        .input_args()
-                        .iter()
-                        .map(&resolve_signal)
-                        .collect();
-                    let outputs = unit[inst]
-                        .output_args()
-                        .iter()
-                        .map(&resolve_signal)
-                        .collect();
-                    self.instantiate(self.module.unit(mod_subunit), inputs, outputs);
-                    self.pop_scope();
-                }
-            }
-
-            InstanceKind::Entity { entity: unit }
         } else {
-            unreachable!()
+            InstanceKind::Entity { entity: unit }
         };
-
-        // Create a mapping from signals to the values which correspond to them.
-        // This resolves signals to arguments or `sig` instructions.
-        let signal_values: HashMap<SignalRef, llhd::ir::Value> = values
-            .iter()
-            .flat_map(|(&v, s)| match s {
-                &ValueSlot::Signal(s) => Some((s, v)),
-                _ => None,
-            })
-            .collect();
-
-        // Create the unit instance.
         self.insts.push(Instance {
-            values,
+            values: HashMap::new(),
+            consts: template.consts.clone(),
+            offsets: template.offsets.clone(),
             kind,
             state: InstanceState::Ready,
             signals,
-            signal_values,
+            signal_values: template.values.clone(),
+            block_counts: vec![],
         })
     }
 
     /// Consume the builder and assemble the simulation state.
-    pub fn finish(self) -> State<'ll> {
+    pub fn finish(mut self) -> State<'ll> {
+        let mut scope = self.scope_stack.remove(0);
+        self.resolve_aliases(&mut scope);
         State {
             module: self.module,
             signals: self.signals,
             probes: self.probes,
-            scope: self.scope_stack.into_iter().next().unwrap(),
+            inputs: self.inputs,
+            delays: self.delays,
+            scope,
             insts: self.insts.into_iter().map(Mutex::new).collect(),
             time: TimeValue::new(num::zero(), 0, 0),
+            changed_elements: Default::default(),
+            halted: Default::default(),
             events: Default::default(),
             timed: Default::default(),
         }
     }
 
+    /// Replace every signal connected with `con` by the signal that represents
+    /// it, such that the connected signals share one storage slot.
+    ///
+    /// The signals that are no longer referenced remain allocated, but are
+    /// never read or written.
+    fn resolve_aliases(&mut self, scope: &mut Scope) {
+        let num_signals = self.signals.len();
+        let roots: Vec<_> = (0..num_signals)
+            .map(|i| self.find_alias(SignalRef::new(i)))
+            .collect();
+        if roots.iter().enumerate().all(|(i, s)| s.as_usize() == i) {
+            return;
+        }
+        let map = |s: &mut SignalRef| *s = roots[s.as_usize()];
+
+        // The instances keep one entry per declared signal, such that their
+        // offsets stay valid. Connected signals thus simply appear twice.
+        for inst in &mut self.insts {
+            inst.signals.iter_mut().for_each(map);
+        }
+        self.inputs.iter_mut().for_each(map);
+        let mut delays: HashMap<_, Vec<_>> = HashMap::new();
+        for (mut source, mut targets) in self.delays.drain() {
+            map(&mut source);
+            targets.iter_mut().for_each(|(t, _)| map(t));
+            delays.entry(source).or_default().extend(targets);
+        }
+        self.delays = delays;
+        self.probes = merge_probes(std::mem::take(&mut self.probes), &map);
+        scope.map_probes(&|probes| merge_probes(probes, &map));
+    }
+
     /// Push a new scope onto the stack.
     fn push_scope(&mut self, name: impl Into<String>) {
         self.scope_stack.push(Scope::new(name));
@@ -215,57 +291,208 @@ impl<'ll> Builder<'ll> {
         let scope = self.scope_stack.pop().unwrap();
         self.scope_stack.last_mut().unwrap().add_subscope(scope);
     }
+}
+
+/// The elaboration plan of a unit.
+///
+/// Everything that can be determined from the unit alone is computed once per
+/// unit, such that instantiating the unit repeatedly only needs to stamp out
+/// the template.
+struct Template<'ll> {
+    /// The argument values of the unit, inputs first, with their names.
+    args: Vec<(llhd::ir::Value, Option<Arc<str>>)>,
+    /// The signals declared in the unit, with their type, initial value, and
+    /// name.
+    signals: Vec<(llhd::ir::Value, llhd::Type, Value, Option<Arc<str>>)>,
+    /// The arguments followed by the declared signals, in the order in which
+    /// an instance lists the signals they carry.
+    values: Arc<Vec<llhd::ir::Value>>,
+    /// The position of each of `values`, shared among all instances to look
+    /// up the signal a value carries.
+    offsets: Arc<HashMap<llhd::ir::Value, usize>>,
+    /// The constants that are made available to the unit's instructions,
+    /// shared among all instances of the unit.
+    consts: Arc<HashMap<llhd::ir::Value, ValueSlot>>,
+    /// The subunits instantiated by the unit.
+    insts: Vec<SubInstance<'ll>>,
+    /// The pairs of signals connected with `con`.
+    cons: Vec<(llhd::ir::Value, llhd::ir::Value)>,
+    /// The signals driven by another signal with `del`, as target, source,
+    /// and delay.
+    dels: Vec<(llhd::ir::Value, llhd::ir::Value, TimeValue)>,
+}
+
+/// A subunit instantiated by a unit.
+struct SubInstance<'ll> {
+    name: String,
+    unit: llhd::ir::Unit<'ll>,
+    inputs: Vec<llhd::ir::Value>,
+    outputs: Vec<llhd::ir::Value>,
+}
 
-    /// Map an LLHD value to a constant value.
+impl<'ll> Template<'ll> {
+    /// Create the template for a process or entity.
     ///
-    /// This is useful for initializing the value of variables and signals.
-    fn const_value(&self, unit: llhd::ir::Unit, value: llhd::ir::Value) -> Value {
+    /// Fails if the unit uses a `del` whose delay is not a constant time.
+    fn new(module: &'ll llhd::ir::Module, unit: llhd::ir::Unit<'ll>) -> Result<Self> {
         use llhd::ir::Opcode;
-        let ty = unit.value_type(value);
-        let inst = unit.value_inst(value);
-        let data = &unit[inst];
-        match data.opcode() {
-            Opcode::ConstInt => IntValue::from_signed(
-                ty.unwrap_int(),
-                data.get_const_int()
-                    .unwrap()
-                    .value
-                    .to_bigint()
-                    .unwrap()
-                    .clone(),
-            )
-            .into(),
-            Opcode::ConstTime => data.get_const_time().unwrap().clone().into(),
-            Opcode::ArrayUniform => {
-                ArrayValue::new_uniform(data.imms()[0], self.const_value(unit, data.args()[0]))
-                    .into()
+        let name = |value| unit.get_name(value).map(Arc::<str>::from);
+        let args = unit
+            .sig()
+            .inputs()
+            .chain(unit.sig().outputs())
+            .map(|arg| {
+                let value = unit.arg_value(arg);
+                (value, name(value))
+            })
+            .collect();
+        let mut template = Template {
+            args,
+            signals: vec![],
+            values: Default::default(),
+            offsets: Default::default(),
+            consts: Default::default(),
+            insts: vec![],
+            cons: vec![],
+            dels: vec![],
+        };
+        let mut consts = HashMap::new();
+        let signal = |inst: llhd::ir::Inst| {
+            let value = unit.inst_result(inst);
+            let init = const_value(unit, unit[inst].args()[0]);
+            (value, unit.value_type(value), init, name(value))
+        };
+
+        if unit.is_process() {
+            for block in unit.blocks() {
+                for inst in unit.insts(block) {
+                    match unit[inst].opcode() {
+                        Opcode::Sig => template.signals.push(signal(inst)),
+                        // Hotfix for const insts in moore output not dominating their uses
+                        Opcode::ConstInt | Opcode::ConstTime => {
+                            let value = unit.inst_result(inst);
+                            consts.insert(value, ValueSlot::Const(const_value(unit, value)));
+                        }
+                        _ => (),
+                    }
+                }
+            }
+        } else {
+            for inst in unit.all_insts() {
+                match unit[inst].opcode() {
+                    Opcode::Sig => template.signals.push(signal(inst)),
+                    Opcode::Inst => {
+                        let ext_unit = unit[inst].get_ext_unit().unwrap();
+                        let name = &unit[ext_unit].name;
+                        let subunit = match module.lookup_ext_unit(ext_unit, unit.id()) {
+                            Some(llhd::ir::LinkedUnit::Def(s)) => s,
+                            _ => panic!("external unit {} not linked", name),
+                        };
+                        template.insts.push(SubInstance {
+                            name: name.to_string(),
+                            unit: module.unit(subunit),
+                            inputs: unit[inst].input_args().to_vec(),
+                            outputs: unit[inst].output_args().to_vec(),
+                        });
+                    }
+                    Opcode::Con => {
+                        let args = unit[inst].args();
+                        template.cons.push((args[0], args[1]));
+                    }
+                    Opcode::Del => {
+                        let args = unit[inst].args();
+                        let delay = match unit.get_const_time(args[2]) {
+                            Some(delay) => delay.clone(),
+                            None => bail!(
+                                "del in {} has non-constant delay {}",
+                                unit.name(),
+                                args[2].dump(&unit)
+                            ),
+                        };
+                        template.dels.push((args[0], args[1], delay));
+                    }
+                    Opcode::ConstInt | Opcode::ConstTime => {
+                        let value = unit.inst_result(inst);
+                        consts.insert(value, ValueSlot::Const(const_value(unit, value)));
+                    }
+                    _ => (),
+                }
             }
-            Opcode::Array => ArrayValue::new(
-                data.args()
-                    .iter()
-                    .map(|&arg| self.const_value(unit, arg))
-                    .collect(),
-            )
-            .into(),
-            Opcode::Struct => StructValue::new(
-                data.args()
-                    .iter()
-                    .map(|&arg| self.const_value(unit, arg))
-                    .collect(),
-            )
-            .into(),
-            _ => panic!(
-                "{} cannot be turned into a constant ({})",
-                data.opcode(),
-                inst.dump(&unit)
-            ),
         }
+        template.consts = Arc::new(consts);
+        let values: Vec<_> = template
+            .args
+            .iter()
+            .map(|&(v, _)| v)
+            .chain(template.signals.iter().map(|&(v, ..)| v))
+            .collect();
+        template.offsets = Arc::new(values.iter().enumerate().map(|(i, &v)| (v, i)).collect());
+        template.values = Arc::new(values);
+        Ok(template)
+    }
+}
+
+/// Rename the signals of a probe table, merging the names of signals that are
+/// renamed to the same signal.
+///
+/// The merged names are sorted, such that the tracers pick the same name for
+/// connected signals in every run.
+fn merge_probes(
+    probes: HashMap<SignalRef, Vec<Arc<str>>>,
+    map: &impl Fn(&mut SignalRef),
+) -> HashMap<SignalRef, Vec<Arc<str>>> {
+    let mut merged: HashMap<_, Vec<_>> = HashMap::new();
+    for (mut signal, names) in probes {
+        map(&mut signal);
+        merged.entry(signal).or_default().extend(names);
+    }
+    for names in merged.values_mut() {
+        names.sort();
+    }
+    merged
+}
+
+/// Map an LLHD value to a constant value.
+///
+/// This is useful for initializing the value of variables and signals.
+fn const_value(unit: llhd::ir::Unit, value: llhd::ir::Value) -> Value {
+    use llhd::ir::Opcode;
+    let ty = unit.value_type(value);
+    let inst = unit.value_inst(value);
+    let data = &unit[inst];
+    match data.opcode() {
+        Opcode::ConstInt => IntValue::from_packed(data.get_const_int().unwrap().to_packed()).into(),
+        Opcode::ConstTime => data.get_const_time().unwrap().clone().into(),
+        Opcode::ArrayUniform => {
+            Value::uniform_array(data.imms()[0], const_value(unit, data.args()[0]))
+        }
+        Opcode::Array => ArrayValue::new(
+            data.args()
+                .iter()
+                .map(|&arg| const_value(unit, arg))
+                .collect(),
+        )
+        .into(),
+        Opcode::Struct => StructValue::new(
+            data.args()
+                .iter()
+                .map(|&arg| const_value(unit, arg))
+                .collect(),
+        )
+        .into(),
+        _ => panic!(
+            "{} cannot be turned into a constant ({})",
+            data.opcode(),
+            inst.dump(&unit)
+        ),
     }
 }
 
 /// Build the simulation for a module.
-pub fn build(module: &llhd::ir::Module) -> Result<State> {
-    let mut builder = Builder::new(module);
+///
+/// If `four_state` is set, the top-level ports are initialized to `X`.
+pub fn build(module: &llhd::ir::Module, four_state: bool) -> Result<State> {
+    let mut builder = Builder::new(module)?;
 
     // Find the last process or entity in the module, which we will use as the
     // simulation's root unit.
@@ -280,7 +507,7 @@ pub fn build(module: &llhd::ir::Module) -> Result<State> {
     info!("Found simulation root: {}", root.name());
 
     // Build the simulation for this root module.
-    builder.build_root(root);
+    builder.build_root(root, four_state);
 
     // Build the simulation state.
     Ok(builder.finish())
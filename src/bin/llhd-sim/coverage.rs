@@ -0,0 +1,110 @@
+// Copyright (c) 2017-2021 Fabian Schuiki
+
+//! Coverage collection
+//!
+//! Toggle coverage is tracked for every probed integer or logic signal as a
+//! pair of bitmaps, which the engine updates whenever it applies a change to
+//! the signal. Block coverage is tracked as per-instance counters of how often
+//! each block of a process was entered.
+
+use crate::{
+    state::{InstanceKind, SignalRef, State},
+    value::{LogicValue, Value},
+};
+use llhd::{
+    cov::{Database, Toggles},
+    table::TableKey,
+};
+use std::collections::HashMap;
+
+/// The coverage collected during a simulation.
+pub struct Coverage {
+    toggles: HashMap<SignalRef, Toggles>,
+    /// A mask with all bits known, as wide as the widest signal, used for
+    /// changes between two-state values.
+    known: Vec<u64>,
+}
+
+impl Coverage {
+    /// Prepare coverage collection for a simulation.
+    ///
+    /// Allocates the toggle bitmaps for all probed signals, and the block
+    /// counters of all process instances.
+    pub fn new(state: &mut State) -> Self {
+        let mut toggles = HashMap::new();
+        let mut max_width = 0;
+        for &signal in state.probes.keys() {
+            if let llhd::IntType(width) = **state[signal].ty().unwrap_signal() {
+                toggles.insert(signal, Toggles::new(width));
+                max_width = max_width.max(width);
+            }
+        }
+        for inst in &mut state.insts {
+            let inst = inst.get_mut().unwrap();
+            if let InstanceKind::Process { prok, .. } = inst.kind {
+                let num_blocks = prok.blocks().map(|bb| bb.index() + 1).max().unwrap_or(0);
+                inst.block_counts = vec![0; num_blocks];
+            }
+        }
+        Self {
+            toggles,
+            known: vec![!0; (max_width + 63) / 64],
+        }
+    }
+
+    /// Record the change of a signal from `old` to `new`.
+    pub fn toggle(&mut self, signal: SignalRef, old: &Value, new: &Value) {
+        let toggles = match self.toggles.get_mut(&signal) {
+            Some(t) => t,
+            None => return,
+        };
+        match (old, new) {
+            // Two-state values are fully known, so their limbs can be
+            // compared directly without converting them.
+            (Value::Int(old), Value::Int(new)) => {
+                toggles.update(old.value.limbs(), new.value.limbs(), &self.known);
+                return;
+            }
+            (Value::Int(_), Value::Logic(_))
+            | (Value::Logic(_), Value::Int(_))
+            | (Value::Logic(_), Value::Logic(_)) => (),
+            _ => return,
+        }
+        let old = LogicValue::from_value(old);
+        let new = LogicValue::from_value(new);
+        let known: Vec<u64> = old
+            .unknown
+            .iter()
+            .zip(&new.unknown)
+            .map(|(a, b)| !(a | b))
+            .collect();
+        toggles.update(&old.value, &new.value, &known);
+    }
+
+    /// Assemble the coverage database at the end of the simulation.
+    pub fn finish(self, state: &State) -> Database {
+        let mut db = Database::default();
+        for (signal, path) in state.scope.probe_paths() {
+            if let Some(toggles) = self.toggles.get(&signal) {
+                db.toggles.insert(path, toggles.clone());
+            }
+        }
+        for inst in &state.insts {
+            let inst = inst.lock().unwrap();
+            let prok = match inst.kind {
+                InstanceKind::Process { prok, .. } => prok,
+                InstanceKind::Entity { .. } => continue,
+            };
+            for bb in prok.blocks() {
+                let name = match prok.get_block_name(bb) {
+                    Some(name) => format!("{}.{}", prok.name(), name),
+                    None => format!("{}.{}", prok.name(), bb),
+                };
+                let count = inst.block_counts[bb.index()];
+                let entry = db.blocks.entry(name).or_insert(0);
+                *entry = entry.saturating_add(count);
+            }
+        }
+        db
+    }
+}
@@ -7,18 +7,24 @@
 #![allow(dead_code, unused_variables, unused_imports)]
 
 use crate::{
+    coverage::Coverage,
     state::{
         Event, Instance, InstanceKind, InstanceRef, InstanceState, Signal, SignalRef, State,
         TimedInstance, ValuePointer, ValueSelect, ValueSlice, ValueSlot, ValueTarget,
     },
+    stimulus::Stimulus,
     tracer::Tracer,
-    value::{ArrayValue, IntValue, StructValue, TimeValue, Value},
+    value::{ArrayValue, IntValue, LogicValue, StructValue, TimeValue, Value},
+};
+use anyhow::Result;
+use llhd::{
+    ir::{Opcode, Unit},
+    table::TableKey,
 };
-use llhd::ir::{Opcode, Unit};
 use num::{bigint::ToBigInt, BigInt, BigUint, One, ToPrimitive};
 use rayon::prelude::*;
 use std::{
-    borrow::BorrowMut,
+    borrow::{BorrowMut, Cow},
     collections::VecDeque,
     collections::{HashMap, HashSet},
 };
@@ -28,6 +34,9 @@ pub struct Engine<'ts, 'tm: 'ts> {
     state: &'ts mut State<'tm>,
     parallelize: bool,
     last_heartbeat: std::time::SystemTime,
+    stimulus: Option<Stimulus>,
+    coverage: Option<Coverage>,
+    horizon: Option<TimeValue>,
 }
 
 impl<'ts, 'tm> Engine<'ts, 'tm> {
@@ -38,26 +47,83 @@ impl<'ts, 'tm> Engine<'ts, 'tm> {
             state,
             parallelize,
             last_heartbeat: std::time::UNIX_EPOCH,
+            stimulus: None,
+            coverage: None,
+            horizon: None,
+        }
+    }
+
+    /// Collect toggle and block coverage during the simulation.
+    pub fn enable_coverage(&mut self) {
+        self.coverage = Some(Coverage::new(self.state));
+    }
+
+    /// Stop collecting coverage and return the coverage collected so far.
+    pub fn take_coverage(&mut self) -> Option<Coverage> {
+        self.coverage.take()
+    }
+
+    /// Create an engine to continue a simulation that has already performed
+    /// `step` steps, for example on a forked state.
+    pub fn resume(state: &'ts mut State<'tm>, parallelize: bool, step: usize) -> Engine<'ts, 'tm> {
+        Engine {
+            step,
+            ..Engine::new(state, parallelize)
         }
     }
 
+    /// Get the number of steps performed so far.
+    pub fn steps(&self) -> usize {
+        self.step
+    }
+
+    /// Drive the top-level inputs from a recorded stimulus.
+    pub fn set_stimulus(&mut self, stimulus: Stimulus) {
+        self.stimulus = Some(stimulus);
+    }
+
     /// Run the simulation to completion.
-    pub fn run(&mut self, tracer: &mut dyn Tracer, until_step: Option<usize>) {
+    ///
+    /// Fails if the stimulus cannot be read.
+    pub fn run(&mut self, tracer: &mut dyn Tracer, until_step: Option<usize>) -> Result<()> {
+        self.schedule_stimulus()?;
         if let Some(until_step) = until_step {
-            while self.step < until_step && self.step(tracer) {}
+            while self.step < until_step && self.step(tracer)? {}
         } else {
-            while self.step(tracer) {}
+            while self.step(tracer)? {}
         }
-        println!(
+        eprintln!(
             "\rSimulating -- {} (#{})\x1b[0K",
             self.state.time, self.step
         );
+        Ok(())
+    }
+
+    /// Run the simulation up to a point in time.
+    ///
+    /// Stops before any events at `time` are applied, or once the simulation
+    /// reaches the step limit. Stimulus recorded at or after `time` is not
+    /// read, and the simulation does not advance past `time` even if nothing
+    /// happens there, such that the state can be forked exactly at `time`.
+    pub fn run_until(
+        &mut self,
+        tracer: &mut dyn Tracer,
+        until_step: Option<usize>,
+        time: &TimeValue,
+    ) -> Result<()> {
+        self.horizon = Some(time.clone());
+        self.schedule_stimulus()?;
+        while self.state.time < *time
+            && until_step.map(|s| self.step < s).unwrap_or(true)
+            && self.step(tracer)?
+        {}
+        Ok(())
     }
 
     /// Perform one simulation step. Returns true if there are remaining events
     /// in the queue, false otherwise. This can be used as an indication as to
-    /// when the simulation is finished.
-    pub fn step(&mut self, tracer: &mut dyn Tracer) -> bool {
+    /// when the simulation is finished. Fails if the stimulus cannot be read.
+    pub fn step(&mut self, tracer: &mut dyn Tracer) -> Result<bool> {
         info!("STEP {}: {}", self.step, self.state.time);
         let now = std::time::SystemTime::now();
         if now
@@ -67,11 +133,11 @@ impl<'ts, 'tm> Engine<'ts, 'tm> {
             > 250
         {
             use std::io::Write;
-            print!(
+            eprint!(
                 "\rSimulating -- {} (#{})\x1b[0K",
                 self.state.time, self.step
             );
-            let _ = std::io::stdout().flush();
+            let _ = std::io::stderr().flush();
             self.last_heartbeat = now;
         }
         let first = self.step == 0;
@@ -79,32 +145,78 @@ impl<'ts, 'tm> Engine<'ts, 'tm> {
 
         // Apply events at this time, note changed signals.
         let mut changed_signals = HashSet::new();
+        let mut wholly_changed = HashSet::new();
+        self.state.changed_elements.clear();
         for (signal, value) in self.state.take_next_events() {
-            // Determine the current state of all targeted signals.
-            let signals = signal.0.iter().map(|s| s.target.unwrap_signal());
-            let mut modified: Vec<_> = signals
-                .clone()
-                .map(|sig| self.state[sig].value().clone())
-                .collect();
-            for sig in signals.clone() {
+            for (off, slice) in signal.offset_slices() {
+                let sig = slice.target.unwrap_signal();
                 trace!("Event: {}", self.state.probes[&sig][0]);
-            }
-
-            // Modify the signals.
-            let old = modified.clone();
-            write_pointer(&signal, &mut modified, &value);
+                let subvalue = pointer_subvalue(off, slice, &value);
+
+                // Writes to individual elements of a memory are applied in
+                // place, such that only the element is compared and reported
+                // as changed.
+                if let (Value::Memory(memory), Some(&ValueSelect::Field(index))) = (
+                    self.state.signals[sig.as_usize()].value_mut(),
+                    slice.select.first(),
+                ) {
+                    let old = memory.extract_field(index);
+                    let mut modified = old.clone();
+                    write_pointer_select(&slice.select[1..], &mut modified, subvalue);
+                    if modified != old {
+                        debug!(
+                            "Change {}[{}] {} -> {}",
+                            self.state.probes[&sig][0], index, old, modified
+                        );
+                        memory.insert_field(index, &modified);
+                        changed_signals.insert(sig);
+                        self.state
+                            .changed_elements
+                            .entry(sig)
+                            .or_insert_with(Vec::new)
+                            .push(index);
+                    }
+                    continue;
+                }
 
-            // Store the modified state back.
-            for ((sig, modified), old) in signals.zip(modified.into_iter()).zip(old.into_iter()) {
-                if self.state[sig].set_value(modified.clone()) && modified != old {
-                    changed_signals.insert(sig);
+                // Otherwise modify a copy of the signal and store it back.
+                let mut modified = self.state[sig].value().clone();
+                write_pointer_slice(slice, &mut modified, subvalue);
+                if modified != *self.state[sig].value() {
                     debug!(
                         "Change {} {} -> {}",
-                        self.state.probes[&sig][0], old, modified
+                        self.state.probes[&sig][0],
+                        self.state[sig].value(),
+                        modified
                     );
+                    if let Some(ref mut coverage) = self.coverage {
+                        coverage.toggle(sig, self.state[sig].value(), &modified);
+                    }
+                    self.state[sig].set_value(modified);
+                    changed_signals.insert(sig);
+                    wholly_changed.insert(sig);
                 }
             }
         }
+        for sig in wholly_changed {
+            self.state.changed_elements.remove(&sig);
+        }
+
+        // Forward the changes of signals that drive others through a `del`,
+        // including their initial values in the first step.
+        let mut forwarded = Vec::new();
+        if first {
+            for &source in self.state.delays.keys() {
+                self.forward_delays(source, &mut forwarded);
+            }
+        } else {
+            for &source in &changed_signals {
+                self.forward_delays(source, &mut forwarded);
+            }
+        }
+        if !forwarded.is_empty() {
+            self.state.schedule_events(forwarded.into_iter());
+        }
 
         // Wake up units whose timed wait has run out.
         for inst in self.state.take_next_timed() {
@@ -169,31 +281,87 @@ impl<'ts, 'tm> Engine<'ts, 'tm> {
         self.state.schedule_events(events.into_iter());
 
         // Gather a list of instances that perform a timed wait and schedule
-        // them as to be woken up.
-        let timed: Vec<_> = ready_insts
-            .iter()
-            .filter_map(
-                |index| match self.state.insts[*index].lock().unwrap().state {
-                    InstanceState::Wait(Some(ref time), _) => Some(TimedInstance {
-                        time: time.clone(),
-                        inst: InstanceRef::new(*index),
-                    }),
-                    _ => None,
-                },
-            )
-            .collect();
+        // them as to be woken up, and note the ones that halted.
+        let mut timed = vec![];
+        self.state.halted.clear();
+        for &index in &ready_insts {
+            match self.state.insts[index].lock().unwrap().state {
+                InstanceState::Wait(Some(ref time), _) => timed.push(TimedInstance {
+                    time: time.clone(),
+                    inst: InstanceRef::new(index),
+                }),
+                InstanceState::Done => self.state.halted.push(index),
+                _ => (),
+            }
+        }
         self.state.schedule_timed(timed.into_iter());
-
-        // Advance time to next event or process wake, or finish
-        match self.state.next_time() {
+        self.schedule_stimulus()?;
+
+        // Advance time to next event or process wake, or finish. Never advance
+        // past the horizon.
+        let next_time = match (self.state.next_time(), &self.horizon) {
+            (Some(t), Some(h)) if t > *h => Some(h.clone()),
+            (None, Some(h)) => Some(h.clone()),
+            (t, _) => t,
+        };
+        match next_time {
             Some(t) => {
                 self.state.time = t;
-                true
+                Ok(true)
             }
-            None => false,
+            None => Ok(false),
         }
     }
 
+    /// Create the events that forward the current value of a signal to the
+    /// signals it drives through a `del`, if any.
+    fn forward_delays(&self, source: SignalRef, events: &mut Vec<Event>) {
+        let targets = match self.state.delays.get(&source) {
+            Some(targets) => targets,
+            None => return,
+        };
+        for (target, delay) in targets {
+            events.push(Event {
+                time: self.state.time.after(delay),
+                signal: ValuePointer(vec![ValueSlice {
+                    target: ValueTarget::Signal(*target),
+                    select: vec![],
+                    width: 0,
+                }]),
+                value: self.state[source].value().clone(),
+            });
+        }
+    }
+
+    /// Schedule the stimulus up to and including the next simulation time.
+    ///
+    /// Only the value changes that are due before anything else happens in the
+    /// simulation are pulled from the stimulus, such that the remainder of the
+    /// trace is read lazily. Changes recorded at delta or epsilon steps that
+    /// the simulation has already advanced past are applied immediately.
+    /// Changes at or after the horizon are left in the stimulus.
+    fn schedule_stimulus(&mut self) -> Result<()> {
+        let stimulus = match self.stimulus {
+            Some(ref mut s) => s,
+            None => return Ok(()),
+        };
+        loop {
+            let next_time = self.state.next_time();
+            match (stimulus.peek_time()?, next_time) {
+                (Some(t), _) if self.horizon.as_ref().map(|h| t >= h).unwrap_or(false) => break,
+                (Some(t), Some(ref n)) if t > n => break,
+                (Some(_), _) => (),
+                (None, _) => break,
+            }
+            let mut batch = stimulus.next()?.unwrap();
+            if batch.time < self.state.time {
+                batch.time = self.state.time.clone();
+            }
+            self.state.schedule_events(batch.into_events());
+        }
+        Ok(())
+    }
+
     /// Continue execution of one single process or entity instance, until it is
     /// suspended by an instruction.
     fn step_instance(
@@ -225,9 +393,11 @@ impl<'ts, 'tm> Engine<'ts, 'tm> {
         let mut next_block = block;
         while let Some(block) = next_block {
             next_block = None;
+            if let Some(count) = instance.block_counts.get_mut(block.index()) {
+                *count += 1;
+            }
             for inst in unit.insts(block) {
-                let action =
-                    self.execute_instruction(inst, unit, &instance.values, &self.state.signals);
+                let action = self.execute_instruction(inst, unit, instance, &self.state.signals);
                 match action {
                     Action::None => (),
                     Action::Value(vs) => {
@@ -307,16 +477,18 @@ impl<'ts, 'tm> Engine<'ts, 'tm> {
                 dirty_set.insert(inst);
             }
         } else {
-            for sig in instance
+            for (sig, &value) in instance
                 .signals
                 .iter()
-                .filter(|sig| changed_signals.contains(sig))
+                .zip(instance.signal_values.iter())
+                .filter(|&(sig, _)| changed_signals.contains(sig))
             {
-                let value = instance.signal_values[&sig];
-                trace!("  Triggering {} ({})", self.state.probes[&sig][0], value);
+                trace!("  Triggering {} ({:?})", self.state.probes[&sig][0], value);
                 for &inst in unit.uses(value) {
                     match unit[inst].opcode() {
-                        Opcode::Drv | Opcode::Inst | Opcode::Sig => continue,
+                        Opcode::Drv | Opcode::Inst | Opcode::Sig | Opcode::Con | Opcode::Del => {
+                            continue
+                        }
                         _ => (),
                     }
                     trace!("    -> {}", inst.dump(&unit));
@@ -333,8 +505,7 @@ impl<'ts, 'tm> Engine<'ts, 'tm> {
         // instructions to the set.
         while let Some(inst) = dirty.pop_front() {
             dirty_set.remove(&inst);
-            let action =
-                self.execute_instruction(inst, unit, &instance.values, &self.state.signals);
+            let action = self.execute_instruction(inst, unit, instance, &self.state.signals);
             match action {
                 Action::None => (),
                 Action::Value(new) => {
@@ -382,12 +553,15 @@ impl<'ts, 'tm> Engine<'ts, 'tm> {
         &self,
         inst: llhd::ir::Inst,
         unit: llhd::ir::Unit,
-        values: &HashMap<llhd::ir::Value, ValueSlot>,
+        instance: &Instance,
         signals: &[Signal],
     ) -> Action {
         InstContext {
             unit,
-            values,
+            values: &instance.values,
+            consts: &instance.consts,
+            offsets: &instance.offsets,
+            inst_signals: &instance.signals,
             signals,
             time: &self.state.time,
         }
@@ -398,6 +572,9 @@ impl<'ts, 'tm> Engine<'ts, 'tm> {
 struct InstContext<'a> {
     unit: llhd::ir::Unit<'a>,
     values: &'a HashMap<llhd::ir::Value, ValueSlot>,
+    consts: &'a HashMap<llhd::ir::Value, ValueSlot>,
+    offsets: &'a HashMap<llhd::ir::Value, usize>,
+    inst_signals: &'a [SignalRef],
     signals: &'a [Signal],
     time: &'a TimeValue,
 }
@@ -415,17 +592,17 @@ impl<'a> InstContext<'a> {
         }
 
         match data.opcode() {
+            // Constants shared among all instances of the unit are already
+            // known.
+            Opcode::ConstInt | Opcode::ConstTime
+                if self.consts.contains_key(&self.unit.inst_result(inst)) =>
+            {
+                Action::None
+            }
+
             // Constants
             Opcode::ConstInt => {
-                let v = IntValue::from_signed(
-                    ty.unwrap_int(),
-                    data.get_const_int()
-                        .unwrap()
-                        .value
-                        .to_bigint()
-                        .unwrap()
-                        .clone(),
-                );
+                let v = IntValue::from_packed(data.get_const_int().unwrap().to_packed());
                 Action::Value(ValueSlot::Const(v.into()))
             }
             Opcode::ConstTime => {
@@ -435,14 +612,17 @@ impl<'a> InstContext<'a> {
 
             // Aggregates
             Opcode::ArrayUniform => {
-                let v = ArrayValue::new_uniform(data.imms()[0], self.resolve_value(data.args()[0]));
-                Action::Value(ValueSlot::Const(v.into()))
+                let v = Value::uniform_array(
+                    data.imms()[0],
+                    self.resolve_value(data.args()[0]).clone(),
+                );
+                Action::Value(ValueSlot::Const(v))
             }
             Opcode::Array => {
                 let vs = data
                     .args()
                     .iter()
-                    .map(|&arg| self.resolve_value(arg))
+                    .map(|&arg| self.resolve_value(arg).clone())
                     .collect();
                 let v = ArrayValue::new(vs);
                 Action::Value(ValueSlot::Const(v.into()))
@@ -451,20 +631,23 @@ impl<'a> InstContext<'a> {
                 let vs = data
                     .args()
                     .iter()
-                    .map(|&arg| self.resolve_value(arg))
+                    .map(|&arg| self.resolve_value(arg).clone())
                     .collect();
                 let v = StructValue::new(vs);
                 Action::Value(ValueSlot::Const(v.into()))
             }
 
             // Alias
-            Opcode::Alias => Action::Value(ValueSlot::Const(self.resolve_value(data.args()[0]))),
+            Opcode::Alias => {
+                Action::Value(ValueSlot::Const(self.resolve_value(data.args()[0]).clone()))
+            }
 
             // Branches
             Opcode::Br => Action::Jump(data.blocks()[0]),
             Opcode::BrCond => {
+                // An unknown condition is treated as false.
                 let cond = self.resolve_value(data.args()[0]);
-                if cond.is_zero() {
+                if cond.is_zero() || cond.get_logic().is_some() {
                     Action::Jump(data.blocks()[0])
                 } else {
                     Action::Jump(data.blocks()[1])
@@ -493,14 +676,16 @@ impl<'a> InstContext<'a> {
             }
 
             // Memory
-            Opcode::Var => Action::Value(ValueSlot::Variable(self.resolve_value(data.args()[0]))),
+            Opcode::Var => Action::Value(ValueSlot::Variable(
+                self.resolve_value(data.args()[0]).clone(),
+            )),
             Opcode::Ld => {
                 let ptr = self.resolve_variable_pointer(data.args()[0]);
                 Action::Value(ValueSlot::Const(self.read_pointer(&ty, &ptr)))
             }
             Opcode::St => {
                 let ptr = self.resolve_variable_pointer(data.args()[0]);
-                let value = self.resolve_value(data.args()[1]);
+                let value = self.resolve_value(data.args()[1]).clone();
                 Action::Store(ptr, value)
             }
 
@@ -515,7 +700,7 @@ impl<'a> InstContext<'a> {
                 let ev = Event {
                     time: self.time_after_delay(&delay),
                     signal: self.resolve_signal_pointer(data.args()[0]),
-                    value: self.resolve_value(data.args()[1]),
+                    value: self.resolve_value(data.args()[1]).clone(),
                 };
                 Action::Event(ev)
             }
@@ -524,6 +709,10 @@ impl<'a> InstContext<'a> {
             Opcode::Not | Opcode::Neg => {
                 if ty.is_int() {
                     let arg = self.resolve_value(data.args()[0]);
+                    if let Value::Logic(arg) = arg {
+                        let v = LogicValue::unary_op(data.opcode(), arg);
+                        return Action::Value(ValueSlot::Const(v.into_value()));
+                    }
                     let arg = arg.unwrap_int();
                     let v = IntValue::unary_op(data.opcode(), arg);
                     Action::Value(ValueSlot::Const(v.into()))
@@ -549,6 +738,12 @@ impl<'a> InstContext<'a> {
                 if ty.is_int() {
                     let lhs = self.resolve_value(data.args()[0]);
                     let rhs = self.resolve_value(data.args()[1]);
+                    if lhs.get_logic().is_some() || rhs.get_logic().is_some() {
+                        let lhs = LogicValue::from_value(lhs);
+                        let rhs = LogicValue::from_value(rhs);
+                        let v = LogicValue::binary_op(data.opcode(), &lhs, &rhs);
+                        return Action::Value(ValueSlot::Const(v.into_value()));
+                    }
                     let lhs = lhs.unwrap_int();
                     let rhs = rhs.unwrap_int();
                     let v = IntValue::binary_op(data.opcode(), lhs, rhs);
@@ -572,6 +767,12 @@ impl<'a> InstContext<'a> {
                 if ty.is_int() {
                     let lhs = self.resolve_value(data.args()[0]);
                     let rhs = self.resolve_value(data.args()[1]);
+                    if lhs.get_logic().is_some() || rhs.get_logic().is_some() {
+                        let lhs = LogicValue::from_value(lhs);
+                        let rhs = LogicValue::from_value(rhs);
+                        let v = LogicValue::compare_op(data.opcode(), &lhs, &rhs);
+                        return Action::Value(ValueSlot::Const(v.into_value()));
+                    }
                     let lhs = lhs.unwrap_int();
                     let rhs = rhs.unwrap_int();
                     let v = IntValue::compare_op(data.opcode(), lhs, rhs);
@@ -599,8 +800,18 @@ impl<'a> InstContext<'a> {
                         self.resolve_value_pointer(data.args()[1]),
                     )
                 };
-                let amount = self.resolve_value(data.args()[2]);
-                let ptr = self.exec_shift(data.opcode(), &base, &hidden, &amount);
+                // A shift by an unknown amount yields an unknown value. There
+                // is no unknown signal or variable, so those are shifted as
+                // if by the full amount.
+                let amount = match self.resolve_value(data.args()[2]) {
+                    Value::Logic(v) => match v.to_int() {
+                        Some(v) => v.to_usize(),
+                        None if ty.is_pointer() || ty.is_signal() => hidden.width(),
+                        None => return Action::Value(ValueSlot::Const(Value::unknown(&ty))),
+                    },
+                    v => v.unwrap_int().to_usize(),
+                };
+                let ptr = self.exec_shift(data.opcode(), &base, &hidden, amount);
                 if ty.is_pointer() {
                     Action::Value(ValueSlot::VariablePointer(ptr))
                 } else if ty.is_signal() {
@@ -616,8 +827,8 @@ impl<'a> InstContext<'a> {
                 let target_ty = self.unit.value_type(data.args()[0]);
                 let value = self.resolve_value(data.args()[1]);
                 let ptr = self.exec_insext(data.opcode(), &target_ty, &target, data.imms());
-                let mut results = [self.resolve_value(data.args()[0])];
-                write_pointer(&ptr, &mut results, &value);
+                let mut results = [self.resolve_value(data.args()[0]).clone()];
+                write_pointer(&ptr, &mut results, value);
                 let [result] = results;
                 Action::Value(ValueSlot::Const(result))
             }
@@ -645,17 +856,38 @@ impl<'a> InstContext<'a> {
                 let ways = self.resolve_value(data.args()[0]);
                 let index = self.resolve_value(data.args()[1]);
                 match ways {
+                    Value::Array(v) if index.get_logic().is_some() => {
+                        let index = index.unwrap_logic();
+                        Action::Value(ValueSlot::Const(index.mux(v)))
+                    }
                     Value::Array(v) => {
                         let index = index.unwrap_int().to_usize();
                         let index = std::cmp::min(v.0.len() - 1, index);
                         Action::Value(ValueSlot::Const(v.extract_field(index)))
                     }
+                    Value::Memory(v) => {
+                        // Merging every element a partially unknown index may
+                        // select is too costly for memories, so the result is
+                        // entirely unknown.
+                        let index = match index {
+                            Value::Logic(index) => index.to_int(),
+                            index => Some(index.unwrap_int().clone()),
+                        };
+                        let value = match index {
+                            Some(index) => {
+                                let index = std::cmp::min(v.length - 1, index.to_usize());
+                                v.extract_field(index)
+                            }
+                            None => LogicValue::unknown(v.width()).into(),
+                        };
+                        Action::Value(ValueSlot::Const(value))
+                    }
                     _ => panic!("mux on {}", ways),
                 }
             }
 
-            // Instantiations are handled by the builder.
-            Opcode::Inst => Action::None,
+            // Instantiations and connections are handled by the builder.
+            Opcode::Inst | Opcode::Con | Opcode::Del => Action::None,
 
             // Halt trivially suspends the process indefinitely.
             Opcode::Halt if self.unit.is_entity() => Action::None,
@@ -667,10 +899,19 @@ impl<'a> InstContext<'a> {
         }
     }
 
+    /// Look up the slot of a value, in the instance's own values or the
+    /// constants of the unit.
+    fn slot(&self, id: llhd::ir::Value) -> Option<&'a ValueSlot> {
+        self.values.get(&id).or_else(|| self.consts.get(&id))
+    }
+
     /// Resolve a value to a constant.
-    fn resolve_value(&self, id: llhd::ir::Value) -> Value {
-        match self.values.get(&id) {
-            Some(ValueSlot::Const(k)) => k.clone(),
+    ///
+    /// The constant is borrowed, such that operands are only copied where the
+    /// instruction actually needs to own them.
+    fn resolve_value(&self, id: llhd::ir::Value) -> &'a Value {
+        match self.slot(id) {
+            Some(ValueSlot::Const(k)) => k,
             x => panic!(
                 "expected value {:?} to resolve to a constant, got {:?}",
                 id, x
@@ -690,20 +931,27 @@ impl<'a> InstContext<'a> {
         }
     }
 
+    /// Look up the signal carried by one of the unit's arguments or declared
+    /// signals.
+    fn carried_signal(&self, id: llhd::ir::Value) -> Option<SignalRef> {
+        self.offsets.get(&id).map(|&i| self.inst_signals[i])
+    }
+
     // Resolve a value to a signal.
     fn resolve_signal(&self, id: llhd::ir::Value) -> SignalRef {
-        match self.values.get(&id) {
-            Some(ValueSlot::Signal(r)) => *r,
-            x => panic!(
+        match self.carried_signal(id) {
+            Some(sig) => sig,
+            None => panic!(
                 "expected value {:?} to resolve to a signal, got {:?}",
-                id, x
+                id,
+                self.slot(id)
             ),
         }
     }
 
     // Resolve a value to a variable pointer.
     fn resolve_variable_pointer(&self, id: llhd::ir::Value) -> ValuePointer {
-        match self.values.get(&id) {
+        match self.slot(id) {
             Some(ValueSlot::Variable(_)) => ValuePointer(vec![ValueSlice {
                 target: ValueTarget::Variable(id),
                 select: vec![],
@@ -719,12 +967,14 @@ impl<'a> InstContext<'a> {
 
     // Resolve a value to a signal pointer.
     fn resolve_signal_pointer(&self, id: llhd::ir::Value) -> ValuePointer {
-        match self.values.get(&id) {
-            Some(ValueSlot::Signal(sig)) => ValuePointer(vec![ValueSlice {
-                target: ValueTarget::Signal(*sig),
+        if let Some(sig) = self.carried_signal(id) {
+            return ValuePointer(vec![ValueSlice {
+                target: ValueTarget::Signal(sig),
                 select: vec![],
                 width: self.pointer_width(id),
-            }]),
+            }]);
+        }
+        match self.slot(id) {
             Some(ValueSlot::SignalPointer(ref ptr)) => ptr.clone(),
             x => panic!(
                 "expected value {:?} to resolve to a signal pointer, got {:?}",
@@ -773,26 +1023,12 @@ impl<'a> InstContext<'a> {
     /// Calculate the time at which an event occurs, given an optional delay. If
     /// the delay is omitted, the next delta cycle is returned.
     fn time_after_delay(&self, delay: &TimeValue) -> TimeValue {
-        use num::{zero, Zero};
-        let mut time = self.time.time().clone();
-        let mut delta = self.time.delta();
-        let mut epsilon = self.time.epsilon();
-        if !delay.time().is_zero() {
-            time += delay.time();
-            delta = 0;
-            epsilon = 0;
-        }
-        if delay.delta() != 0 {
-            delta += delay.delta();
-            epsilon = 0;
-        }
-        epsilon += delay.epsilon();
-        TimeValue::new(time, delta, epsilon)
+        self.time.after(delay)
     }
 
     /// Calculate the absolute time of the next delta step.
     fn time_after_delta(&self) -> TimeValue {
-        TimeValue::new(self.time.time().clone(), self.time.delta() + 1, 0)
+        self.time.next_delta()
     }
 
     /// Read the target value of a pointer.
@@ -810,6 +1046,17 @@ impl<'a> InstContext<'a> {
         // Otherwise concatenate the results.
         match **ty {
             llhd::IntType(w) => {
+                let results: Vec<_> = results.collect();
+                if results.iter().any(|(r, _)| r.get_logic().is_some()) {
+                    let mut value = LogicValue::zero(w);
+                    let mut offset = 0;
+                    for (result, width) in results {
+                        value.insert_slice(offset, width, &LogicValue::from_value(&result));
+                        offset += width;
+                    }
+                    assert_eq!(offset, w);
+                    return value.into_value();
+                }
                 let mut value = IntValue::from_usize(w, 0);
                 let mut offset = 0;
                 for (result, width) in results {
@@ -819,10 +1066,11 @@ impl<'a> InstContext<'a> {
                 assert_eq!(offset, w);
                 value.into()
             }
+            llhd::ArrayType(..) if ptr.0.len() == 1 => results.next().unwrap().0,
             llhd::ArrayType(w, _) => {
                 let mut values = vec![];
                 for (result, _) in results {
-                    values.extend(result.unwrap_array().0.iter().cloned());
+                    values.extend(result.to_elements());
                 }
                 assert_eq!(values.len(), w);
                 ArrayValue::new(values).into()
@@ -833,40 +1081,47 @@ impl<'a> InstContext<'a> {
     }
 
     /// Read the target value of a pointer slice.
+    ///
+    /// The target is only borrowed, such that only the selected part of it is
+    /// copied.
     pub fn read_pointer_slice(&self, ptr: &ValueSlice) -> Value {
-        let mut value = self.read_pointer_target(ptr.target);
+        let mut value = Cow::Borrowed(self.read_pointer_target(ptr.target));
         for &select in &ptr.select {
-            match select {
-                ValueSelect::Field(idx) => match value {
-                    Value::Array(v) => value = v.extract_field(idx),
-                    Value::Struct(v) => value = v.extract_field(idx),
+            let selected = match select {
+                ValueSelect::Field(idx) => match *value {
+                    Value::Array(ref v) => v.extract_field(idx),
+                    Value::Memory(ref v) => v.extract_field(idx),
+                    Value::Struct(ref v) => v.extract_field(idx),
                     _ => panic!("access field {} in {} ({:?})", idx, value, ptr.target),
                 },
-                ValueSelect::Slice(off, len) => match value {
-                    Value::Int(v) => value = v.extract_slice(off, len).into(),
-                    Value::Array(v) => value = v.extract_slice(off, len).into(),
+                ValueSelect::Slice(off, len) => match *value {
+                    Value::Int(ref v) => v.extract_slice(off, len).into(),
+                    Value::Logic(ref v) => v.extract_slice(off, len).into_value(),
+                    Value::Array(ref v) => v.extract_slice(off, len).into(),
+                    Value::Memory(ref v) => v.extract_slice(off, len),
                     _ => panic!(
                         "access slice {},{} in {} ({:?})",
                         off, len, value, ptr.target
                     ),
                 },
-            }
+            };
+            value = Cow::Owned(selected);
         }
-        value
+        value.into_owned()
     }
 
     /// Read the value of a pointer target.
-    pub fn read_pointer_target(&self, target: ValueTarget) -> Value {
+    pub fn read_pointer_target(&self, target: ValueTarget) -> &'a Value {
         match target {
             ValueTarget::Value(v) => self.resolve_value(v),
             ValueTarget::Variable(v) => match self.values[&v] {
-                ValueSlot::Variable(ref k) => k.clone(),
+                ValueSlot::Variable(ref k) => k,
                 _ => panic!(
                     "pointer target {:?} did not resolve to a variable value",
                     target
                 ),
             },
-            ValueTarget::Signal(v) => self.signals[v.as_usize()].value().clone(),
+            ValueTarget::Signal(v) => self.signals[v.as_usize()].value(),
         }
     }
 
@@ -879,10 +1134,9 @@ impl<'a> InstContext<'a> {
         op: Opcode,
         base: &ValuePointer,
         hidden: &ValuePointer,
-        amount: &Value,
+        amount: usize,
     ) -> ValuePointer {
-        // Map the shift amount to a usize and clamp to the maximum shift.
-        let amount = amount.unwrap_int().to_usize();
+        // Clamp the shift amount to the maximum shift.
         let amount = std::cmp::min(hidden.width(), amount);
 
         // Compute the length of the selected slices from the base and hidden
@@ -1064,26 +1318,31 @@ impl std::fmt::Display for Action {
 /// each of the pointer slices.
 pub fn write_pointer(ptr: &ValuePointer, into: &mut [Value], value: &Value) {
     for (i, (off, s)) in ptr.offset_slices().enumerate() {
-        // Extract the slice of the value that maps to this pointer
-        // slice.
-        let subvalue = if s.width != 0 {
-            match value {
-                Value::Int(v) => v.extract_slice(off, s.width).into(),
-                Value::Array(v) => v.extract_slice(off, s.width).into(),
-                _ => panic!(
-                    "cannot slice {} into {},{} for write to pointer slice {:?}",
-                    value, off, s.width, s
-                ),
-            }
-        } else {
-            value.clone()
-        };
-
-        // Write to this pointer slice.
+        let subvalue = pointer_subvalue(off, s, value);
         write_pointer_slice(s, &mut into[i], subvalue);
     }
 }
 
+/// Extract the part of a value that maps to a pointer slice.
+///
+/// The `off` is the offset of the slice within the pointer.
+pub fn pointer_subvalue(off: usize, s: &ValueSlice, value: &Value) -> Value {
+    if s.width != 0 {
+        match value {
+            Value::Int(v) => v.extract_slice(off, s.width).into(),
+            Value::Logic(v) => v.extract_slice(off, s.width).into_value(),
+            Value::Array(v) => v.extract_slice(off, s.width).into(),
+            Value::Memory(v) => v.extract_slice(off, s.width),
+            _ => panic!(
+                "cannot slice {} into {},{} for write to pointer slice {:?}",
+                value, off, s.width, s
+            ),
+        }
+    } else {
+        value.clone()
+    }
+}
+
 /// Modify a pointer slice.
 ///
 /// This applies a value to a pointer slice and returns the modified value.
@@ -1103,29 +1362,38 @@ pub fn write_pointer_select(select: &[ValueSelect], into: &mut Value, value: Val
     }
     match select[0] {
         ValueSelect::Field(index) => match into {
-            Value::Array(v) => {
+            Value::Array(v) => write_pointer_select(&select[1..], v.field_mut(index), value),
+            Value::Memory(v) => {
                 let mut sub = v.extract_field(index);
                 write_pointer_select(&select[1..], &mut sub, value);
-                v.insert_field(index, sub);
-            }
-            Value::Struct(v) => {
-                let mut sub = v.extract_field(index);
-                write_pointer_select(&select[1..], &mut sub, value);
-                v.insert_field(index, sub);
+                v.insert_field(index, &sub);
             }
+            Value::Struct(v) => write_pointer_select(&select[1..], v.field_mut(index), value),
             _ => panic!("access field {} in {}", index, into),
         },
         ValueSelect::Slice(offset, length) => match into {
-            Value::Int(ref mut v) => {
+            Value::Int(ref mut v) if value.get_logic().is_none() => {
                 let mut sub = v.extract_slice(offset, length).into();
                 write_pointer_select(&select[1..], &mut sub, value);
                 v.insert_slice(offset, length, sub.unwrap_int());
             }
+            Value::Int(_) | Value::Logic(_) => {
+                let mut v = LogicValue::from_value(into);
+                let mut sub = v.extract_slice(offset, length).into_value();
+                write_pointer_select(&select[1..], &mut sub, value);
+                v.insert_slice(offset, length, &LogicValue::from_value(&sub));
+                *into = v.into_value();
+            }
             Value::Array(v) => {
                 let mut sub = v.extract_slice(offset, length).into();
                 write_pointer_select(&select[1..], &mut sub, value);
                 v.insert_slice(offset, length, sub.unwrap_array());
             }
+            Value::Memory(v) => {
+                let mut sub = v.extract_slice(offset, length);
+                write_pointer_select(&select[1..], &mut sub, value);
+                v.insert_slice(offset, length, &sub);
+            }
             _ => panic!("access slice {},{} in {}", offset, length, into),
         },
     }
@@ -15,8 +15,10 @@ use clap::Arg;
 use std::{fs::File, io::prelude::*};
 
 mod builder;
+mod coverage;
 mod engine;
 mod state;
+mod stimulus;
 pub mod tracer;
 pub mod value;
 
@@ -38,7 +40,7 @@ fn main() -> Result<()> {
                 .short("o")
                 .long("output")
                 .takes_value(true)
-                .help("Trace into an output file"),
+                .help("Trace into an output file, or print a change dump if `-`"),
         )
         .arg(
             Arg::with_name("INPUT")
@@ -46,6 +48,76 @@ fn main() -> Result<()> {
                 .required(true)
                 .index(1),
         )
+        .arg(
+            Arg::with_name("four-state")
+                .short("x")
+                .long("four-state")
+                .help("Initialize top-level ports to X and propagate unknown values"),
+        )
+        .arg(
+            Arg::with_name("stimulus")
+                .long("stimulus")
+                .takes_value(true)
+                .help("Drive the top-level inputs from a recorded trace"),
+        )
+        .arg(
+            Arg::with_name("flight-recorder")
+                .long("flight-recorder")
+                .takes_value(true)
+                .conflicts_with("OUTPUT")
+                .help("Keep only the recent history in memory and write it to a VCD file, or `-` for stdout"),
+        )
+        .arg(
+            Arg::with_name("flight-depth")
+                .long("flight-depth")
+                .takes_value(true)
+                .default_value("1024")
+                .help("Number of value changes per signal kept by the flight recorder"),
+        )
+        .arg(
+            Arg::with_name("flight-window")
+                .long("flight-window")
+                .takes_value(true)
+                .help("Amount of simulated time kept by the flight recorder"),
+        )
+        .arg(
+            Arg::with_name("flight-trigger")
+                .long("flight-trigger")
+                .takes_value(true)
+                .multiple(true)
+                .number_of_values(1)
+                .help("Write the flight recorder history once a signal has a value, as NAME=VALUE"),
+        )
+        .arg(
+            Arg::with_name("flight-halt")
+                .long("flight-halt")
+                .takes_value(true)
+                .multiple(true)
+                .number_of_values(1)
+                .help("Write the flight recorder history once a process halts"),
+        )
+        .arg(
+            Arg::with_name("coverage")
+                .long("coverage")
+                .takes_value(true)
+                .help("Collect toggle and block coverage into a database file"),
+        )
+        .arg(
+            Arg::with_name("fork-at")
+                .long("fork-at")
+                .takes_value(true)
+                .requires("fork")
+                .help("Run until this time, then fork into one simulation per --fork stimulus"),
+        )
+        .arg(
+            Arg::with_name("fork")
+                .long("fork")
+                .takes_value(true)
+                .multiple(true)
+                .number_of_values(1)
+                .requires("fork-at")
+                .help("Stimulus to continue a forked simulation with"),
+        )
         .arg(
             Arg::with_name("num-steps")
                 .short("N")
@@ -80,38 +152,242 @@ fn main() -> Result<()> {
     };
 
     // Build the simulation state for this module.
-    let mut state = builder::build(&module).with_context(|| "failed to initialize simulation")?;
+    let mut state = builder::build(&module, matches.is_present("four-state"))
+        .with_context(|| "failed to initialize simulation")?;
 
     // Create a new tracer for this state that will generate some waveforms.
     let mut tracer: Box<dyn Tracer> = if let Some(tracer_path) = matches.value_of("OUTPUT") {
-        let file = File::create(tracer_path)
-            .with_context(|| format!("failed to create output at {}", tracer_path))?;
-        if tracer_path.ends_with(".vcd") {
-            Box::new(tracer::VcdTracer::new(file))
-        } else if tracer_path.ends_with(".dump") {
-            Box::new(tracer::DumpTracer::new(file))
-        } else {
+        open_tracer(tracer_path)?
+    } else if let Some(path) = matches.value_of("flight-recorder") {
+        if path != "-" && !path.ends_with(".vcd") {
             return Err(anyhow!(
-                "Cannot determine output format from file name `{}`",
-                tracer_path
+                "Flight recorder output `{}` must be a VCD file",
+                path
             ));
         }
+        let depth = matches
+            .value_of("flight-depth")
+            .unwrap()
+            .parse()
+            .context("invalid flight recorder depth")?;
+        let window = match matches.value_of("flight-window") {
+            Some(w) => Some(
+                llhd::assembly::parse_time(w)
+                    .map_err(|e| anyhow!("{}", e))
+                    .with_context(|| format!("invalid flight recorder window `{}`", w))?,
+            ),
+            None => None,
+        };
+        let mut triggers = vec![];
+        for trigger in matches.values_of("flight-trigger").into_iter().flatten() {
+            let mut parts = trigger.splitn(2, '=');
+            let (name, value) = match (parts.next(), parts.next()) {
+                (Some(n), Some(v)) => (n, v),
+                _ => {
+                    return Err(anyhow!(
+                        "Trigger `{}` must be of the form NAME=VALUE",
+                        trigger
+                    ))
+                }
+            };
+            let value = value
+                .parse()
+                .with_context(|| format!("invalid trigger value in `{}`", trigger))?;
+            triggers.push(tracer::Trigger::Value(name.to_string(), value));
+        }
+        for name in matches.values_of("flight-halt").into_iter().flatten() {
+            triggers.push(tracer::Trigger::Halt(name.to_string()));
+        }
+        if path == "-" {
+            let stdout = std::io::stdout();
+            Box::new(tracer::FlightRecorder::new(stdout, depth, window, triggers))
+        } else {
+            let file = File::create(path)
+                .with_context(|| format!("failed to create output at {}", path))?;
+            Box::new(tracer::FlightRecorder::new(file, depth, window, triggers))
+        }
     } else {
         Box::new(tracer::NullTracer)
     };
     tracer.init(&state);
 
-    // Create the simulation engine and run the simulation to completion.
-    {
-        let step_limit = matches
-            .value_of("num-steps")
-            .map(|s| s.parse::<usize>().unwrap());
-        let mut engine = engine::Engine::new(&mut state, !matches.is_present("sequential"));
-        engine.run(&mut *tracer, step_limit);
-    }
+    // Open the stimulus to be replayed, if any.
+    let stimulus = match matches.value_of("stimulus") {
+        Some(path) => Some(
+            stimulus::Stimulus::open(path, &state)
+                .with_context(|| format!("failed to load stimulus from {}", path))?,
+        ),
+        None => None,
+    };
+
+    // Create the simulation engine and run the simulation to completion, or up
+    // to the point where it forks.
+    let step_limit = matches
+        .value_of("num-steps")
+        .map(|s| s.parse::<usize>().unwrap());
+    let parallelize = !matches.is_present("sequential");
+    let fork_at = match matches.value_of("fork-at") {
+        Some(t) => Some(
+            llhd::assembly::parse_time(t)
+                .map_err(|e| anyhow!("{}", e))
+                .with_context(|| format!("invalid fork time `{}`", t))?,
+        ),
+        None => None,
+    };
+    let (coverage, steps) = {
+        let mut engine = engine::Engine::new(&mut state, parallelize);
+        if let Some(stimulus) = stimulus {
+            engine.set_stimulus(stimulus);
+        }
+        if matches.is_present("coverage") {
+            engine.enable_coverage();
+        }
+        match fork_at {
+            Some(ref time) => engine.run_until(&mut *tracer, step_limit, time)?,
+            None => engine.run(&mut *tracer, step_limit)?,
+        }
+        (engine.take_coverage(), engine.steps())
+    };
 
     // Flush the tracer.
     tracer.finish(&state);
 
+    // Write the coverage database.
+    if let Some(coverage) = coverage {
+        write_coverage(coverage, &state, matches.value_of("coverage").unwrap())?;
+    }
+
+    // Continue the simulation in the forks.
+    if fork_at.is_some() {
+        let stimuli: Vec<_> = matches.values_of("fork").unwrap().collect();
+        run_forks(
+            &state,
+            &stimuli,
+            matches.value_of("OUTPUT"),
+            matches.value_of("coverage"),
+            step_limit,
+            steps,
+            parallelize,
+        )?;
+    }
+
+    Ok(())
+}
+
+/// Create a tracer that writes to a file, in the format implied by the file
+/// extension. A path of `-` prints a change dump to stdout.
+fn open_tracer(path: &str) -> Result<Box<dyn Tracer>> {
+    if path == "-" {
+        return Ok(Box::new(tracer::DumpTracer::new(std::io::stdout())));
+    }
+    let file =
+        File::create(path).with_context(|| format!("failed to create output at {}", path))?;
+    if path.ends_with(".vcd") {
+        Ok(Box::new(tracer::VcdTracer::new(file)))
+    } else if path.ends_with(".dump") {
+        Ok(Box::new(tracer::DumpTracer::new(file)))
+    } else {
+        Err(anyhow!(
+            "Cannot determine output format from file name `{}`",
+            path
+        ))
+    }
+}
+
+/// Write the coverage collected during a simulation to a database file.
+fn write_coverage(coverage: coverage::Coverage, state: &state::State, path: &str) -> Result<()> {
+    let file = File::create(path)
+        .with_context(|| format!("failed to create coverage database at {}", path))?;
+    coverage
+        .finish(state)
+        .write(std::io::BufWriter::new(file))
+        .with_context(|| format!("failed to write coverage database to {}", path))?;
+    Ok(())
+}
+
+/// Insert `.fork<N>` before the extension of a file name.
+fn fork_path(path: &str, index: usize) -> String {
+    let (stem, ext) = match path.rfind('.') {
+        Some(i) => path.split_at(i),
+        None => (path, ""),
+    };
+    format!("{}.fork{}{}", stem, index, ext)
+}
+
+/// Continue a simulation in parallel, once for each of a set of stimuli.
+///
+/// Each fork starts from a copy of `state`, which avoids simulating the common
+/// prefix more than once. If an `output` file is given, each fork writes its
+/// trace to a separate file, with `.fork<N>` inserted before the file
+/// extension. If the prefix is traced to stdout, the trace of each fork is
+/// collected in memory and printed after the fork's summary instead, such that
+/// the traces of parallel forks do not interleave. The `coverage` database is
+/// split up like the trace files, where each fork only records the coverage
+/// after the fork, such that `llhd-cov` can merge it with the prefix.
+fn run_forks(
+    state: &state::State,
+    stimuli: &[&str],
+    output: Option<&str>,
+    coverage: Option<&str>,
+    step_limit: Option<usize>,
+    steps: usize,
+    parallelize: bool,
+) -> Result<()> {
+    use rayon::prelude::*;
+    info!("Forking {} simulations at {}", stimuli.len(), state.time);
+    let results: Vec<Result<(String, Vec<u8>)>> = stimuli
+        .par_iter()
+        .enumerate()
+        .map(|(index, &path)| -> Result<(String, Vec<u8>)> {
+            let mut state = state.fork();
+            let stimulus = stimulus::Stimulus::open(path, &state)
+                .with_context(|| format!("failed to load stimulus from {}", path))?;
+            let mut trace = vec![];
+            let (fork_coverage, steps) = {
+                let mut tracer: Box<dyn Tracer + '_> = match output {
+                    Some("-") => Box::new(tracer::DumpTracer::new(&mut trace)),
+                    Some(output) => open_tracer(&fork_path(output, index))?,
+                    None => Box::new(tracer::NullTracer),
+                };
+                tracer.init(&state);
+                let result = {
+                    let mut engine = engine::Engine::resume(&mut state, parallelize, steps);
+                    engine.set_stimulus(stimulus);
+                    if coverage.is_some() {
+                        engine.enable_coverage();
+                    }
+                    engine.run(&mut *tracer, step_limit)?;
+                    (engine.take_coverage(), engine.steps())
+                };
+                tracer.finish(&state);
+                result
+            };
+            if let (Some(fork_coverage), Some(path)) = (fork_coverage, coverage) {
+                write_coverage(fork_coverage, &state, &fork_path(path, index))?;
+            }
+            let summary = format!("finished at {} after {} steps", state.time, steps);
+            Ok((summary, trace))
+        })
+        .collect();
+
+    // Report the outcome of each fork.
+    let mut failed = 0;
+    for (result, path) in results.into_iter().zip(stimuli) {
+        match result {
+            Ok((summary, trace)) => {
+                println!("Fork {}: {}", path, summary);
+                std::io::stdout()
+                    .write_all(&trace)
+                    .context("failed to write fork trace")?;
+            }
+            Err(e) => {
+                println!("Fork {}: {:#}", path, e);
+                failed += 1;
+            }
+        }
+    }
+    if failed > 0 {
+        return Err(anyhow!("{} of {} forks failed", failed, stimuli.len()));
+    }
     Ok(())
 }
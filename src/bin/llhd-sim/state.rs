@@ -12,7 +12,7 @@ use std::{
     collections::{BTreeMap, BinaryHeap, HashMap, HashSet},
     fmt,
     ops::{Index, IndexMut},
-    sync::Mutex,
+    sync::{Arc, Mutex},
 };
 
 /// A simulation state.
@@ -22,13 +22,29 @@ pub struct State<'ll> {
     /// The signals present in the simulation.
     pub signals: Vec<Signal>,
     /// The probed signals.
-    pub probes: HashMap<SignalRef, Vec<String>>,
+    pub probes: HashMap<SignalRef, Vec<Arc<str>>>,
+    /// The input signals of the root unit.
+    pub inputs: Vec<SignalRef>,
+    /// The signals that follow another signal with a delay, as target and
+    /// delay, by source signal.
+    pub delays: HashMap<SignalRef, Vec<(SignalRef, TimeValue)>>,
     /// The root scope of the simulation.
     pub scope: Scope,
     /// The process and entity instances in the simulation.
     pub insts: Vec<Mutex<Instance<'ll>>>,
     /// The current simulation time.
     pub time: TimeValue,
+    /// The memory elements that changed in the current step.
+    ///
+    /// A changed signal with an entry in this map only had the listed elements
+    /// of its memory value modified. Changed signals without an entry may have
+    /// been modified arbitrarily.
+    pub changed_elements: HashMap<SignalRef, Vec<usize>>,
+    /// The instances that halted when they were last executed.
+    ///
+    /// Refilled every time the ready instances are executed, such that tracers
+    /// see the instances that halted in the previous step.
+    pub halted: Vec<usize>,
 
     /// The current state of the event queue.
     pub events: BTreeMap<TimeValue, HashMap<ValuePointer, Value>>,
@@ -118,6 +134,32 @@ impl<'ll> State<'ll> {
     //         &self.scope
     //     }
 
+    /// Create an independent copy of the simulation state.
+    ///
+    /// The copy shares the pages of large memories with the original until
+    /// either of them modifies a page, which makes forking cheap even for
+    /// designs with large memories.
+    pub fn fork(&self) -> State<'ll> {
+        State {
+            module: self.module,
+            signals: self.signals.clone(),
+            probes: self.probes.clone(),
+            inputs: self.inputs.clone(),
+            delays: self.delays.clone(),
+            scope: self.scope.clone(),
+            insts: self
+                .insts
+                .iter()
+                .map(|inst| Mutex::new(inst.lock().unwrap().clone()))
+                .collect(),
+            time: self.time.clone(),
+            changed_elements: self.changed_elements.clone(),
+            halted: self.halted.clone(),
+            events: self.events.clone(),
+            timed: self.timed.clone(),
+        }
+    }
+
     /// Add a set of events to the schedule.
     pub fn schedule_events<I>(&mut self, iter: I)
     where
@@ -136,7 +178,7 @@ impl<'ll> State<'ll> {
                         let sig = s.target.unwrap_signal();
                         probes
                             .get(&sig)
-                            .map(|n| n[0].clone())
+                            .map(|n| n[0].to_string())
                             .unwrap_or_else(|| format!("{:?}", sig))
                     })
                     .collect::<String>(),
@@ -249,6 +291,7 @@ impl fmt::Debug for SignalRef {
 }
 
 /// A signal in a simulation state.
+#[derive(Clone)]
 pub struct Signal {
     ty: llhd::Type,
     value: Value,
@@ -273,6 +316,13 @@ impl Signal {
         &self.value
     }
 
+    /// Get mutable access to the signal's current value.
+    ///
+    /// This is useful to apply small modifications to large values in place.
+    pub fn value_mut(&mut self) -> &mut Value {
+        &mut self.value
+    }
+
     /// Change the signal's current value. Returns whether the values were
     /// identical.
     pub fn set_value(&mut self, value: Value) -> bool {
@@ -286,12 +336,26 @@ impl Signal {
 }
 
 /// An instance of a process or entity.
+#[derive(Clone)]
 pub struct Instance<'ll> {
+    /// The values computed by the instance's instructions.
     pub values: HashMap<llhd::ir::Value, ValueSlot>,
+    /// The constants of the unit, shared among all its instances.
+    pub consts: Arc<HashMap<llhd::ir::Value, ValueSlot>>,
+    /// The position in `signals` of each value that carries a signal, shared
+    /// among all instances of the unit.
+    pub offsets: Arc<HashMap<llhd::ir::Value, usize>>,
     pub kind: InstanceKind<'ll>,
     pub state: InstanceState,
+    /// The signals carried by the unit's arguments and declared signals.
+    /// Signals connected with `con` may appear more than once.
     pub signals: Vec<SignalRef>,
-    pub signal_values: HashMap<SignalRef, llhd::ir::Value>,
+    /// The value that carries each of `signals`, shared among all instances
+    /// of the unit.
+    pub signal_values: Arc<Vec<llhd::ir::Value>>,
+    /// How often each block of a process was entered, indexed by block. Empty
+    /// unless coverage is being collected.
+    pub block_counts: Vec<u64>,
 }
 
 impl<'ll> Instance<'ll> {
@@ -335,7 +399,10 @@ impl<'ll> Instance<'ll> {
 
     /// Access an entry in this instance's value table.
     pub fn value(&self, id: llhd::ir::Value) -> &ValueSlot {
-        self.values.get(&id).unwrap()
+        self.values
+            .get(&id)
+            .or_else(|| self.consts.get(&id))
+            .unwrap()
     }
 
     /// Change an entry in this instance's value table.
@@ -368,8 +435,6 @@ impl<'ll> Instance<'ll> {
 /// Execution of instructions change the value slots.
 #[derive(Debug, Clone, PartialEq, Eq)]
 pub enum ValueSlot {
-    /// A signal.
-    Signal(SignalRef),
     /// A variable with its current value.
     Variable(Value),
     /// A constant value.
@@ -383,7 +448,6 @@ pub enum ValueSlot {
 impl fmt::Display for ValueSlot {
     fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
         match self {
-            ValueSlot::Signal(v) => fmt::Debug::fmt(v, f),
             ValueSlot::Variable(v) => fmt::Display::fmt(v, f),
             ValueSlot::Const(v) => fmt::Display::fmt(v, f),
             ValueSlot::VariablePointer(v) => fmt::Display::fmt(v, f),
@@ -531,6 +595,7 @@ impl fmt::Display for ValueSelect {
 }
 
 /// An instantiation.
+#[derive(Clone)]
 pub enum InstanceKind<'ll> {
     Process {
         prok: llhd::ir::Unit<'ll>,
@@ -622,7 +687,7 @@ pub struct Scope {
     /// The name of the scope.
     pub name: String,
     /// The probes in this scope.
-    pub probes: HashMap<SignalRef, Vec<String>>,
+    pub probes: HashMap<SignalRef, Vec<Arc<str>>>,
     /// The subscopes.
     pub subscopes: Vec<Scope>,
 }
@@ -643,7 +708,38 @@ impl Scope {
     }
 
     /// Add a probe.
-    pub fn add_probe(&mut self, signal: SignalRef, name: String) {
+    pub fn add_probe(&mut self, signal: SignalRef, name: Arc<str>) {
         self.probes.entry(signal).or_insert(Vec::new()).push(name);
     }
+
+    /// Replace the probes of this scope and its subscopes.
+    pub fn map_probes(
+        &mut self,
+        f: &dyn Fn(HashMap<SignalRef, Vec<Arc<str>>>) -> HashMap<SignalRef, Vec<Arc<str>>>,
+    ) {
+        self.probes = f(std::mem::take(&mut self.probes));
+        for subscope in &mut self.subscopes {
+            subscope.map_probes(f);
+        }
+    }
+
+    /// Collect the full path of all probes in this scope and its subscopes,
+    /// in the form `scope/subscope/name` used by the dump output.
+    pub fn probe_paths(&self) -> Vec<(SignalRef, String)> {
+        let mut paths = vec![];
+        self.collect_probe_paths("", &mut paths);
+        paths
+    }
+
+    fn collect_probe_paths(&self, prefix: &str, into: &mut Vec<(SignalRef, String)>) {
+        let prefix = format!("{}{}/", prefix, &self.name[1..]);
+        for (&signal, names) in &self.probes {
+            for name in names {
+                into.push((signal, format!("{}{}", prefix, name)));
+            }
+        }
+        for subscope in &self.subscopes {
+            subscope.collect_probe_paths(&prefix, into);
+        }
+    }
 }
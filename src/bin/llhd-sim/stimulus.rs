@@ -0,0 +1,324 @@
+// Copyright (c) 2017-2021 Fabian Schuiki
+
+//! Stimulus replay
+//!
+//! This module implements driving the top-level inputs of a simulation from a
+//! previously recorded trace. The trace is parsed lazily by a reader thread and
+//! handed to the engine in time order, which schedules the value changes as
+//! events.
+
+use crate::{
+    state::{Event, SignalRef, State, ValuePointer, ValueSlice, ValueTarget},
+    value::{LogicValue, TimeValue, Value},
+};
+use anyhow::{anyhow, bail, Context, Result};
+use llhd::vcd::{parse_timescale, Tokens};
+use num::{pow, BigInt, BigRational};
+use std::{
+    collections::HashMap,
+    fs::File,
+    io::{BufRead, BufReader},
+    sync::mpsc::{sync_channel, Receiver, SyncSender},
+};
+
+/// The number of batches the reader thread may run ahead of the simulation.
+const LOOKAHEAD: usize = 64;
+
+/// A set of value changes that occur at the same time.
+#[derive(Debug)]
+pub struct Batch {
+    /// The time at which the changes occur.
+    pub time: TimeValue,
+    /// The signals and their new values.
+    pub changes: Vec<(SignalRef, usize, Value)>,
+}
+
+impl Batch {
+    /// Convert the batch into events that can be scheduled.
+    pub fn into_events(self) -> impl Iterator<Item = Event> {
+        let time = self.time;
+        self.changes
+            .into_iter()
+            .map(move |(signal, width, value)| Event {
+                time: time.clone(),
+                signal: ValuePointer(vec![ValueSlice {
+                    target: ValueTarget::Signal(signal),
+                    select: vec![],
+                    width,
+                }]),
+                value,
+            })
+    }
+}
+
+/// A stream of stimulus read from a recorded trace.
+pub struct Stimulus {
+    rx: Receiver<Result<Batch>>,
+    peeked: Option<Batch>,
+}
+
+/// A top-level input that a trace signal is bound to.
+#[derive(Debug, Clone, Copy)]
+struct Binding {
+    signal: SignalRef,
+    width: usize,
+}
+
+impl Stimulus {
+    /// Open a recorded trace and bind its signals to the top-level inputs.
+    ///
+    /// The format is determined from the file extension, which may either be
+    /// `.vcd` or `.dump`. Signals in the trace are matched to the inputs by
+    /// name, disregarding the scope they are in.
+    pub fn open(path: &str, state: &State) -> Result<Stimulus> {
+        // Collect the names of the top-level inputs.
+        let mut bindings = HashMap::new();
+        for &signal in &state.inputs {
+            let width = match **state[signal].ty().unwrap_signal() {
+                llhd::IntType(w) => w,
+                ref ty => bail!("cannot replay stimulus for input of type {}", ty),
+            };
+            for name in state.probes.get(&signal).into_iter().flatten() {
+                bindings.insert(name.to_string(), Binding { signal, width });
+            }
+        }
+
+        let file = File::open(path).with_context(|| format!("failed to open {}", path))?;
+        let mut tokens = Tokens::new(BufReader::new(file));
+        let (tx, rx) = sync_channel(LOOKAHEAD);
+        if path.ends_with(".vcd") {
+            let header = parse_vcd_header(&mut tokens, &bindings)
+                .with_context(|| format!("failed to read VCD header of {}", path))?;
+            std::thread::spawn(move || read_vcd(tokens, header, tx));
+        } else if path.ends_with(".dump") {
+            std::thread::spawn(move || read_dump(tokens, bindings, tx));
+        } else {
+            bail!("Cannot determine stimulus format from file name `{}`", path);
+        }
+        Ok(Stimulus { rx, peeked: None })
+    }
+
+    /// Get the time of the next batch of value changes.
+    ///
+    /// Fails if the remainder of the trace cannot be read.
+    pub fn peek_time(&mut self) -> Result<Option<&TimeValue>> {
+        if self.peeked.is_none() {
+            self.peeked = match self.rx.recv() {
+                Ok(batch) => Some(batch.context("failed to read stimulus")?),
+                Err(_) => None,
+            };
+        }
+        Ok(self.peeked.as_ref().map(|b| &b.time))
+    }
+
+    /// Get the next batch of value changes.
+    pub fn next(&mut self) -> Result<Option<Batch>> {
+        self.peek_time()?;
+        Ok(self.peeked.take())
+    }
+}
+
+/// Create a value from a string of bits, most significant bit first.
+///
+/// Strings shorter than the width are extended with zeros, or with `x` or `z`
+/// if that is their leftmost bit.
+fn parse_bits(bits: &str, width: usize) -> Result<Value> {
+    let fill = match bits.chars().next() {
+        Some(c @ 'x') | Some(c @ 'X') | Some(c @ 'z') | Some(c @ 'Z') => c,
+        _ => '0',
+    };
+    let mut value = LogicValue::zero(width);
+    let mut chars = bits.chars().rev();
+    for i in 0..width {
+        let c = chars.next().unwrap_or(fill);
+        match c {
+            '0' | '1' | 'x' | 'X' | 'z' | 'Z' => value.set_bit(i, c),
+            _ => bail!("invalid bit `{}` in `{}`", c, bits),
+        }
+    }
+    Ok(value.into_value())
+}
+
+/// The information gathered from a VCD header.
+struct VcdHeader {
+    timescale: BigRational,
+    ids: HashMap<String, Binding>,
+}
+
+/// Parse the header of a VCD file, up to `$enddefinitions`.
+fn parse_vcd_header<R: BufRead>(
+    tokens: &mut Tokens<R>,
+    bindings: &HashMap<String, Binding>,
+) -> Result<VcdHeader> {
+    let mut timescale = BigRational::new(BigInt::from(1), pow(BigInt::from(10), 12));
+    let mut ids = HashMap::new();
+    loop {
+        let token = tokens.expect_token()?;
+        match token.as_str() {
+            "$enddefinitions" => {
+                tokens.skip_to_end()?;
+                break;
+            }
+            "$timescale" => {
+                timescale = parse_timescale(&tokens.skip_to_end()?.concat())
+                    .map_err(|e| anyhow!("{}", e))?;
+            }
+            "$var" => {
+                let var = tokens.skip_to_end()?;
+                if var.len() < 4 {
+                    bail!("invalid variable declaration `{}`", var.join(" "));
+                }
+                // Ignore signals declared multiple times in different scopes,
+                // and use the first one.
+                if let Some(&binding) = bindings.get(&var[3]) {
+                    if !ids.values().any(|b: &Binding| b.signal == binding.signal) {
+                        ids.insert(var[2].clone(), binding);
+                    }
+                }
+            }
+            _ if token.starts_with('$') => {
+                tokens.skip_to_end()?;
+            }
+            _ => bail!("unexpected `{}` in header", token),
+        }
+    }
+    for (name, binding) in bindings {
+        if !ids.values().any(|b| b.signal == binding.signal) {
+            warn!("Input {} not present in stimulus", name);
+        }
+    }
+    Ok(VcdHeader { timescale, ids })
+}
+
+/// Read the value changes of a VCD file and send them to the simulation.
+fn read_vcd<R: BufRead>(mut tokens: Tokens<R>, header: VcdHeader, tx: SyncSender<Result<Batch>>) {
+    let mut batch = Batch {
+        time: TimeValue::zero(),
+        changes: vec![],
+    };
+    let result = (|| -> Result<()> {
+        while let Some(token) = tokens.next_token()? {
+            let (bits, id) = match token.chars().next().unwrap() {
+                '#' => {
+                    let time: BigInt = token[1..]
+                        .parse()
+                        .with_context(|| format!("invalid time `{}`", token))?;
+                    let time =
+                        TimeValue::new(BigRational::from_integer(time) * &header.timescale, 0, 0);
+                    let next = Batch {
+                        time,
+                        changes: vec![],
+                    };
+                    let prev = std::mem::replace(&mut batch, next);
+                    if !prev.changes.is_empty() && tx.send(Ok(prev)).is_err() {
+                        return Ok(());
+                    }
+                    continue;
+                }
+                // Keywords such as `$dumpvars` are irrelevant for replay.
+                '$' => continue,
+                'b' | 'B' => (token[1..].to_string(), tokens.expect_token()?),
+                'r' | 'R' => {
+                    tokens.expect_token()?;
+                    continue;
+                }
+                _ => (token[..1].to_string(), token[1..].to_string()),
+            };
+            if let Some(binding) = header.ids.get(&id) {
+                let value = parse_bits(&bits, binding.width)?;
+                batch.changes.push((binding.signal, binding.width, value));
+            }
+        }
+        Ok(())
+    })();
+    match result {
+        Ok(()) if !batch.changes.is_empty() => {
+            let _ = tx.send(Ok(batch));
+        }
+        Ok(()) => (),
+        Err(e) => {
+            let _ = tx.send(Err(e));
+        }
+    }
+}
+
+/// Read the value changes of a `DumpTracer` trace and send them to the
+/// simulation.
+fn read_dump<R: BufRead>(
+    mut tokens: Tokens<R>,
+    bindings: HashMap<String, Binding>,
+    tx: SyncSender<Result<Batch>>,
+) {
+    let precision = BigRational::from_integer(pow(BigInt::from(10), 12));
+    let mut batch = Batch {
+        time: TimeValue::zero(),
+        changes: vec![],
+    };
+    let result = (|| -> Result<()> {
+        while let Some(line) = tokens.next_line()? {
+            // Lines that are not indented carry the time of the subsequent
+            // value changes, as `<time>ps <delta>d <epsilon>e`.
+            if !line.starts_with(' ') {
+                let fields: Vec<_> = line.split_whitespace().collect();
+                let (time, delta, epsilon) = match fields.as_slice() {
+                    [t, d, e] if t.ends_with("ps") && d.ends_with('d') && e.ends_with('e') => (
+                        t.trim_end_matches("ps").parse::<BigInt>()?,
+                        d.trim_end_matches('d').parse::<usize>()?,
+                        e.trim_end_matches('e').parse::<usize>()?,
+                    ),
+                    _ => bail!("invalid time `{}`", line),
+                };
+                let next = Batch {
+                    time: TimeValue::new(
+                        BigRational::from_integer(time) / &precision,
+                        delta,
+                        epsilon,
+                    ),
+                    changes: vec![],
+                };
+                let prev = std::mem::replace(&mut batch, next);
+                if !prev.changes.is_empty() && tx.send(Ok(prev)).is_err() {
+                    return Ok(());
+                }
+                continue;
+            }
+
+            // All other lines are value changes, as `<scope>/<name> = 0x<hex>`.
+            let mut parts = line.trim().splitn(2, " = ");
+            let (path, value) = match (parts.next(), parts.next()) {
+                (Some(p), Some(v)) => (p, v),
+                _ => bail!("invalid value change `{}`", line),
+            };
+            let name = path.rsplit('/').next().unwrap();
+            let binding = match bindings.get(name) {
+                Some(b) => b,
+                None => continue,
+            };
+            if !value.starts_with("0x") {
+                bail!("cannot replay value `{}` of {}", value, path);
+            }
+            let bits: String = value[2..]
+                .chars()
+                .map(|c| match c {
+                    'x' | 'z' => std::iter::repeat(c).take(4).collect(),
+                    _ => c
+                        .to_digit(16)
+                        .map(|d| format!("{:04b}", d))
+                        .unwrap_or_else(|| c.to_string()),
+                })
+                .collect();
+            let value = parse_bits(&bits, binding.width)?;
+            batch.changes.push((binding.signal, binding.width, value));
+        }
+        Ok(())
+    })();
+    match result {
+        Ok(()) if !batch.changes.is_empty() => {
+            let _ = tx.send(Ok(batch));
+        }
+        Ok(()) => (),
+        Err(e) => {
+            let _ = tx.send(Err(e));
+        }
+    }
+}
@@ -40,6 +40,28 @@ where
             Value::Int(v) => {
                 write!(self.writer, "0x{0:01$x}", v.value, (v.width + 3) / 4).unwrap();
             }
+            Value::Logic(v) => {
+                // Print each hex digit as `x` or `z` if any of its bits are
+                // unknown, or as a regular digit otherwise.
+                write!(self.writer, "0x").unwrap();
+                for digit in (0..(v.width + 3) / 4).rev() {
+                    let bits: Vec<char> = (digit * 4..std::cmp::min(digit * 4 + 4, v.width))
+                        .map(|i| v.bit(i))
+                        .collect();
+                    let c = if bits.iter().all(|&b| b == 'z') {
+                        'z'
+                    } else if bits.iter().any(|&b| b == 'x' || b == 'z') {
+                        'x'
+                    } else {
+                        let d = bits
+                            .iter()
+                            .rev()
+                            .fold(0, |d, &b| d << 1 | (b == '1') as u32);
+                        std::char::from_digit(d, 16).unwrap()
+                    };
+                    write!(self.writer, "{}", c).unwrap();
+                }
+            }
             Value::Time(_) => (),
             Value::Array(v) => {
                 write!(self.writer, "[").unwrap();
@@ -49,6 +71,16 @@ where
                 }
                 write!(self.writer, "]").unwrap();
             }
+            Value::Memory(v) => {
+                write!(self.writer, "[").unwrap();
+                for i in 0..v.length {
+                    if i > 0 {
+                        write!(self.writer, ", ").unwrap();
+                    }
+                    self.write_value(&v.extract_field(i));
+                }
+                write!(self.writer, "]").unwrap();
+            }
             Value::Struct(v) => {
                 write!(self.writer, "{{").unwrap();
                 for (field, sep) in v.0.iter().zip(once("").chain(repeat(", "))) {
@@ -93,10 +125,20 @@ where
     }
 
     fn step(&mut self, state: &State, changed: &HashSet<SignalRef>) {
+        // Times are emitted in ps. Only fall back to rational arithmetic for
+        // times that are not a whole number of femtoseconds.
+        match state.time.femtoseconds() {
+            Some(fs) => write!(self.writer, "{}ps", fs / 1000).unwrap(),
+            None => write!(
+                self.writer,
+                "{}ps",
+                (state.time.time() * &self.precision).trunc()
+            )
+            .unwrap(),
+        }
         write!(
             self.writer,
-            "{}ps {}d {}e\n",
-            (state.time.time() * &self.precision).trunc(),
+            " {}d {}e\n",
             state.time.delta(),
             state.time.epsilon()
         )
@@ -105,6 +147,19 @@ where
         let mut changed: Vec<SignalRef> = changed.iter().cloned().collect();
         changed.sort_by_key(|s| &self.signals[s]);
         for signal in changed {
+            // Only print the changed elements of memories.
+            if let Some(elements) = state.changed_elements.get(&signal) {
+                let mut elements = elements.clone();
+                elements.sort();
+                elements.dedup();
+                let memory = state[signal].value().unwrap_memory();
+                for index in elements {
+                    write!(self.writer, "  {}[{}] = ", self.signals[&signal], index).unwrap();
+                    self.write_value(&memory.extract_field(index));
+                    write!(self.writer, "\n").unwrap();
+                }
+                continue;
+            }
             write!(self.writer, "  {} = ", self.signals[&signal]).unwrap();
             self.write_value(state[signal].value());
             write!(self.writer, "\n").unwrap();
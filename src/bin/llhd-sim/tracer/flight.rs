@@ -0,0 +1,245 @@
+// Copyright (c) 2017-2021 Fabian Schuiki
+
+//! A flight recorder that keeps the recent history of the simulation.
+
+use crate::{
+    state::{InstanceKind, SignalRef, State},
+    tracer::{Tracer, VcdTracer},
+    value::{IntValue, TimeValue, Value},
+};
+use num::BigUint;
+use std::collections::{HashMap, HashSet, VecDeque};
+
+/// A condition that causes the flight recorder to write out its history.
+#[derive(Debug, Clone)]
+pub enum Trigger {
+    /// A signal, identified by name, takes on a value.
+    Value(String, BigUint),
+    /// A process, identified by name, halts.
+    Halt(String),
+}
+
+/// A tracer that keeps the most recent value changes of each signal in memory,
+/// and writes them out as VCD once a trigger fires.
+///
+/// At most `depth` changes are kept per signal. If a `window` is set, changes
+/// that are older than the window are discarded as well, except for the last
+/// one which establishes the signal's value at the start of the window. If no
+/// trigger fires during the simulation, the history is written out at the end.
+///
+/// While no trigger fires, each step only appends the changed values to their
+/// ring buffers. The start of the window is only recomputed when the physical
+/// time advances, and halt triggers are only checked for the instances that
+/// actually halted.
+pub struct FlightRecorder<T> {
+    writer: Option<T>,
+    depth: usize,
+    window: Option<TimeValue>,
+    /// The physical time for which `start` was computed.
+    now: TimeValue,
+    /// The earliest point in time that is within the window.
+    start: Option<TimeValue>,
+    triggers: Vec<Trigger>,
+    history: HashMap<SignalRef, VecDeque<(TimeValue, Value)>>,
+    watched_signals: Vec<(SignalRef, IntValue)>,
+    watched_insts: Vec<usize>,
+}
+
+impl<T> FlightRecorder<T>
+where
+    T: std::io::Write,
+{
+    /// Create a new flight recorder which will write its VCD to `writer`.
+    pub fn new(writer: T, depth: usize, window: Option<TimeValue>, triggers: Vec<Trigger>) -> Self {
+        FlightRecorder {
+            writer: Some(writer),
+            depth: std::cmp::max(depth, 1),
+            window,
+            now: TimeValue::zero(),
+            start: None,
+            triggers,
+            history: HashMap::new(),
+            watched_signals: vec![],
+            watched_insts: vec![],
+        }
+    }
+
+    /// Record the current value of a signal, and discard the changes before
+    /// the start of the window.
+    fn record(&mut self, state: &State, signal: SignalRef) {
+        let depth = self.depth;
+        let ring = self
+            .history
+            .entry(signal)
+            .or_insert_with(|| VecDeque::with_capacity(depth));
+        if ring.len() == depth {
+            ring.pop_front();
+        }
+        ring.push_back((state.time.clone(), state[signal].value().clone()));
+        if let Some(ref start) = self.start {
+            prune(ring, start);
+        }
+    }
+
+    /// Update the start of the window if the physical time has advanced.
+    fn advance(&mut self, state: &State) {
+        if state.time.same_time(&self.now) {
+            return;
+        }
+        self.now = state.time.clone();
+        self.start = self
+            .window
+            .as_ref()
+            .and_then(|window| window_start(&self.now, window));
+    }
+
+    /// Check whether any of the triggers fired.
+    fn triggered(&self, state: &State, changed: &HashSet<SignalRef>) -> bool {
+        let value_matches = self.watched_signals.iter().any(|(signal, target)| {
+            changed.contains(signal) && state[*signal].value().get_int() == Some(target)
+        });
+        value_matches
+            || state
+                .halted
+                .iter()
+                .any(|inst| self.watched_insts.contains(inst))
+    }
+
+    /// Write the recorded history as VCD. Does nothing if the history has
+    /// already been written.
+    fn dump(&mut self, state: &State) {
+        let writer = match self.writer.take() {
+            Some(w) => w,
+            None => return,
+        };
+        info!("Writing flight recorder history at {}", state.time);
+        self.advance(state);
+        if let Some(ref start) = self.start {
+            for ring in self.history.values_mut() {
+                prune(ring, start);
+            }
+        }
+        let mut changes: Vec<_> = self
+            .history
+            .iter()
+            .flat_map(|(&signal, ring)| ring.iter().map(move |(t, v)| (t, signal, v)))
+            .collect();
+        changes.sort_by(|a, b| (a.0, a.1).cmp(&(b.0, b.1)));
+
+        let mut vcd = VcdTracer::new(writer);
+        vcd.write_header(state);
+        for (time, signal, value) in changes {
+            vcd.record(time, signal, value.clone());
+        }
+        vcd.finish(state);
+        self.history.clear();
+    }
+}
+
+impl<T> Tracer for FlightRecorder<T>
+where
+    T: std::io::Write,
+{
+    fn init(&mut self, state: &State) {
+        // Resolve the triggers. Signals and processes may be named either by
+        // their full path, as in the dump output, or by their name alone.
+        let probes = state.scope.probe_paths();
+        let matches =
+            |path: &str, name: &str| path == name || path.rsplit('/').next() == Some(name);
+        for trigger in &self.triggers {
+            match trigger {
+                Trigger::Value(name, target) => {
+                    let found: Vec<_> = probes
+                        .iter()
+                        .filter(|(_, path)| matches(path.as_str(), name.as_str()))
+                        .map(|&(signal, _)| signal)
+                        .collect();
+                    if found.is_empty() {
+                        warn!("Flight recorder trigger signal {} not found", name);
+                    }
+
+                    // Convert the value to the width of each signal once, such
+                    // that changes can be compared directly.
+                    for signal in found {
+                        let width = match state[signal].value().get_int() {
+                            Some(v) => v.width,
+                            None => continue,
+                        };
+                        if target.bits() as usize > width {
+                            warn!(
+                                "Flight recorder trigger value {} does not fit into {}",
+                                target, name
+                            );
+                            continue;
+                        }
+                        let target = IntValue::from_unsigned(width, target.clone());
+                        self.watched_signals.push((signal, target));
+                    }
+                }
+                Trigger::Halt(name) => {
+                    let name = name.trim_start_matches('@');
+                    let found: Vec<_> = (0..state.insts.len())
+                        .filter(|&i| match state.insts[i].lock().unwrap().kind {
+                            InstanceKind::Process { ref prok, .. } => {
+                                prok.name().to_string().trim_start_matches('@') == name
+                            }
+                            InstanceKind::Entity { .. } => false,
+                        })
+                        .collect();
+                    if found.is_empty() {
+                        warn!("Flight recorder trigger process {} not found", name);
+                    }
+                    self.watched_insts.extend(found);
+                }
+            }
+        }
+
+        // Record the initial values.
+        for &signal in state.probes.keys() {
+            self.record(state, signal, None);
+        }
+    }
+
+    fn step(&mut self, state: &State, changed: &HashSet<SignalRef>) {
+        if self.writer.is_none() {
+            return;
+        }
+        self.advance(state);
+        for &signal in changed {
+            if state.probes.contains_key(&signal) {
+                self.record(state, signal);
+            }
+        }
+        if self.triggered(state, changed) {
+            self.dump(state);
+        }
+    }
+
+    fn finish(&mut self, state: &State) {
+        self.dump(state);
+    }
+}
+
+/// Determine the earliest point in time that is within a window ending at
+/// `now`, if the window does not reach back to the start of the simulation.
+fn window_start(now: &TimeValue, window: &TimeValue) -> Option<TimeValue> {
+    match (now.femtoseconds(), window.femtoseconds()) {
+        (Some(now), Some(window)) if now > window => {
+            Some(TimeValue::from_femtoseconds(now - window, 0, 0))
+        }
+        (Some(_), Some(_)) => None,
+        _ if now.time() > window.time() => Some(TimeValue::new(now.time() - window.time(), 0, 0)),
+        _ => None,
+    }
+}
+
+/// Discard the changes of a signal that are no longer needed to reconstruct its
+/// values from `start` onwards.
+///
+/// All changes at the physical time of `start` are considered to be at the
+/// start of the window, regardless of their delta and epsilon steps.
+fn prune(ring: &mut VecDeque<(TimeValue, Value)>, start: &TimeValue) {
+    while ring.len() > 1 && (ring[1].0 < *start || ring[1].0.same_time(start)) {
+        ring.pop_front();
+    }
+}
@@ -29,6 +29,8 @@ impl Tracer for NullTracer {
 
 // Import the actual tracers.
 mod dump;
+mod flight;
 mod vcd;
 pub use dump::*;
+pub use flight::*;
 pub use vcd::*;
@@ -5,7 +5,7 @@
 use crate::{
     state::{Scope, SignalRef, State},
     tracer::Tracer,
-    value::Value,
+    value::{TimeValue, Value},
 };
 use num::{traits::Pow, BigInt, BigRational, FromPrimitive};
 use std::{
@@ -17,8 +17,9 @@ use std::{
 pub struct VcdTracer<T> {
     writer: RefCell<T>,
     abbrevs: HashMap<SignalRef, Vec<(String, String, usize)>>,
-    time: BigRational,
+    time: TimeValue,
     pending: HashMap<SignalRef, Value>,
+    pending_elements: HashMap<SignalRef, HashSet<usize>>,
     precision: BigRational,
 }
 
@@ -31,22 +32,74 @@ where
         VcdTracer {
             writer: RefCell::new(writer),
             abbrevs: HashMap::new(),
-            time: num::zero(),
+            time: TimeValue::zero(),
             pending: HashMap::new(),
+            pending_elements: HashMap::new(),
             // Hard-code the precision to ps for now. Later on, we might want to
             // make this configurable or automatically determined by the module.
             precision: BigInt::from_usize(10).unwrap().pow(12usize).into(), // ps
         }
     }
 
+    /// Write the VCD header and allocate short names for all probed signals.
+    pub fn write_header(&mut self, state: &State) {
+        write!(
+            self.writer.borrow_mut(),
+            "$version\nllhd-sim {}\n$end\n",
+            clap::crate_version!()
+        )
+        .unwrap();
+        write!(self.writer.borrow_mut(), "$timescale 1ps $end\n").unwrap();
+        self.prepare_scope(state, &state.scope, &mut 0);
+        write!(self.writer.borrow_mut(), "$enddefinitions $end\n").unwrap();
+    }
+
+    /// Record the value of a signal at a point in physical time.
+    ///
+    /// This allows a trace to be written from values that were collected
+    /// elsewhere, after `write_header` has been called. The times must not
+    /// decrease. Call `finish` to flush the last point in time.
+    pub fn record(&mut self, time: &TimeValue, signal: SignalRef, value: Value) {
+        if !self.time.same_time(time) {
+            self.flush();
+            self.time = time.clone();
+        }
+        self.pending_elements.remove(&signal);
+        self.pending.insert(signal, value);
+    }
+
     /// Write the value of all signals that have changed since the last flush.
     /// Clears the `pending` set.
     fn flush(&mut self) {
-        let time = (&self.time * &self.precision).trunc();
-        write!(self.writer.borrow_mut(), "#{}\n", time).unwrap();
+        // Times are emitted in ps. Only fall back to rational arithmetic for
+        // times that are not a whole number of femtoseconds.
+        match self.time.femtoseconds() {
+            Some(fs) => write!(self.writer.borrow_mut(), "#{}\n", fs / 1000).unwrap(),
+            None => {
+                let time = (self.time.time() * &self.precision).trunc();
+                write!(self.writer.borrow_mut(), "#{}\n", time).unwrap();
+            }
+        }
         for (signal, value) in std::mem::replace(&mut self.pending, HashMap::new()) {
-            for &(ref abbrev, _, offset) in &self.abbrevs[&signal] {
-                self.flush_signal(signal, offset, &value, abbrev);
+            let elements = self.pending_elements.remove(&signal);
+            let abbrevs = &self.abbrevs[&signal];
+            match (elements, &value) {
+                // Only write the changed elements of memories. Their
+                // abbreviations are allocated in element order, once for each
+                // name of the signal.
+                (Some(elements), Value::Memory(v)) if abbrevs.len() % v.length == 0 => {
+                    for base in (0..abbrevs.len()).step_by(v.length) {
+                        for &index in &elements {
+                            let (ref abbrev, _, offset) = abbrevs[base + index];
+                            self.flush_signal(signal, offset, &value, abbrev);
+                        }
+                    }
+                }
+                _ => {
+                    for &(ref abbrev, _, offset) in abbrevs {
+                        self.flush_signal(signal, offset, &value, abbrev);
+                    }
+                }
             }
         }
     }
@@ -61,6 +114,11 @@ where
                 assert_eq!(offset, 0);
                 write!(self.writer.borrow_mut(), "b{:b} {}\n", v.value, abbrev).unwrap();
             }
+            Value::Logic(v) => {
+                assert_eq!(offset, 0);
+                let bits: String = (0..v.width).rev().map(|i| v.bit(i)).collect();
+                write!(self.writer.borrow_mut(), "b{} {}\n", bits, abbrev).unwrap();
+            }
             Value::Time(_) => (),
             Value::Array(v) => {
                 let elems = &v.0;
@@ -71,6 +129,14 @@ where
                     abbrev,
                 );
             }
+            Value::Memory(v) => {
+                self.flush_signal(
+                    signal,
+                    offset / v.length,
+                    &v.extract_field(offset % v.length),
+                    abbrev,
+                );
+            }
             Value::Struct(v) => {
                 let fields = &v.0;
                 self.flush_signal(
@@ -190,16 +256,7 @@ where
     T: std::io::Write,
 {
     fn init(&mut self, state: &State) {
-        // Dump the VCD header.
-        write!(
-            self.writer.borrow_mut(),
-            "$version\nllhd-sim {}\n$end\n",
-            clap::crate_version!()
-        )
-        .unwrap();
-        write!(self.writer.borrow_mut(), "$timescale 1ps $end\n").unwrap();
-        self.prepare_scope(state, &state.scope, &mut 0);
-        write!(self.writer.borrow_mut(), "$enddefinitions $end\n").unwrap();
+        self.write_header(state);
 
         // Dump the variables.
         write!(self.writer.borrow_mut(), "$dumpvars\n").unwrap();
@@ -214,19 +271,31 @@ where
     }
 
     fn step(&mut self, state: &State, changed: &HashSet<SignalRef>) {
-        // If the physical time in seconds of the simulation changed, flush the
-        // aggregated pending changes and update the time.
-        if self.time != *state.time.time() {
+        // If the physical time of the simulation changed, flush the aggregated
+        // pending changes and update the time.
+        if !self.time.same_time(&state.time) {
             self.flush();
-            self.time = state.time.time().clone();
+            self.time = state.time.clone();
         }
 
         // Mark the changed signals for consideration during the next flush.
-        self.pending.extend(
-            changed
-                .iter()
-                .map(|&signal| (signal, state[signal].value().clone())),
-        );
+        // Keep track of which elements of memories changed, unless the entire
+        // signal is already pending.
+        for &signal in changed {
+            let whole =
+                self.pending.contains_key(&signal) && !self.pending_elements.contains_key(&signal);
+            match state.changed_elements.get(&signal) {
+                Some(elements) if !whole => self
+                    .pending_elements
+                    .entry(signal)
+                    .or_insert_with(HashSet::new)
+                    .extend(elements.iter().cloned()),
+                _ => {
+                    self.pending_elements.remove(&signal);
+                }
+            }
+            self.pending.insert(signal, state[signal].value().clone());
+        }
     }
 
     fn finish(&mut self, _: &State) {
@@ -5,9 +5,15 @@
 //! This module implements representations for LLHD values as they evolve during
 //! the simulation of a design.
 
-use llhd::ir::Opcode;
+use llhd::{ir::Opcode, value::PackedInt};
 use num::{bigint::ToBigInt, BigInt, BigUint, One, Signed, ToPrimitive, Zero};
-use std::fmt::{Debug, Display};
+use std::{
+    borrow::Cow,
+    cmp::Ordering,
+    collections::{HashMap, HashSet},
+    fmt::{Debug, Display},
+    sync::Arc,
+};
 
 /// A point in time.
 pub type Time = llhd::value::TimeValue;
@@ -22,7 +28,9 @@ pub enum Value {
     Void,
     Time(Time),
     Int(IntValue),
+    Logic(LogicValue),
     Array(ArrayValue),
+    Memory(MemoryValue),
     Struct(StructValue),
 }
 
@@ -53,6 +61,19 @@ impl Value {
         self.get_int().expect("value is not an integer")
     }
 
+    /// If this value is a four-state logic value, access it.
+    pub fn get_logic(&self) -> Option<&LogicValue> {
+        match self {
+            Value::Logic(v) => Some(v),
+            _ => None,
+        }
+    }
+
+    /// Unwrap this value as a four-state logic value, or panic.
+    pub fn unwrap_logic(&self) -> &LogicValue {
+        self.get_logic().expect("value is not a logic value")
+    }
+
     /// If this value is an array, access it.
     pub fn get_array(&self) -> Option<&ArrayValue> {
         match self {
@@ -66,6 +87,19 @@ impl Value {
         self.get_array().expect("value is not an array")
     }
 
+    /// If this value is a memory, access it.
+    pub fn get_memory(&self) -> Option<&MemoryValue> {
+        match self {
+            Value::Memory(v) => Some(v),
+            _ => None,
+        }
+    }
+
+    /// Unwrap this value as a memory, or panic.
+    pub fn unwrap_memory(&self) -> &MemoryValue {
+        self.get_memory().expect("value is not a memory")
+    }
+
     /// If this value is a struct, access it.
     pub fn get_struct(&self) -> Option<&StructValue> {
         match self {
@@ -82,18 +116,83 @@ impl Value {
     /// Check if the value is zero.
     pub fn is_zero(&self) -> bool {
         match self {
-            Value::Array(..) | Value::Struct(..) | Value::Void => false,
-            Value::Time(v) => v.time().is_zero() && v.delta() == 0 && v.epsilon() == 0,
+            Value::Array(..) | Value::Memory(..) | Value::Struct(..) | Value::Void => false,
+            Value::Time(v) => v.is_zero(),
             Value::Int(v) => v.is_zero(),
+            Value::Logic(v) => v.is_known() && v.value.iter().all(|&w| w == 0),
         }
     }
 
     /// Check if the value is one.
     pub fn is_one(&self) -> bool {
         match self {
-            Value::Array(..) | Value::Struct(..) | Value::Void => false,
+            Value::Array(..) | Value::Memory(..) | Value::Struct(..) | Value::Void => false,
             Value::Time(_) => false,
             Value::Int(v) => v.is_one(),
+            Value::Logic(v) => v.to_int().map(|v| v.is_one()).unwrap_or(false),
+        }
+    }
+
+    /// Create an array with all elements set to the same value.
+    ///
+    /// Long arrays of integers are stored as a memory.
+    pub fn uniform_array(length: usize, value: Value) -> Value {
+        match value {
+            Value::Int(v) if length >= MEMORY_THRESHOLD => MemoryValue::new(length, v).into(),
+            _ => ArrayValue::new_uniform(length, value).into(),
+        }
+    }
+
+    /// Convert an array or memory into its elements, or panic.
+    pub fn to_elements(&self) -> Vec<Value> {
+        match self {
+            Value::Array(v) => v.0.to_vec(),
+            Value::Memory(v) => v.to_array().0.to_vec(),
+            _ => panic!("{} is not an array", self),
+        }
+    }
+
+    /// Create a value of the given type where all bits are unknown.
+    ///
+    /// Integers become all-`X` logic values, aggregates are filled with
+    /// unknown elements, and all other types map to `Void`.
+    pub fn unknown(ty: &llhd::Type) -> Value {
+        match **ty {
+            llhd::IntType(w) => LogicValue::unknown(w).into(),
+            llhd::SignalType(ref ty) | llhd::PointerType(ref ty) => Value::unknown(ty),
+            llhd::ArrayType(w, ref ty) => ArrayValue::new_uniform(w, Value::unknown(ty)).into(),
+            llhd::StructType(ref fields) => {
+                StructValue::new(fields.iter().map(Value::unknown).collect()).into()
+            }
+            _ => Value::Void,
+        }
+    }
+
+    /// Merge two values, turning all bits in which they differ into `X`.
+    ///
+    /// This is used to determine the result of a `mux` whose selector is not
+    /// fully known.
+    pub fn merge_unknown(&self, other: &Value) -> Value {
+        match (self, other) {
+            (Value::Array(a), Value::Array(b)) => ArrayValue::new(
+                a.0.iter()
+                    .zip(b.0.iter())
+                    .map(|(a, b)| a.merge_unknown(b))
+                    .collect(),
+            )
+            .into(),
+            (Value::Struct(a), Value::Struct(b)) => StructValue::new(
+                a.0.iter()
+                    .zip(b.0.iter())
+                    .map(|(a, b)| a.merge_unknown(b))
+                    .collect(),
+            )
+            .into(),
+            (Value::Int(_), _) | (Value::Logic(_), _) => LogicValue::from_value(self)
+                .merge(&LogicValue::from_value(other))
+                .into_value(),
+            _ if self == other => self.clone(),
+            _ => panic!("cannot merge {} and {}", self, other),
         }
     }
 }
@@ -110,12 +209,24 @@ impl From<IntValue> for Value {
     }
 }
 
+impl From<LogicValue> for Value {
+    fn from(v: LogicValue) -> Value {
+        Value::Logic(v)
+    }
+}
+
 impl From<ArrayValue> for Value {
     fn from(v: ArrayValue) -> Value {
         Value::Array(v)
     }
 }
 
+impl From<MemoryValue> for Value {
+    fn from(v: MemoryValue) -> Value {
+        Value::Memory(v)
+    }
+}
+
 impl From<StructValue> for Value {
     fn from(v: StructValue) -> Value {
         Value::Struct(v)
@@ -128,7 +239,9 @@ impl Display for Value {
             Value::Void => write!(f, "void"),
             Value::Time(v) => write!(f, "time {}", v),
             Value::Int(v) => Display::fmt(v, f),
+            Value::Logic(v) => Display::fmt(v, f),
             Value::Array(v) => Display::fmt(v, f),
+            Value::Memory(v) => Display::fmt(v, f),
             Value::Struct(v) => Display::fmt(v, f),
         }
     }
@@ -141,20 +254,29 @@ impl Debug for Value {
 }
 
 /// An integer value.
-#[derive(Clone, PartialEq, Eq, PartialOrd, Ord)]
+///
+/// The bits are stored as packed 64 bit limbs, such that the bitwise and
+/// additive operations, comparisons, and slicing work directly on machine
+/// words. Only multiplication and division go through a `BigUint`.
+#[derive(Clone, PartialEq, Eq)]
 pub struct IntValue {
     /// The width of the value in bits.
     pub width: usize,
     /// The value itself.
-    pub value: BigUint,
+    pub value: PackedInt,
 }
 
 impl IntValue {
     /// Create a new integer value from a `usize`.
     pub fn from_usize(width: usize, value: usize) -> Self {
+        Self::from_packed(PackedInt::from_u64(width, value as u64))
+    }
+
+    /// Create a new integer value from packed limbs.
+    pub fn from_packed(value: PackedInt) -> Self {
         Self {
-            width,
-            value: value.into(),
+            width: value.width(),
+            value,
         }
     }
 
@@ -171,23 +293,33 @@ impl IntValue {
 
     /// Create a new integer value from an unsigned `BigUint` value.
     pub fn from_unsigned(width: usize, value: BigUint) -> Self {
-        let value = value % (BigUint::one() << width);
-        Self { width, value }
+        Self::from_packed(PackedInt::from_biguint(width, &value))
+    }
+
+    /// Convert the value to an unsigned `BigUint`.
+    pub fn to_unsigned(&self) -> BigUint {
+        self.value.to_biguint()
     }
 
     /// Convert the value to a signed `BigInt`.
     pub fn to_signed(&self) -> BigInt {
-        let sign_mask = BigUint::one() << (self.width - 1);
-        if (&self.value & &sign_mask).is_zero() {
-            self.value.to_bigint().unwrap()
+        let v = self.to_unsigned().to_bigint().unwrap();
+        if self.value.sign() {
+            v - (BigInt::one() << self.width)
         } else {
-            (BigInt::one() << self.width) - self.value.to_bigint().unwrap()
+            v
         }
     }
 
     /// Convert the value to a usize.
     pub fn to_usize(&self) -> usize {
-        self.value.to_usize().unwrap()
+        let limbs = self.value.limbs();
+        assert!(
+            limbs.iter().skip(1).all(|&l| l == 0),
+            "{} does not fit into usize",
+            self
+        );
+        limbs.first().cloned().unwrap_or(0).to_usize().unwrap()
     }
 
     /// Check if the value is zero.
@@ -197,13 +329,29 @@ impl IntValue {
 
     /// Check if the value is one.
     pub fn is_one(&self) -> bool {
-        self.value.is_one()
+        let limbs = self.value.limbs();
+        limbs.first() == Some(&1) && limbs.iter().skip(1).all(|&l| l == 0)
+    }
+
+    /// Apply an in-place kernel to a copy of the value.
+    fn map(&self, f: impl FnOnce(&mut PackedInt)) -> IntValue {
+        let mut v = self.value.clone();
+        f(&mut v);
+        IntValue::from_packed(v)
+    }
+
+    /// Apply an in-place kernel to a copy of the value and another value.
+    fn zip(&self, other: &Self, f: impl FnOnce(&mut PackedInt, &PackedInt)) -> IntValue {
+        assert_eq!(self.width, other.width);
+        let mut v = self.value.clone();
+        f(&mut v, &other.value);
+        IntValue::from_packed(v)
     }
 }
 
 impl Display for IntValue {
     fn fmt(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
-        write!(f, "i{} {}", self.width, self.value)
+        write!(f, "i{} {}", self.width, self.to_unsigned())
     }
 }
 
@@ -217,18 +365,15 @@ impl Debug for IntValue {
 impl IntValue {
     /// Extract a slice of bits from the value.
     pub fn extract_slice(&self, off: usize, len: usize) -> IntValue {
-        let shifted = self.value.clone() >> off;
-        let modulus = BigUint::one() << len;
-        IntValue::from_unsigned(len, shifted % modulus)
+        let mut slice = PackedInt::zero(len);
+        self.value.extract_slice_into(off, &mut slice);
+        IntValue::from_packed(slice)
     }
 
     /// Insert a slice of bits into the value.
     pub fn insert_slice(&mut self, off: usize, len: usize, value: &IntValue) {
         assert_eq!(len, value.width);
-        let mask = ((BigUint::one() << len) - BigUint::one()) << off;
-        let mask_inv = ((BigUint::one() << self.width) - BigUint::one()) ^ mask;
-        self.value &= mask_inv;
-        self.value |= &value.value << off;
+        self.value.insert_slice(off, &value.value);
     }
 }
 
@@ -236,16 +381,12 @@ impl IntValue {
 impl IntValue {
     /// Compute `not`.
     pub fn not(&self) -> IntValue {
-        let max = (BigUint::one() << self.width) - BigUint::one();
-        let v = &max - &self.value;
-        IntValue::from_unsigned(self.width, v)
+        self.map(PackedInt::not_assign)
     }
 
     /// Compute `neg`.
     pub fn neg(&self) -> IntValue {
-        let max = BigUint::one() << self.width;
-        let v = &max - &self.value;
-        IntValue::from_unsigned(self.width, v)
+        self.map(PackedInt::neg_assign)
     }
 }
 
@@ -253,47 +394,47 @@ impl IntValue {
 impl IntValue {
     /// Compute `add`.
     pub fn add(&self, other: &Self) -> IntValue {
-        IntValue::from_unsigned(self.width, &self.value + &other.value)
+        self.zip(other, PackedInt::add_assign)
     }
 
     /// Compute `sub`.
     pub fn sub(&self, other: &Self) -> IntValue {
-        IntValue::from_signed(self.width, self.to_signed() - other.to_signed())
+        self.zip(other, PackedInt::sub_assign)
     }
 
     /// Compute `and`.
     pub fn and(&self, other: &Self) -> IntValue {
-        IntValue::from_unsigned(self.width, &self.value & &other.value)
+        self.zip(other, PackedInt::and_assign)
     }
 
     /// Compute `or`.
     pub fn or(&self, other: &Self) -> IntValue {
-        IntValue::from_unsigned(self.width, &self.value | &other.value)
+        self.zip(other, PackedInt::or_assign)
     }
 
     /// Compute `xor`.
     pub fn xor(&self, other: &Self) -> IntValue {
-        IntValue::from_unsigned(self.width, &self.value ^ &other.value)
+        self.zip(other, PackedInt::xor_assign)
     }
 
     /// Compute `umul`.
     pub fn umul(&self, other: &Self) -> IntValue {
-        IntValue::from_unsigned(self.width, &self.value * &other.value)
+        IntValue::from_unsigned(self.width, self.to_unsigned() * other.to_unsigned())
     }
 
     /// Compute `udiv`.
     pub fn udiv(&self, other: &Self) -> IntValue {
-        IntValue::from_unsigned(self.width, &self.value / &other.value)
+        IntValue::from_unsigned(self.width, self.to_unsigned() / other.to_unsigned())
     }
 
     /// Compute `umod`.
     pub fn umod(&self, other: &Self) -> IntValue {
-        IntValue::from_unsigned(self.width, &self.value % &other.value)
+        IntValue::from_unsigned(self.width, self.to_unsigned() % other.to_unsigned())
     }
 
     /// Compute `urem`.
     pub fn urem(&self, other: &Self) -> IntValue {
-        IntValue::from_unsigned(self.width, &self.value % &other.value)
+        IntValue::from_unsigned(self.width, self.to_unsigned() % other.to_unsigned())
     }
 
     /// Compute `smul`.
@@ -334,49 +475,49 @@ impl IntValue {
     /// Compute unsigned `<`.
     pub fn ult(&self, other: &Self) -> bool {
         assert_eq!(self.width, other.width);
-        self.value < other.value
+        self.value.cmp_unsigned(&other.value) == Ordering::Less
     }
 
     /// Compute unsigned `>`.
     pub fn ugt(&self, other: &Self) -> bool {
         assert_eq!(self.width, other.width);
-        self.value > other.value
+        self.value.cmp_unsigned(&other.value) == Ordering::Greater
     }
 
     /// Compute unsigned `<=`.
     pub fn ule(&self, other: &Self) -> bool {
         assert_eq!(self.width, other.width);
-        self.value <= other.value
+        self.value.cmp_unsigned(&other.value) != Ordering::Greater
     }
 
     /// Compute unsigned `>=`.
     pub fn uge(&self, other: &Self) -> bool {
         assert_eq!(self.width, other.width);
-        self.value >= other.value
+        self.value.cmp_unsigned(&other.value) != Ordering::Less
     }
 
     /// Compute signed `<`.
     pub fn slt(&self, other: &Self) -> bool {
         assert_eq!(self.width, other.width);
-        self.to_signed() < other.to_signed()
+        self.value.cmp_signed(&other.value) == Ordering::Less
     }
 
     /// Compute signed `>`.
     pub fn sgt(&self, other: &Self) -> bool {
         assert_eq!(self.width, other.width);
-        self.to_signed() > other.to_signed()
+        self.value.cmp_signed(&other.value) == Ordering::Greater
     }
 
     /// Compute signed `<=`.
     pub fn sle(&self, other: &Self) -> bool {
         assert_eq!(self.width, other.width);
-        self.to_signed() <= other.to_signed()
+        self.value.cmp_signed(&other.value) != Ordering::Greater
     }
 
     /// Compute signed `>=`.
     pub fn sge(&self, other: &Self) -> bool {
         assert_eq!(self.width, other.width);
-        self.to_signed() >= other.to_signed()
+        self.value.cmp_signed(&other.value) != Ordering::Less
     }
 }
 
@@ -433,19 +574,647 @@ impl IntValue {
     }
 }
 
+/// A four-state logic value.
+///
+/// The bits are stored in two packed bit planes. Known bits have their
+/// `unknown` bit cleared and carry their logic level in the `value` plane.
+/// Unknown bits have their `unknown` bit set, and are an `X` if their `value`
+/// bit is set, or a `Z` otherwise. This makes bitwise logic a handful of
+/// word-wide boolean operations, which the compiler vectorizes for wide
+/// values.
+///
+/// Bits beyond the width in the most significant word are always kept zero,
+/// such that logic values can be compared for equality directly.
+#[derive(Clone, PartialEq, Eq)]
+pub struct LogicValue {
+    /// The width of the value in bits.
+    pub width: usize,
+    /// The value plane.
+    pub value: Vec<u64>,
+    /// The unknown plane.
+    pub unknown: Vec<u64>,
+}
+
+/// Number of 64 bit words needed to store `width` bits.
+fn num_words(width: usize) -> usize {
+    (width + 63) / 64
+}
+
+/// A mask with the lower `len` bits set.
+fn low_mask(len: usize) -> u64 {
+    if len >= 64 {
+        !0
+    } else {
+        (1 << len) - 1
+    }
+}
+
+/// Extract `len` bits at offset `off` from a sequence of words.
+fn extract_bits(words: &[u64], off: usize, len: usize) -> Vec<u64> {
+    let mut bits = vec![0; num_words(len)];
+    for (i, b) in bits.iter_mut().enumerate() {
+        let pos = off + i * 64;
+        let (w, s) = (pos / 64, pos % 64);
+        let lo = words.get(w).map(|&x| x >> s).unwrap_or(0);
+        let hi = match s {
+            0 => 0,
+            _ => words.get(w + 1).map(|&x| x << (64 - s)).unwrap_or(0),
+        };
+        *b = (lo | hi) & low_mask(len - i * 64);
+    }
+    bits
+}
+
+/// Insert `len` bits at offset `off` into a sequence of words.
+fn insert_bits(words: &mut [u64], off: usize, len: usize, bits: &[u64]) {
+    for (i, &chunk) in bits.iter().enumerate() {
+        let chunk_len = std::cmp::min(64, len - i * 64);
+        let mask = low_mask(chunk_len);
+        let chunk = chunk & mask;
+        let pos = off + i * 64;
+        let (w, s) = (pos / 64, pos % 64);
+        words[w] = words[w] & !(mask << s) | chunk << s;
+        if s != 0 && s + chunk_len > 64 {
+            words[w + 1] = words[w + 1] & !(mask >> (64 - s)) | chunk >> (64 - s);
+        }
+    }
+}
+
+/// Unpack an integer value from a sequence of words.
+fn int_from_words(width: usize, words: &[u64]) -> IntValue {
+    IntValue::from_packed(PackedInt::from_limbs(width, words))
+}
+
+impl LogicValue {
+    /// Create a new logic value with all bits set to `0`.
+    pub fn zero(width: usize) -> Self {
+        Self {
+            width,
+            value: vec![0; num_words(width)],
+            unknown: vec![0; num_words(width)],
+        }
+    }
+
+    /// Create a new logic value with all bits set to `X`.
+    pub fn unknown(width: usize) -> Self {
+        let mut v = Self {
+            width,
+            value: vec![!0; num_words(width)],
+            unknown: vec![!0; num_words(width)],
+        };
+        v.mask_unused();
+        v
+    }
+
+    /// Create a new logic value with all bits set to `Z`.
+    pub fn high_impedance(width: usize) -> Self {
+        let mut v = Self {
+            width,
+            value: vec![0; num_words(width)],
+            unknown: vec![!0; num_words(width)],
+        };
+        v.mask_unused();
+        v
+    }
+
+    /// Create a logic value from a two-state integer value.
+    pub fn from_int(v: &IntValue) -> Self {
+        let mut v = Self {
+            width: v.width,
+            value: v.value.limbs().to_vec(),
+            unknown: vec![0; num_words(v.width)],
+        };
+        v.mask_unused();
+        v
+    }
+
+    /// Create a logic value from an integer or logic value, or panic.
+    pub fn from_value(v: &Value) -> Self {
+        match v {
+            Value::Int(v) => Self::from_int(v),
+            Value::Logic(v) => v.clone(),
+            _ => panic!("{} is not an integer or logic value", v),
+        }
+    }
+
+    /// Convert to a two-state integer value, if all bits are known.
+    pub fn to_int(&self) -> Option<IntValue> {
+        if self.is_known() {
+            Some(int_from_words(self.width, &self.value))
+        } else {
+            None
+        }
+    }
+
+    /// Convert into a simulation value.
+    ///
+    /// Fully known values become regular integers, such that the two-state
+    /// fast path is taken wherever possible.
+    pub fn into_value(self) -> Value {
+        match self.to_int() {
+            Some(v) => v.into(),
+            None => self.into(),
+        }
+    }
+
+    /// Check if all bits of the value are known.
+    pub fn is_known(&self) -> bool {
+        self.unknown.iter().all(|&w| w == 0)
+    }
+
+    /// Get the character representing a single bit: `0`, `1`, `x`, or `z`.
+    pub fn bit(&self, idx: usize) -> char {
+        let (w, s) = (idx / 64, idx % 64);
+        let v = (self.value[w] >> s) & 1 != 0;
+        let u = (self.unknown[w] >> s) & 1 != 0;
+        match (u, v) {
+            (false, false) => '0',
+            (false, true) => '1',
+            (true, true) => 'x',
+            (true, false) => 'z',
+        }
+    }
+
+    /// Set a single bit from its character: `0`, `1`, `x`, or `z`.
+    ///
+    /// Upper case characters are accepted as well.
+    pub fn set_bit(&mut self, idx: usize, bit: char) {
+        let (w, s) = (idx / 64, idx % 64);
+        let (v, u) = match bit {
+            '0' => (false, false),
+            '1' => (true, false),
+            'x' | 'X' => (true, true),
+            'z' | 'Z' => (false, true),
+            _ => panic!("invalid logic bit `{}`", bit),
+        };
+        self.value[w] = self.value[w] & !(1 << s) | (v as u64) << s;
+        self.unknown[w] = self.unknown[w] & !(1 << s) | (u as u64) << s;
+    }
+
+    /// Clear the bits beyond the value's width.
+    fn mask_unused(&mut self) {
+        let mask = low_mask(self.width % 64);
+        if self.width % 64 != 0 {
+            if let Some(w) = self.value.last_mut() {
+                *w &= mask;
+            }
+            if let Some(w) = self.unknown.last_mut() {
+                *w &= mask;
+            }
+        }
+    }
+
+    /// Combine two values word by word.
+    ///
+    /// The function is called with the value and unknown words of both
+    /// operands, and returns the value and unknown words of the result.
+    fn zip_words(&self, other: &Self, f: impl Fn(u64, u64, u64, u64) -> (u64, u64)) -> Self {
+        assert_eq!(self.width, other.width);
+        let mut r = Self::zero(self.width);
+        for i in 0..r.value.len() {
+            let (v, u) = f(
+                self.value[i],
+                self.unknown[i],
+                other.value[i],
+                other.unknown[i],
+            );
+            r.value[i] = v;
+            r.unknown[i] = u;
+        }
+        r.mask_unused();
+        r
+    }
+}
+
+impl Display for LogicValue {
+    fn fmt(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
+        write!(f, "l{} \"", self.width)?;
+        for i in (0..self.width).rev() {
+            write!(f, "{}", self.bit(i).to_ascii_uppercase())?;
+        }
+        write!(f, "\"")
+    }
+}
+
+impl Debug for LogicValue {
+    fn fmt(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
+        write!(f, "{}", self)
+    }
+}
+
+/// Slicing.
+impl LogicValue {
+    /// Extract a slice of bits from the value.
+    pub fn extract_slice(&self, off: usize, len: usize) -> LogicValue {
+        LogicValue {
+            width: len,
+            value: extract_bits(&self.value, off, len),
+            unknown: extract_bits(&self.unknown, off, len),
+        }
+    }
+
+    /// Insert a slice of bits into the value.
+    pub fn insert_slice(&mut self, off: usize, len: usize, value: &LogicValue) {
+        assert_eq!(len, value.width);
+        insert_bits(&mut self.value, off, len, &value.value);
+        insert_bits(&mut self.unknown, off, len, &value.unknown);
+    }
+}
+
+/// Bitwise operators.
+///
+/// These follow the usual four-state semantics: a `Z` input behaves like an
+/// `X`, a known `0` dominates an `and`, and a known `1` dominates an `or`.
+impl LogicValue {
+    /// Compute `not`.
+    pub fn not(&self) -> LogicValue {
+        self.zip_words(self, |v, u, _, _| (!v | u, u))
+    }
+
+    /// Compute `and`.
+    pub fn and(&self, other: &Self) -> LogicValue {
+        self.zip_words(other, |av, au, bv, bu| {
+            let one = (av & !au) & (bv & !bu);
+            let zero = (!av & !au) | (!bv & !bu);
+            let u = !(one | zero);
+            (one | u, u)
+        })
+    }
+
+    /// Compute `or`.
+    pub fn or(&self, other: &Self) -> LogicValue {
+        self.zip_words(other, |av, au, bv, bu| {
+            let one = (av & !au) | (bv & !bu);
+            let zero = (!av & !au) & (!bv & !bu);
+            let u = !(one | zero);
+            (one | u, u)
+        })
+    }
+
+    /// Compute `xor`.
+    pub fn xor(&self, other: &Self) -> LogicValue {
+        self.zip_words(other, |av, au, bv, bu| {
+            let u = au | bu;
+            ((av ^ bv) | u, u)
+        })
+    }
+
+    /// Merge two values, turning all bits in which they differ into `X`.
+    pub fn merge(&self, other: &Self) -> LogicValue {
+        self.zip_words(other, |av, au, bv, bu| {
+            let u = au | bu | (av ^ bv);
+            (av | u, u)
+        })
+    }
+}
+
+/// Opcode implementations.
+///
+/// Arithmetic is pessimistic: if any bit of an operand is unknown, or a
+/// division by zero occurs, all bits of the result are `X`. Comparisons yield
+/// a single `X` bit under the same conditions, except for `eq` and `neq`,
+/// which yield a known result if the known bits of the operands differ.
+impl LogicValue {
+    /// Execute a unary opcode.
+    pub fn unary_op(op: Opcode, arg: &LogicValue) -> LogicValue {
+        match op {
+            Opcode::Not => arg.not(),
+            Opcode::Neg => match arg.to_int() {
+                Some(v) => LogicValue::from_int(&v.neg()),
+                None => LogicValue::unknown(arg.width),
+            },
+            _ => panic!("{} is not a unary op", op),
+        }
+    }
+
+    /// Execute a binary opcode.
+    pub fn binary_op(op: Opcode, lhs: &LogicValue, rhs: &LogicValue) -> LogicValue {
+        trace!("{} ({}, {})", op, lhs, rhs);
+        match op {
+            Opcode::And => return lhs.and(rhs),
+            Opcode::Or => return lhs.or(rhs),
+            Opcode::Xor => return lhs.xor(rhs),
+            _ => (),
+        }
+        let (lhs_int, rhs_int) = match (lhs.to_int(), rhs.to_int()) {
+            (Some(l), Some(r)) => (l, r),
+            _ => return LogicValue::unknown(lhs.width),
+        };
+        match op {
+            Opcode::Sdiv
+            | Opcode::Smod
+            | Opcode::Srem
+            | Opcode::Udiv
+            | Opcode::Umod
+            | Opcode::Urem
+                if rhs_int.is_zero() =>
+            {
+                LogicValue::unknown(lhs.width)
+            }
+            _ => LogicValue::from_int(&IntValue::binary_op(op, &lhs_int, &rhs_int)),
+        }
+    }
+
+    /// Execute a comparison opcode.
+    pub fn compare_op(op: Opcode, lhs: &LogicValue, rhs: &LogicValue) -> LogicValue {
+        if let (Some(l), Some(r)) = (lhs.to_int(), rhs.to_int()) {
+            return LogicValue::from_int(&IntValue::compare_op(op, &l, &r));
+        }
+        match op {
+            Opcode::Eq | Opcode::Neq => {
+                // The operands are definitely not equal if any of the bits
+                // known in both operands differ.
+                let differ = lhs
+                    .zip_words(rhs, |av, au, bv, bu| ((av ^ bv) & !au & !bu, 0))
+                    .value
+                    .iter()
+                    .any(|&w| w != 0);
+                if differ {
+                    LogicValue::from_int(&IntValue::from_usize(1, (op == Opcode::Neq) as usize))
+                } else {
+                    LogicValue::unknown(1)
+                }
+            }
+            _ => LogicValue::unknown(1),
+        }
+    }
+
+    /// Execute a `mux` with this value as a selector.
+    ///
+    /// All ways that the selector may select given its known bits are merged,
+    /// such that the result is `X` wherever these ways disagree.
+    pub fn mux(&self, ways: &ArrayValue) -> Value {
+        let len = ways.0.len();
+        let mask = low_mask(self.width);
+        let known = !self.unknown.first().cloned().unwrap_or(0) & mask;
+        let value = self.value.first().cloned().unwrap_or(0) & known;
+
+        // Selectors which are definitely out of bounds pick the last way.
+        let upper = self.value.iter().zip(self.unknown.iter()).skip(1);
+        if upper.clone().any(|(&v, &u)| v & !u != 0) {
+            return ways.0[len - 1].clone();
+        }
+        let upper = upper.any(|(_, &u)| u != 0);
+        let max = (value | !known) & mask;
+
+        let mut result: Option<Value> = None;
+        for (i, way) in ways.0.iter().enumerate() {
+            let i = i as u64;
+            let candidate = i & !mask == 0 && (i ^ value) & known == 0;
+            let clamped = i + 1 == len as u64 && (upper || max >= len as u64);
+            if candidate || clamped {
+                result = Some(match result {
+                    Some(r) => r.merge_unknown(way),
+                    None => way.clone(),
+                });
+            }
+        }
+        result.expect("mux selector matches no way")
+    }
+}
+
+/// Arrays of integers with at least this many elements are stored as a
+/// `MemoryValue` instead of an `ArrayValue`.
+pub const MEMORY_THRESHOLD: usize = 1024;
+
+/// The number of elements in each page of a `MemoryValue`.
+const MEMORY_PAGE_SIZE: usize = 256;
+
+/// A large array of integers, stored as sparse pages.
+///
+/// Pages are allocated upon the first write to one of their elements, and
+/// store the elements packed at their bit width. Elements in unallocated pages
+/// read as the memory's initial value. The unknown bits of four-state elements
+/// are kept in a separate set of pages, which only exist where such elements
+/// were written. Pages are shared among clones of a memory and only copied
+/// upon modification.
+#[derive(Clone)]
+pub struct MemoryValue {
+    /// The number of elements.
+    pub length: usize,
+    /// The initial value of all elements.
+    pub init: IntValue,
+    /// The allocated value pages.
+    pages: HashMap<usize, Arc<Vec<u64>>>,
+    /// The allocated unknown pages.
+    unknown: HashMap<usize, Arc<Vec<u64>>>,
+}
+
+impl MemoryValue {
+    /// Create a new memory with all elements set to `init`.
+    pub fn new(length: usize, init: IntValue) -> Self {
+        Self {
+            length,
+            init,
+            pages: HashMap::new(),
+            unknown: HashMap::new(),
+        }
+    }
+
+    /// Get the width of each element in bits.
+    pub fn width(&self) -> usize {
+        self.init.width
+    }
+
+    /// Get the number of allocated pages.
+    pub fn num_pages(&self) -> usize {
+        self.pages.len()
+    }
+
+    /// Get the number of words in a page.
+    fn page_words(&self) -> usize {
+        num_words(MEMORY_PAGE_SIZE * self.width())
+    }
+
+    /// Create a page with all elements set to the initial value.
+    fn init_page(&self) -> Vec<u64> {
+        let width = self.width();
+        let mut page = vec![0; self.page_words()];
+        if !self.init.is_zero() {
+            let init = self.init.value.limbs();
+            for i in 0..MEMORY_PAGE_SIZE {
+                insert_bits(&mut page, i * width, width, init);
+            }
+        }
+        page
+    }
+
+    /// Get the contents of a value page, allocated or not.
+    fn value_page(&self, page: usize) -> Cow<[u64]> {
+        match self.pages.get(&page) {
+            Some(p) => Cow::Borrowed(&p[..]),
+            None => Cow::Owned(self.init_page()),
+        }
+    }
+
+    /// Get the contents of an unknown page, allocated or not.
+    fn unknown_page(&self, page: usize) -> Cow<[u64]> {
+        match self.unknown.get(&page) {
+            Some(p) => Cow::Borrowed(&p[..]),
+            None => Cow::Owned(vec![0; self.page_words()]),
+        }
+    }
+
+    /// Convert into an array value.
+    pub fn to_array(&self) -> ArrayValue {
+        ArrayValue::new((0..self.length).map(|i| self.extract_field(i)).collect())
+    }
+}
+
+impl PartialEq for MemoryValue {
+    fn eq(&self, other: &Self) -> bool {
+        if self.length != other.length || self.width() != other.width() {
+            return false;
+        }
+        if self.init != other.init {
+            return (0..self.length).all(|i| self.extract_field(i) == other.extract_field(i));
+        }
+        let pages: HashSet<usize> = self
+            .pages
+            .keys()
+            .chain(other.pages.keys())
+            .cloned()
+            .collect();
+        pages.into_iter().all(|page| {
+            self.value_page(page) == other.value_page(page)
+                && self.unknown_page(page) == other.unknown_page(page)
+        })
+    }
+}
+
+impl Eq for MemoryValue {}
+
+impl Display for MemoryValue {
+    fn fmt(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
+        write!(
+            f,
+            "[{} x {}; {} pages]",
+            self.length,
+            self.init,
+            self.pages.len()
+        )
+    }
+}
+
+impl Debug for MemoryValue {
+    fn fmt(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
+        write!(f, "{}", self)
+    }
+}
+
+/// Slicing.
+impl MemoryValue {
+    /// Extract a single element from the memory.
+    pub fn extract_field(&self, idx: usize) -> Value {
+        assert!(idx < self.length);
+        let width = self.width();
+        let page = idx / MEMORY_PAGE_SIZE;
+        let off = idx % MEMORY_PAGE_SIZE * width;
+        let value = match self.pages.get(&page) {
+            Some(p) => extract_bits(p, off, width),
+            None => return self.init.clone().into(),
+        };
+        match self.unknown.get(&page) {
+            Some(u) => LogicValue {
+                width,
+                value,
+                unknown: extract_bits(u, off, width),
+            }
+            .into_value(),
+            None => int_from_words(width, &value).into(),
+        }
+    }
+
+    /// Extract a slice of elements from the memory.
+    ///
+    /// Short slices are returned as a regular array.
+    pub fn extract_slice(&self, off: usize, len: usize) -> Value {
+        assert!(off + len <= self.length);
+        if len < MEMORY_THRESHOLD {
+            return ArrayValue::new((off..off + len).map(|i| self.extract_field(i)).collect())
+                .into();
+        }
+        let mut result = MemoryValue::new(len, self.init.clone());
+        for &page in self.pages.keys() {
+            let lo = std::cmp::max(page * MEMORY_PAGE_SIZE, off);
+            let hi = std::cmp::min((page + 1) * MEMORY_PAGE_SIZE, off + len);
+            for idx in lo..hi {
+                result.insert_field(idx - off, &self.extract_field(idx));
+            }
+        }
+        result.into()
+    }
+
+    /// Insert a single element into the memory.
+    pub fn insert_field(&mut self, idx: usize, value: &Value) {
+        assert!(idx < self.length);
+        let width = self.width();
+        let page = idx / MEMORY_PAGE_SIZE;
+        let off = idx % MEMORY_PAGE_SIZE * width;
+        let (bits, unknown) = match value {
+            Value::Int(v) if v.width == width => (v.value.limbs(), None),
+            Value::Logic(v) if v.width == width => (&v.value[..], Some(&v.unknown)),
+            _ => panic!("cannot store {} in memory of i{}", value, width),
+        };
+        if !self.pages.contains_key(&page) {
+            let p = self.init_page();
+            self.pages.insert(page, Arc::new(p));
+        }
+        let p = self.pages.get_mut(&page).unwrap();
+        insert_bits(Arc::make_mut(p), off, width, bits);
+        match unknown {
+            Some(u) => {
+                let words = self.page_words();
+                let p = self
+                    .unknown
+                    .entry(page)
+                    .or_insert_with(|| Arc::new(vec![0; words]));
+                insert_bits(Arc::make_mut(p), off, width, u);
+            }
+            None => {
+                if let Some(p) = self.unknown.get_mut(&page) {
+                    insert_bits(Arc::make_mut(p), off, width, &vec![0; num_words(width)]);
+                }
+            }
+        }
+    }
+
+    /// Insert a slice of elements into the memory.
+    pub fn insert_slice(&mut self, off: usize, len: usize, value: &Value) {
+        match value {
+            Value::Array(v) => {
+                assert_eq!(len, v.0.len());
+                for (i, elem) in v.0.iter().enumerate() {
+                    self.insert_field(off + i, elem);
+                }
+            }
+            Value::Memory(v) => {
+                assert_eq!(len, v.length);
+                for i in 0..len {
+                    self.insert_field(off + i, &v.extract_field(i));
+                }
+            }
+            _ => panic!("cannot insert {} into memory", value),
+        }
+    }
+}
+
 /// An array value.
+///
+/// The elements are shared between clones of the array, and only copied once
+/// one of the clones is modified.
 #[derive(Clone, PartialEq, Eq)]
-pub struct ArrayValue(pub Vec<Value>);
+pub struct ArrayValue(pub Arc<Vec<Value>>);
 
 impl ArrayValue {
     /// Create a new uniform array.
     pub fn new_uniform(length: usize, value: Value) -> Self {
-        ArrayValue(std::iter::repeat(value).take(length).collect())
+        ArrayValue(Arc::new(std::iter::repeat(value).take(length).collect()))
     }
 
     /// Create a new array.
     pub fn new(values: Vec<Value>) -> Self {
-        ArrayValue(values)
+        ArrayValue(Arc::new(values))
     }
 }
 
@@ -453,7 +1222,7 @@ impl Display for ArrayValue {
     fn fmt(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
         let mut first = true;
         write!(f, "[")?;
-        for v in &self.0 {
+        for v in self.0.iter() {
             if !first {
                 write!(f, ", ")?;
             }
@@ -479,29 +1248,48 @@ impl ArrayValue {
 
     /// Extract a slice of elements from the array.
     pub fn extract_slice(&self, off: usize, len: usize) -> ArrayValue {
+        if off == 0 && len == self.0.len() {
+            return self.clone();
+        }
         ArrayValue::new(self.0[off..off + len].to_vec())
     }
 
+    /// Access a single element of the array for modification.
+    ///
+    /// Copies the elements first if they are shared with another array.
+    pub fn field_mut(&mut self, idx: usize) -> &mut Value {
+        &mut Arc::make_mut(&mut self.0)[idx]
+    }
+
     /// Insert a single element into the array.
+    ///
+    /// Copies the elements first if they are shared with another array.
     pub fn insert_field(&mut self, idx: usize, value: Value) {
-        self.0[idx] = value;
+        Arc::make_mut(&mut self.0)[idx] = value;
     }
 
     /// Insert a slice of elements into the array.
+    ///
+    /// Copies the elements first if they are shared with another array.
     pub fn insert_slice(&mut self, off: usize, len: usize, value: &ArrayValue) {
         assert_eq!(len, value.0.len());
-        self.0[off..off + len].clone_from_slice(&value.0);
+        if Arc::ptr_eq(&self.0, &value.0) {
+            return;
+        }
+        Arc::make_mut(&mut self.0)[off..off + len].clone_from_slice(&value.0);
     }
 }
 
 /// A struct value.
+///
+/// Like arrays, the fields are shared between clones of the struct.
 #[derive(Clone, PartialEq, Eq)]
-pub struct StructValue(pub Vec<Value>);
+pub struct StructValue(pub Arc<Vec<Value>>);
 
 impl StructValue {
     /// Create a new struct.
     pub fn new(values: Vec<Value>) -> Self {
-        StructValue(values)
+        StructValue(Arc::new(values))
     }
 }
 
@@ -509,7 +1297,7 @@ impl Display for StructValue {
     fn fmt(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
         let mut first = true;
         write!(f, "{{")?;
-        for v in &self.0 {
+        for v in self.0.iter() {
             if !first {
                 write!(f, ", ")?;
             }
@@ -534,7 +1322,120 @@ impl StructValue {
     }
 
     /// Insert a field into the struct.
+    ///
+    /// Copies the fields first if they are shared with another struct.
     pub fn insert_field(&mut self, idx: usize, value: Value) {
-        self.0[idx] = value;
+        Arc::make_mut(&mut self.0)[idx] = value;
+    }
+
+    /// Access a single field of the struct for modification.
+    ///
+    /// Copies the fields first if they are shared with another struct.
+    pub fn field_mut(&mut self, idx: usize) -> &mut Value {
+        &mut Arc::make_mut(&mut self.0)[idx]
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn logic(bits: &str) -> LogicValue {
+        let mut v = LogicValue::zero(bits.len());
+        for (i, c) in bits.chars().rev().enumerate() {
+            let (w, s) = (i / 64, i % 64);
+            match c {
+                '1' => v.value[w] |= 1 << s,
+                'X' => {
+                    v.value[w] |= 1 << s;
+                    v.unknown[w] |= 1 << s;
+                }
+                'Z' => v.unknown[w] |= 1 << s,
+                _ => (),
+            }
+        }
+        v
+    }
+
+    #[test]
+    fn logic_bitwise() {
+        let a = logic("0011XXZZ");
+        let b = logic("01X001X1");
+        assert_eq!(a.not(), logic("1100XXXX"));
+        assert_eq!(a.and(&b), logic("00X00XXX"));
+        assert_eq!(a.or(&b), logic("0111X1X1"));
+        assert_eq!(a.xor(&b), logic("01X1XXXX"));
+    }
+
+    #[test]
+    fn logic_slices() {
+        let mut v = LogicValue::zero(130);
+        v.insert_slice(60, 10, &logic("1XZ0011XZ1"));
+        assert_eq!(v.extract_slice(60, 10), logic("1XZ0011XZ1"));
+        assert_eq!(v.extract_slice(58, 4), logic("Z100"));
+        assert_eq!(v.extract_slice(68, 4), logic("001X"));
+        assert!(v.extract_slice(0, 60).is_known());
+    }
+
+    #[test]
+    fn logic_arithmetic() {
+        let a = logic("0101");
+        let b = logic("0X01");
+        assert_eq!(LogicValue::binary_op(Opcode::Add, &a, &a), logic("1010"));
+        assert_eq!(
+            LogicValue::binary_op(Opcode::Add, &a, &b),
+            LogicValue::unknown(4)
+        );
+        assert_eq!(
+            LogicValue::binary_op(Opcode::Udiv, &a, &logic("0000")),
+            LogicValue::unknown(4)
+        );
+        assert_eq!(
+            LogicValue::compare_op(Opcode::Eq, &a, &b),
+            LogicValue::unknown(1)
+        );
+        assert_eq!(
+            LogicValue::compare_op(Opcode::Neq, &a, &logic("1X01")),
+            logic("1")
+        );
+    }
+
+    #[test]
+    fn logic_mux() {
+        let ways = ArrayValue::new(vec![
+            IntValue::from_usize(4, 0b0011).into(),
+            IntValue::from_usize(4, 0b0101).into(),
+            IntValue::from_usize(4, 0b0111).into(),
+        ]);
+        assert_eq!(logic("0X").mux(&ways), Value::Logic(logic("0XX1")));
+        assert_eq!(logic("X1").mux(&ways), Value::Logic(logic("01X1")));
+    }
+
+    #[test]
+    fn memory_elements() {
+        let init = IntValue::from_usize(12, 0xabc);
+        let mut mem = MemoryValue::new(100_000, init.clone());
+        assert_eq!(mem.extract_field(4711), Value::from(init.clone()));
+        mem.insert_field(4711, &IntValue::from_usize(12, 0x123).into());
+        mem.insert_field(4712, &logic("0000XXXX1111").into());
+        assert_eq!(mem.num_pages(), 1);
+        assert_eq!(mem.extract_field(4710), Value::from(init.clone()));
+        assert_eq!(
+            mem.extract_field(4711),
+            Value::from(IntValue::from_usize(12, 0x123))
+        );
+        assert_eq!(mem.extract_field(4712), Value::from(logic("0000XXXX1111")));
+        assert_eq!(mem.extract_field(4713), Value::from(init.clone()));
+
+        let mut other = mem.clone();
+        assert_eq!(mem, other);
+        other.insert_field(4712, &init.clone().into());
+        assert_ne!(mem, other);
+        mem.insert_field(4712, &init.clone().into());
+        assert_eq!(mem, other);
+        assert_eq!(
+            mem.extract_slice(4710, 3).to_elements()[1],
+            mem.extract_field(4711)
+        );
     }
 }
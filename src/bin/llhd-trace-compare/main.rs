@@ -0,0 +1,371 @@
+// Copyright (c) 2017-2021 Fabian Schuiki
+
+//! A tool to compare simulation traces
+//!
+//! Streams two traces and aligns their value changes by signal name and
+//! physical time. The signals are distributed across a set of worker threads,
+//! each of which tracks the current values of its share of the signals and
+//! reports the points in time where the two traces disagree.
+
+#[macro_use]
+extern crate clap;
+#[macro_use]
+extern crate log;
+
+use crate::reader::{Step, TraceReader};
+use anyhow::{anyhow, bail, Context, Result};
+use clap::Arg;
+use num::BigRational;
+use regex::RegexSet;
+use std::{
+    collections::{hash_map::DefaultHasher, HashMap},
+    hash::{Hash, Hasher},
+    sync::{
+        atomic::{AtomicUsize, Ordering},
+        mpsc::sync_channel,
+        Arc,
+    },
+};
+
+mod reader;
+
+/// The number of steps the shard workers may lag behind the trace readers.
+const SHARD_LOOKAHEAD: usize = 64;
+
+fn main() -> Result<()> {
+    // Configure the logger.
+    pretty_env_logger::init_custom_env("LLHD_LOG");
+
+    // Parse the command line arguments.
+    let matches = app_from_crate!()
+        .about("A tool to compare simulation traces.")
+        .arg(
+            Arg::with_name("EXPECTED")
+                .help("The reference trace")
+                .required(true)
+                .index(1),
+        )
+        .arg(
+            Arg::with_name("ACTUAL")
+                .help("The trace to compare against the reference")
+                .required(true)
+                .index(2),
+        )
+        .arg(
+            Arg::with_name("max-mismatches")
+                .short("n")
+                .long("max-mismatches")
+                .takes_value(true)
+                .default_value("10")
+                .help("Report at most this many mismatches"),
+        )
+        .arg(
+            Arg::with_name("signal")
+                .short("s")
+                .long("signal")
+                .takes_value(true)
+                .multiple(true)
+                .number_of_values(1)
+                .help("Only compare signals whose name matches this regex"),
+        )
+        .arg(
+            Arg::with_name("start")
+                .long("start")
+                .takes_value(true)
+                .help("Only compare value changes at or after this time"),
+        )
+        .arg(
+            Arg::with_name("end")
+                .long("end")
+                .takes_value(true)
+                .help("Only compare value changes at or before this time"),
+        )
+        .arg(
+            Arg::with_name("jobs")
+                .short("j")
+                .long("jobs")
+                .takes_value(true)
+                .help("Number of worker threads to compare signals on"),
+        )
+        .get_matches();
+
+    // Parse the comparison options.
+    let max_mismatches: usize = matches
+        .value_of("max-mismatches")
+        .unwrap()
+        .parse()
+        .context("invalid number of mismatches")?;
+    let filter = match matches.values_of("signal") {
+        Some(patterns) => Some(RegexSet::new(patterns).context("invalid signal pattern")?),
+        None => None,
+    };
+    let parse_time = |name: &str| -> Result<Option<BigRational>> {
+        match matches.value_of(name) {
+            Some(s) => Ok(Some(
+                llhd::assembly::parse_time(s)
+                    .map_err(|e| anyhow!("{}", e))
+                    .with_context(|| format!("invalid {} time `{}`", name, s))?
+                    .time(),
+            )),
+            None => Ok(None),
+        }
+    };
+    let start = parse_time("start")?;
+    let end = parse_time("end")?;
+    let jobs = match matches.value_of("jobs") {
+        Some(j) => j.parse().context("invalid number of jobs")?,
+        None => rayon::current_num_threads(),
+    };
+
+    // Compare the traces.
+    let mut expected = TraceReader::open(matches.value_of("EXPECTED").unwrap())?;
+    let mut actual = TraceReader::open(matches.value_of("ACTUAL").unwrap())?;
+    let options = Options {
+        max_mismatches,
+        filter,
+        start,
+        end,
+        jobs: std::cmp::max(jobs, 1),
+    };
+    let result = compare(&mut expected, &mut actual, &options)?;
+
+    // Report the results.
+    for m in &result.mismatches {
+        println!(
+            "{} {}: expected {}, got {}",
+            llhd::TimeValue::new(m.time.clone(), 0, 0),
+            m.signal,
+            m.expected.as_ref().map(String::as_str).unwrap_or("nothing"),
+            m.actual.as_ref().map(String::as_str).unwrap_or("nothing"),
+        );
+    }
+    for name in &result.unmatched {
+        warn!("Signal {} only present in one of the traces", name);
+    }
+    if !result.mismatches.is_empty() {
+        bail!(
+            "traces differ{}",
+            if result.truncated {
+                format!(" (first {} mismatches shown)", max_mismatches)
+            } else {
+                String::new()
+            }
+        );
+    }
+    info!("Traces match");
+    Ok(())
+}
+
+/// The options of a comparison.
+struct Options {
+    /// The number of mismatches after which the comparison stops.
+    max_mismatches: usize,
+    /// The signals to compare. All signals if `None`.
+    filter: Option<RegexSet>,
+    /// The time from which on to compare signals.
+    start: Option<BigRational>,
+    /// The time up to which to compare signals.
+    end: Option<BigRational>,
+    /// The number of worker threads to distribute the signals across.
+    jobs: usize,
+}
+
+/// The outcome of a comparison.
+#[derive(Default)]
+struct Comparison {
+    /// The earliest mismatches, ordered by time and signal name.
+    mismatches: Vec<Mismatch>,
+    /// Whether more mismatches than the ones reported exist.
+    truncated: bool,
+    /// The signals which only appeared in one of the traces.
+    unmatched: Vec<Arc<str>>,
+}
+
+/// A point in time where the traces disagree on the value of a signal.
+struct Mismatch {
+    time: BigRational,
+    signal: Arc<str>,
+    expected: Option<String>,
+    actual: Option<String>,
+}
+
+/// The value changes of one step, sent to a shard worker.
+struct ShardStep {
+    time: BigRational,
+    compare: bool,
+    expected: Vec<(Arc<str>, String)>,
+    actual: Vec<(Arc<str>, String)>,
+}
+
+/// Compare two traces.
+fn compare(
+    expected: &mut TraceReader,
+    actual: &mut TraceReader,
+    options: &Options,
+) -> Result<Comparison> {
+    // Spawn the shard workers.
+    let found = Arc::new(AtomicUsize::new(0));
+    let mut shards = vec![];
+    let mut workers = vec![];
+    for _ in 0..options.jobs {
+        let (tx, rx) = sync_channel::<ShardStep>(SHARD_LOOKAHEAD);
+        let mut worker = ShardWorker::new(found.clone(), options.max_mismatches);
+        shards.push(tx);
+        workers.push(std::thread::spawn(move || {
+            for step in rx {
+                worker.apply(step);
+            }
+            worker.finish()
+        }));
+    }
+
+    // Merge the two traces by time and distribute the changes among the
+    // shards. Stop early once enough mismatches have been found, since all
+    // mismatches at earlier points in time have been dispatched by then.
+    let mut filter_cache: HashMap<Arc<str>, bool> = HashMap::new();
+    while found.load(Ordering::Relaxed) < options.max_mismatches {
+        let time = match (expected.peek_time()?, actual.peek_time()?) {
+            (Some(a), Some(b)) => std::cmp::min(a, b).clone(),
+            (Some(t), None) | (None, Some(t)) => t.clone(),
+            (None, None) => break,
+        };
+        if options.end.as_ref().map(|end| &time > end).unwrap_or(false) {
+            break;
+        }
+        let compare = options
+            .start
+            .as_ref()
+            .map(|start| &time >= start)
+            .unwrap_or(true);
+        let mut split = |reader: &mut TraceReader| -> Result<Vec<Vec<_>>> {
+            let mut changes = vec![vec![]; shards.len()];
+            if reader.peek_time()? == Some(&time) {
+                let Step { changes: all, .. } = reader.next()?.unwrap();
+                for (name, value) in all {
+                    let selected = match options.filter {
+                        Some(ref filter) => *filter_cache
+                            .entry(name.clone())
+                            .or_insert_with(|| filter.is_match(&name)),
+                        None => true,
+                    };
+                    if selected {
+                        changes[shard_of(&name, shards.len())].push((name, value));
+                    }
+                }
+            }
+            Ok(changes)
+        };
+        let expected_changes = split(&mut *expected)?;
+        let actual_changes = split(&mut *actual)?;
+        for ((shard, expected), actual) in shards.iter().zip(expected_changes).zip(actual_changes) {
+            if expected.is_empty() && actual.is_empty() {
+                continue;
+            }
+            shard
+                .send(ShardStep {
+                    time: time.clone(),
+                    compare,
+                    expected,
+                    actual,
+                })
+                .map_err(|_| anyhow!("comparison worker terminated"))?;
+        }
+    }
+    drop(shards);
+
+    // Merge the outcomes of the shards.
+    let mut result = Comparison::default();
+    for worker in workers {
+        let outcome = worker
+            .join()
+            .map_err(|_| anyhow!("comparison worker panicked"))?;
+        result.truncated |= outcome.truncated;
+        result.mismatches.extend(outcome.mismatches);
+        result.unmatched.extend(outcome.unmatched);
+    }
+    result
+        .mismatches
+        .sort_by(|a, b| (&a.time, &a.signal).cmp(&(&b.time, &b.signal)));
+    if result.mismatches.len() > options.max_mismatches {
+        result.mismatches.truncate(options.max_mismatches);
+        result.truncated = true;
+    }
+    result.unmatched.sort();
+    Ok(result)
+}
+
+/// Determine which shard a signal is assigned to.
+fn shard_of(name: &str, num_shards: usize) -> usize {
+    let mut hasher = DefaultHasher::new();
+    name.hash(&mut hasher);
+    hasher.finish() as usize % num_shards
+}
+
+/// A worker that compares a share of the signals.
+struct ShardWorker {
+    found: Arc<AtomicUsize>,
+    max_mismatches: usize,
+    /// The current expected and actual value of each signal.
+    values: HashMap<Arc<str>, (Option<String>, Option<String>)>,
+    outcome: Comparison,
+}
+
+impl ShardWorker {
+    fn new(found: Arc<AtomicUsize>, max_mismatches: usize) -> Self {
+        Self {
+            found,
+            max_mismatches,
+            values: HashMap::new(),
+            outcome: Default::default(),
+        }
+    }
+
+    /// Apply the changes of one step and compare the affected signals.
+    ///
+    /// Signals are only compared once both traces have provided a value for
+    /// them, such that differences in what the traces record initially do not
+    /// count as mismatches.
+    fn apply(&mut self, step: ShardStep) {
+        let mut changed = Vec::with_capacity(step.expected.len() + step.actual.len());
+        for (name, value) in step.expected {
+            self.values.entry(name.clone()).or_default().0 = Some(value);
+            changed.push(name);
+        }
+        for (name, value) in step.actual {
+            self.values.entry(name.clone()).or_default().1 = Some(value);
+            changed.push(name);
+        }
+        if !step.compare {
+            return;
+        }
+        changed.sort();
+        changed.dedup();
+        for name in changed {
+            let (expected, actual) = &self.values[&name];
+            if expected.is_none() || actual.is_none() || expected == actual {
+                continue;
+            }
+            if self.outcome.mismatches.len() >= self.max_mismatches {
+                self.outcome.truncated = true;
+                continue;
+            }
+            self.found.fetch_add(1, Ordering::Relaxed);
+            self.outcome.mismatches.push(Mismatch {
+                time: step.time.clone(),
+                signal: name.clone(),
+                expected: expected.clone(),
+                actual: actual.clone(),
+            });
+        }
+    }
+
+    /// Finish the comparison and return the outcome.
+    fn finish(mut self) -> Comparison {
+        for (name, (expected, actual)) in self.values {
+            if expected.is_none() || actual.is_none() {
+                self.outcome.unmatched.push(name);
+            }
+        }
+        self.outcome
+    }
+}
@@ -0,0 +1,308 @@
+// Copyright (c) 2017-2021 Fabian Schuiki
+
+//! Streaming trace readers
+//!
+//! This module implements readers for the VCD and dump traces emitted by
+//! `llhd-sim`. Each reader runs on a separate thread and sends the value
+//! changes of the trace to the consumer in physical time order, one step at a
+//! time. Delta and epsilon steps are collapsed, such that each step carries the
+//! final value of each signal that changed at that time.
+
+use anyhow::{anyhow, bail, Context, Result};
+use llhd::vcd::{parse_timescale, Tokens};
+use num::{pow, BigInt, BigRational};
+use std::{
+    collections::HashMap,
+    fs::File,
+    io::{BufRead, BufReader},
+    sync::{
+        mpsc::{sync_channel, Receiver, SyncSender},
+        Arc,
+    },
+};
+
+/// The number of steps a reader may run ahead of the consumer.
+const LOOKAHEAD: usize = 256;
+
+/// The value changes of a trace at one point in physical time.
+#[derive(Debug)]
+pub struct Step {
+    /// The physical time of the step, in seconds.
+    pub time: BigRational,
+    /// The signals that changed and their new canonical values.
+    pub changes: Vec<(Arc<str>, String)>,
+}
+
+/// A trace that is being read on a separate thread.
+pub struct TraceReader {
+    path: String,
+    rx: Receiver<Result<Step>>,
+    peeked: Option<Step>,
+}
+
+impl TraceReader {
+    /// Open a trace file and start reading it.
+    ///
+    /// The format is determined from the file extension, which may either be
+    /// `.vcd` or `.dump`.
+    pub fn open(path: &str) -> Result<TraceReader> {
+        let file = File::open(path).with_context(|| format!("failed to open {}", path))?;
+        let tokens = Tokens::new(BufReader::new(file));
+        let (tx, rx) = sync_channel(LOOKAHEAD);
+        if path.ends_with(".vcd") {
+            std::thread::spawn(move || finish(read_vcd(tokens, &tx), &tx));
+        } else if path.ends_with(".dump") {
+            std::thread::spawn(move || finish(read_dump(tokens, &tx), &tx));
+        } else {
+            bail!("Cannot determine trace format from file name `{}`", path);
+        }
+        Ok(TraceReader {
+            path: path.to_string(),
+            rx,
+            peeked: None,
+        })
+    }
+
+    /// Get the time of the next step in the trace.
+    pub fn peek_time(&mut self) -> Result<Option<&BigRational>> {
+        if self.peeked.is_none() {
+            self.peeked = match self.rx.recv() {
+                Ok(step) => Some(step.with_context(|| format!("failed to read {}", self.path))?),
+                Err(_) => None,
+            };
+        }
+        Ok(self.peeked.as_ref().map(|s| &s.time))
+    }
+
+    /// Get the next step in the trace.
+    pub fn next(&mut self) -> Result<Option<Step>> {
+        self.peek_time()?;
+        Ok(self.peeked.take())
+    }
+}
+
+/// Forward a reader thread's error to the consumer.
+fn finish(result: Result<()>, tx: &SyncSender<Result<Step>>) {
+    if let Err(e) = result {
+        let _ = tx.send(Err(e));
+    }
+}
+
+/// A step that is being assembled from the value changes in a trace.
+struct StepBuilder<'a> {
+    tx: &'a SyncSender<Result<Step>>,
+    time: BigRational,
+    changes: Vec<(Arc<str>, String)>,
+    index: HashMap<Arc<str>, usize>,
+}
+
+impl<'a> StepBuilder<'a> {
+    fn new(tx: &'a SyncSender<Result<Step>>) -> Self {
+        Self {
+            tx,
+            time: num::zero(),
+            changes: vec![],
+            index: HashMap::new(),
+        }
+    }
+
+    /// Record the change of a signal, overriding any earlier change in the same
+    /// step.
+    fn change(&mut self, name: &Arc<str>, value: String) {
+        match self.index.get(name) {
+            Some(&i) => self.changes[i].1 = value,
+            None => {
+                self.index.insert(name.clone(), self.changes.len());
+                self.changes.push((name.clone(), value));
+            }
+        }
+    }
+
+    /// Advance to a new point in time. Returns false if the consumer has hung
+    /// up and reading should stop.
+    fn advance(&mut self, time: BigRational) -> Result<bool> {
+        if time < self.time {
+            bail!("time goes backwards from {} to {}", self.time, time);
+        }
+        if time == self.time {
+            return Ok(true);
+        }
+        let time = std::mem::replace(&mut self.time, time);
+        Ok(self.flush(time))
+    }
+
+    /// Send the assembled step to the consumer.
+    fn flush(&mut self, time: BigRational) -> bool {
+        self.index.clear();
+        let changes = std::mem::replace(&mut self.changes, vec![]);
+        changes.is_empty() || self.tx.send(Ok(Step { time, changes })).is_ok()
+    }
+}
+
+/// Bring a string of bits, most significant bit first, into a canonical form.
+///
+/// Leading bits that the VCD format would implicitly extend the value with are
+/// removed, such that values of different widths compare equal if they
+/// describe the same bits.
+pub fn canonicalize_bits(bits: &str) -> String {
+    let bits = bits.to_ascii_lowercase();
+    let b = bits.as_bytes();
+    let mut start = 0;
+    while start + 1 < b.len() {
+        match (b[start], b[start + 1]) {
+            (b'0', b'0') | (b'0', b'1') | (b'x', b'x') | (b'z', b'z') => start += 1,
+            _ => break,
+        }
+    }
+    bits[start..].to_string()
+}
+
+/// Read a VCD file.
+fn read_vcd<R: BufRead>(mut tokens: Tokens<R>, tx: &SyncSender<Result<Step>>) -> Result<()> {
+    // Parse the header, assembling the hierarchical names of the variables.
+    let mut timescale = parse_timescale("1ps").unwrap();
+    let mut scopes: Vec<String> = vec![];
+    let mut ids: HashMap<String, Vec<Arc<str>>> = HashMap::new();
+    loop {
+        let token = tokens.expect_token()?;
+        match token.as_str() {
+            "$enddefinitions" => {
+                tokens.skip_to_end()?;
+                break;
+            }
+            "$timescale" => {
+                timescale = parse_timescale(&tokens.skip_to_end()?.concat())
+                    .map_err(|e| anyhow!("{}", e))?;
+            }
+            "$scope" => {
+                let scope = tokens.skip_to_end()?;
+                let name = scope.get(1).map(|s| s.as_str()).unwrap_or("");
+                scopes.push(
+                    name.trim_start_matches(|c: char| c == '@' || c == '%')
+                        .to_string(),
+                );
+            }
+            "$upscope" => {
+                tokens.skip_to_end()?;
+                scopes.pop();
+            }
+            "$var" => {
+                let var = tokens.skip_to_end()?;
+                if var.len() < 4 {
+                    bail!("invalid variable declaration `{}`", var.join(" "));
+                }
+                // Bit selects in the declaration are part of the name.
+                let mut name = scopes.join("/");
+                name.push('/');
+                name.push_str(&var[3..].concat());
+                ids.entry(var[2].clone())
+                    .or_insert_with(Vec::new)
+                    .push(name.into());
+            }
+            _ if token.starts_with('$') => {
+                tokens.skip_to_end()?;
+            }
+            _ => bail!("unexpected `{}` in header", token),
+        }
+    }
+
+    // Parse the value changes.
+    let mut step = StepBuilder::new(tx);
+    while let Some(token) = tokens.next_token()? {
+        let (value, id) = match token.as_bytes()[0] {
+            b'#' => {
+                let time: BigInt = token[1..]
+                    .parse()
+                    .with_context(|| format!("invalid time `{}`", token))?;
+                if !step.advance(BigRational::from_integer(time) * &timescale)? {
+                    return Ok(());
+                }
+                continue;
+            }
+            // Keywords such as `$dumpvars` carry no information here.
+            b'$' => continue,
+            b'b' | b'B' => (canonicalize_bits(&token[1..]), tokens.expect_token()?),
+            b'r' | b'R' => (token, tokens.expect_token()?),
+            _ => (canonicalize_bits(&token[..1]), token[1..].to_string()),
+        };
+        for name in ids.get(&id).into_iter().flatten() {
+            step.change(name, value.clone());
+        }
+    }
+    let time = step.time.clone();
+    step.flush(time);
+    Ok(())
+}
+
+/// Read a trace emitted by the `DumpTracer`.
+fn read_dump<R: BufRead>(mut tokens: Tokens<R>, tx: &SyncSender<Result<Step>>) -> Result<()> {
+    let precision = BigRational::from_integer(pow(BigInt::from(10), 12));
+    let mut names: HashMap<String, Arc<str>> = HashMap::new();
+    let mut step = StepBuilder::new(tx);
+    while let Some(line) = tokens.next_line()? {
+        // Lines that are not indented carry the time of the subsequent value
+        // changes, as `<time>ps <delta>d <epsilon>e`.
+        if !line.starts_with(' ') {
+            let time = line
+                .split_whitespace()
+                .next()
+                .filter(|t| t.ends_with("ps"))
+                .ok_or_else(|| anyhow!("invalid time `{}`", line))?;
+            let time: BigInt = time
+                .trim_end_matches("ps")
+                .parse()
+                .with_context(|| format!("invalid time `{}`", line))?;
+            if !step.advance(BigRational::from_integer(time) / &precision)? {
+                return Ok(());
+            }
+            continue;
+        }
+
+        // All other lines are value changes, as `<path> = <value>`.
+        let mut parts = line.trim().splitn(2, " = ");
+        let (path, value) = match (parts.next(), parts.next()) {
+            (Some(p), Some(v)) => (p, v),
+            _ => bail!("invalid value change `{}`", line),
+        };
+        let value = if value.starts_with("0x") {
+            let bits: String = value[2..]
+                .chars()
+                .map(|c| match c.to_digit(16) {
+                    Some(d) => format!("{:04b}", d),
+                    None => std::iter::repeat(c).take(4).collect(),
+                })
+                .collect();
+            canonicalize_bits(&bits)
+        } else {
+            value.to_string()
+        };
+        let name = match names.get(path) {
+            Some(name) => name.clone(),
+            None => {
+                let name: Arc<str> = path.into();
+                names.insert(path.to_string(), name.clone());
+                name
+            }
+        };
+        step.change(&name, value);
+    }
+    let time = step.time.clone();
+    step.flush(time);
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn canonical_bits() {
+        assert_eq!(canonicalize_bits("0"), "0");
+        assert_eq!(canonicalize_bits("0000"), "0");
+        assert_eq!(canonicalize_bits("0101"), "101");
+        assert_eq!(canonicalize_bits("0x1"), "0x1");
+        assert_eq!(canonicalize_bits("XX01"), "x01");
+        assert_eq!(canonicalize_bits("zzzz"), "z");
+        assert_eq!(canonicalize_bits("x0"), "x0");
+    }
+}
@@ -0,0 +1,239 @@
+// Copyright (c) 2017-2021 Fabian Schuiki
+
+//! Coverage database
+//!
+//! This module implements the binary format in which the simulator stores the
+//! coverage of a run. It is shared by the simulator and the `llhd-cov` tool,
+//! which merges the databases of multiple runs.
+//!
+//! The format is a sequence of little-endian fields:
+//!
+//! ```text
+//! "LLHDCOV" version:u8
+//! num_toggles:u32 { name:str width:u32 rise:[u64] fall:[u64] }*
+//! num_blocks:u32 { name:str count:u64 }*
+//! ```
+//!
+//! Strings are stored as their length as `u32`, followed by their UTF-8 bytes.
+//! The `rise` and `fall` bitmaps have one word per 64 bits of the signal.
+
+use std::{
+    collections::BTreeMap,
+    io::{Error, ErrorKind, Read, Result, Write},
+};
+
+/// The magic bytes at the beginning of every coverage database.
+const MAGIC: &[u8; 7] = b"LLHDCOV";
+
+/// The version of the format.
+const VERSION: u8 = 1;
+
+/// The coverage collected from one or more simulation runs.
+#[derive(Debug, Default, Clone, PartialEq, Eq)]
+pub struct Database {
+    /// The toggle coverage of each signal, by name.
+    pub toggles: BTreeMap<String, Toggles>,
+    /// The number of times each block was entered, by `unit.block` name.
+    pub blocks: BTreeMap<String, u64>,
+}
+
+/// The bits of a signal that have seen a rising or falling transition.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct Toggles {
+    /// The width of the signal.
+    pub width: usize,
+    /// The bits that changed from 0 to 1.
+    pub rise: Vec<u64>,
+    /// The bits that changed from 1 to 0.
+    pub fall: Vec<u64>,
+}
+
+impl Toggles {
+    /// Create an empty toggle bitmap for a signal of a given width.
+    pub fn new(width: usize) -> Self {
+        let words = (width + 63) / 64;
+        Self {
+            width,
+            rise: vec![0; words],
+            fall: vec![0; words],
+        }
+    }
+
+    /// Record the transitions from `old` to `new`. Only bits set in `known`
+    /// are considered.
+    pub fn update(&mut self, old: &[u64], new: &[u64], known: &[u64]) {
+        for (i, (rise, fall)) in self.rise.iter_mut().zip(&mut self.fall).enumerate() {
+            let old = old.get(i).copied().unwrap_or(0);
+            let new = new.get(i).copied().unwrap_or(0);
+            let toggled = (old ^ new) & known.get(i).copied().unwrap_or(0);
+            *rise |= toggled & new;
+            *fall |= toggled & old;
+        }
+    }
+
+    /// Return the number of bits that have toggled in both directions.
+    pub fn num_covered(&self) -> usize {
+        self.rise
+            .iter()
+            .zip(&self.fall)
+            .map(|(r, f)| (r & f).count_ones() as usize)
+            .sum()
+    }
+
+    /// Combine with the toggles of another run.
+    fn merge(&mut self, other: &Toggles) {
+        if other.width > self.width {
+            self.width = other.width;
+            self.rise.resize(other.rise.len(), 0);
+            self.fall.resize(other.fall.len(), 0);
+        }
+        for (a, b) in self.rise.iter_mut().zip(&other.rise) {
+            *a |= b;
+        }
+        for (a, b) in self.fall.iter_mut().zip(&other.fall) {
+            *a |= b;
+        }
+    }
+}
+
+impl Database {
+    /// Combine with the coverage of another run.
+    pub fn merge(mut self, other: Database) -> Database {
+        for (name, toggles) in other.toggles {
+            match self.toggles.get_mut(&name) {
+                Some(t) => t.merge(&toggles),
+                None => {
+                    self.toggles.insert(name, toggles);
+                }
+            }
+        }
+        for (name, count) in other.blocks {
+            let c = self.blocks.entry(name).or_insert(0);
+            *c = c.saturating_add(count);
+        }
+        self
+    }
+
+    /// Write the database.
+    pub fn write(&self, mut w: impl Write) -> Result<()> {
+        w.write_all(MAGIC)?;
+        w.write_all(&[VERSION])?;
+        write_u32(&mut w, self.toggles.len())?;
+        for (name, toggles) in &self.toggles {
+            write_str(&mut w, name)?;
+            write_u32(&mut w, toggles.width)?;
+            for &word in toggles.rise.iter().chain(&toggles.fall) {
+                w.write_all(&word.to_le_bytes())?;
+            }
+        }
+        write_u32(&mut w, self.blocks.len())?;
+        for (name, &count) in &self.blocks {
+            write_str(&mut w, name)?;
+            w.write_all(&count.to_le_bytes())?;
+        }
+        Ok(())
+    }
+
+    /// Read a database.
+    pub fn read(mut r: impl Read) -> Result<Database> {
+        let mut magic = [0; 8];
+        r.read_exact(&mut magic)?;
+        if &magic[..7] != MAGIC {
+            return Err(Error::new(
+                ErrorKind::InvalidData,
+                "not a coverage database",
+            ));
+        }
+        if magic[7] != VERSION {
+            return Err(Error::new(
+                ErrorKind::InvalidData,
+                format!("unsupported coverage database version {}", magic[7]),
+            ));
+        }
+        let mut db = Database::default();
+        for _ in 0..read_u32(&mut r)? {
+            let name = read_str(&mut r)?;
+            let mut toggles = Toggles::new(read_u32(&mut r)?);
+            for word in toggles.rise.iter_mut().chain(&mut toggles.fall) {
+                *word = read_u64(&mut r)?;
+            }
+            db.toggles.insert(name, toggles);
+        }
+        for _ in 0..read_u32(&mut r)? {
+            let name = read_str(&mut r)?;
+            db.blocks.insert(name, read_u64(&mut r)?);
+        }
+        Ok(db)
+    }
+}
+
+fn write_u32(w: &mut impl Write, v: usize) -> Result<()> {
+    w.write_all(&(v as u32).to_le_bytes())?;
+    Ok(())
+}
+
+fn write_str(w: &mut impl Write, s: &str) -> Result<()> {
+    write_u32(w, s.len())?;
+    w.write_all(s.as_bytes())?;
+    Ok(())
+}
+
+fn read_u32(r: &mut impl Read) -> Result<usize> {
+    let mut buf = [0; 4];
+    r.read_exact(&mut buf)?;
+    Ok(u32::from_le_bytes(buf) as usize)
+}
+
+fn read_u64(r: &mut impl Read) -> Result<u64> {
+    let mut buf = [0; 8];
+    r.read_exact(&mut buf)?;
+    Ok(u64::from_le_bytes(buf))
+}
+
+fn read_str(r: &mut impl Read) -> Result<String> {
+    let mut buf = vec![0; read_u32(r)?];
+    r.read_exact(&mut buf)?;
+    String::from_utf8(buf).map_err(|e| Error::new(ErrorKind::InvalidData, e))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn toggles() {
+        let mut t = Toggles::new(4);
+        t.update(&[0b0011], &[0b0101], &[0b1111]);
+        assert_eq!(t.rise, vec![0b0100]);
+        assert_eq!(t.fall, vec![0b0010]);
+        t.update(&[0b0101], &[0b0011], &[0b1011]);
+        assert_eq!(t.rise, vec![0b0110]);
+        assert_eq!(t.fall, vec![0b0010]);
+        assert_eq!(t.num_covered(), 1);
+    }
+
+    #[test]
+    fn merge_and_roundtrip() {
+        let mut a = Database::default();
+        let mut t = Toggles::new(8);
+        t.rise[0] = 0x0f;
+        a.toggles.insert("top/a".to_string(), t.clone());
+        a.blocks.insert("@top.entry".to_string(), 1);
+        let mut b = Database::default();
+        t.rise[0] = 0;
+        t.fall[0] = 0xf0;
+        b.toggles.insert("top/a".to_string(), t);
+        b.blocks.insert("@top.entry".to_string(), 2);
+        b.blocks.insert("@top.exit".to_string(), 0);
+
+        let merged = a.merge(b);
+        assert_eq!(merged.toggles["top/a"].rise, vec![0x0f]);
+        assert_eq!(merged.toggles["top/a"].fall, vec![0xf0]);
+        assert_eq!(merged.blocks["@top.entry"], 3);
+        assert_eq!(merged.blocks["@top.exit"], 0);
+
+        let mut buf = vec![];
+        merged.write(&mut buf).unwrap();
+        assert_eq!(Database::read(&buf[..]).unwrap(), merged);
+    }
+}
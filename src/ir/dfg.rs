@@ -7,17 +7,24 @@
 
 use crate::{
     impl_table_indexing,
-    ir::{Arg, Block, ExtUnit, ExtUnitData, Inst, InstData, Value, ValueData},
+    ir::{
+        footprint::hash_bytes, Arg, Block, ExtUnit, ExtUnitData, Inst, InstData, Value, ValueData,
+    },
     table::{PrimaryTable2, SecondaryTable},
+    value::{IntValue, TimeValue},
+};
+use std::{
+    collections::{HashMap, HashSet},
+    mem::size_of,
+    sync::Arc,
 };
-use std::collections::{HashMap, HashSet};
 
 /// A data flow graph.
 ///
 /// This is the main container for instructions, values, and the relationship
 /// between them. Every `Function`, `Process`, and `Entity` has an associated
 /// data flow graph.
-#[derive(Default, Serialize, Deserialize)]
+#[derive(Default, Clone, Serialize, Deserialize)]
 pub(super) struct DataFlowGraph {
     /// The instructions in the graph.
     pub insts: PrimaryTable2<Inst, InstData>,
@@ -39,6 +46,68 @@ pub(super) struct DataFlowGraph {
     pub value_uses: HashMap<Value, HashSet<Inst>>,
     /// The block use lookup table.
     pub block_uses: HashMap<Block, HashSet<Inst>>,
+    /// The constants used by instructions.
+    #[serde(skip)]
+    pub consts: ConstPool,
+}
+
+/// A pool of constants.
+///
+/// Constant instructions with the same value share a single copy of that value,
+/// which is stored in the pool. This keeps constant-heavy units, such as ROM
+/// initializations or lookup tables, from storing many copies of the same wide
+/// integer.
+#[derive(Default, Clone)]
+pub(super) struct ConstPool {
+    ints: HashSet<Arc<IntValue>>,
+    times: HashSet<Arc<TimeValue>>,
+    /// The number of constants after the last time unused ones were dropped.
+    last_size: usize,
+}
+
+impl ConstPool {
+    /// Replace the constant of an instruction with the pooled copy.
+    pub fn intern(&mut self, data: &mut InstData) {
+        match data {
+            InstData::ConstInt { imm, .. } => *imm = intern(&mut self.ints, imm),
+            InstData::ConstTime { imm, .. } => *imm = intern(&mut self.times, imm),
+            _ => return,
+        }
+
+        // Drop the constants that are no longer used by any instruction, once
+        // the pool has doubled in size. This keeps the cost amortized.
+        let size = self.ints.len() + self.times.len();
+        if size > 2 * self.last_size + 64 {
+            self.ints.retain(|c| Arc::strong_count(c) > 1);
+            self.times.retain(|c| Arc::strong_count(c) > 1);
+            self.last_size = self.ints.len() + self.times.len();
+        }
+    }
+
+    /// Get the number of bytes allocated by the pool and its constants.
+    pub fn allocated_bytes(&self) -> usize {
+        // Each constant is preceded by the reference counts of its `Arc`.
+        let arc = 2 * size_of::<usize>();
+        hash_bytes::<Arc<IntValue>>(self.ints.capacity())
+            + hash_bytes::<Arc<TimeValue>>(self.times.capacity())
+            + self
+                .ints
+                .iter()
+                .map(|c| arc + size_of::<IntValue>() + (c.width + 63) / 64 * 8)
+                .sum::<usize>()
+            + self.times.len() * (arc + size_of::<TimeValue>())
+    }
+}
+
+/// Look up a constant in a pool, or add it if it is not yet in the pool.
+fn intern<T: Eq + std::hash::Hash>(pool: &mut HashSet<Arc<T>>, value: &Arc<T>) -> Arc<T> {
+    match pool.get(value) {
+        Some(pooled) => pooled.clone(),
+        None => {
+            pool.insert(value.clone());
+            value.clone()
+        }
+    }
 }
 
 impl_table_indexing!(DataFlowGraph, insts, Inst, InstData);
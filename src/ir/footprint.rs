@@ -0,0 +1,197 @@
+// Copyright (c) 2017-2021 Fabian Schuiki
+
+//! Memory footprint of the IR.
+//!
+//! This module estimates how many bytes the tables of a unit occupy, broken
+//! down by what they are used for. The numbers are derived from the capacity
+//! of the underlying containers and the size of their entries. They do not
+//! account for allocator overhead and are thus a lower bound.
+
+use crate::{
+    ir::{Block, Inst, InstData, Module, Unit, UnitData, Value, ValueData},
+    ty::{Type, TypeKind},
+};
+use std::{
+    collections::HashSet,
+    mem::size_of,
+    ops::{Add, AddAssign},
+    sync::Arc,
+};
+
+/// The memory used by a unit or module, in bytes.
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub struct Footprint {
+    /// The instructions, values, blocks, and their results and arguments.
+    pub insts: usize,
+    /// The operand vectors of instructions with a variable number of operands.
+    pub operands: usize,
+    /// The value and block use-lists.
+    pub uses: usize,
+    /// The names and name, location, and anonymous hints.
+    pub names: usize,
+    /// The block and instruction layout.
+    pub layout: usize,
+    /// The types of values.
+    pub types: usize,
+}
+
+impl Footprint {
+    /// The total number of bytes used.
+    pub fn total(&self) -> usize {
+        self.insts + self.operands + self.uses + self.names + self.layout + self.types
+    }
+}
+
+impl Add for Footprint {
+    type Output = Footprint;
+
+    fn add(mut self, other: Footprint) -> Footprint {
+        self += other;
+        self
+    }
+}
+
+impl AddAssign for Footprint {
+    fn add_assign(&mut self, other: Footprint) {
+        self.insts += other.insts;
+        self.operands += other.operands;
+        self.uses += other.uses;
+        self.names += other.names;
+        self.layout += other.layout;
+        self.types += other.types;
+    }
+}
+
+impl std::iter::Sum for Footprint {
+    fn sum<I: Iterator<Item = Footprint>>(iter: I) -> Footprint {
+        iter.fold(Default::default(), Add::add)
+    }
+}
+
+impl std::fmt::Display for Footprint {
+    fn fmt(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
+        write!(
+            f,
+            "{} bytes (insts {}, operands {}, uses {}, names {}, layout {}, types {})",
+            self.total(),
+            self.insts,
+            self.operands,
+            self.uses,
+            self.names,
+            self.layout,
+            self.types
+        )
+    }
+}
+
+impl Unit<'_> {
+    /// Estimate the memory used by the unit.
+    ///
+    /// Types are counted once per allocation. Equal types that have been
+    /// created separately are counted separately.
+    pub fn footprint(self) -> Footprint {
+        let UnitData {
+            dfg, cfg, layout, ..
+        } = self.data();
+        let mut fp = Footprint::default();
+
+        fp.insts = size_of::<UnitData>()
+            + dfg.insts.allocated_bytes()
+            + hash_bytes::<(usize, Value)>(dfg.results.storage.capacity())
+            + dfg.values.allocated_bytes()
+            + hash_bytes::<(usize, Value)>(dfg.args.storage.capacity())
+            + dfg.ext_units.allocated_bytes()
+            + cfg.blocks.allocated_bytes()
+            + dfg.consts.allocated_bytes();
+
+        fp.operands = dfg.insts.values().map(operand_bytes).sum();
+
+        fp.uses = hash_bytes::<(Value, HashSet<Inst>)>(dfg.value_uses.capacity())
+            + hash_bytes::<(Block, HashSet<Inst>)>(dfg.block_uses.capacity())
+            + dfg
+                .value_uses
+                .values()
+                .chain(dfg.block_uses.values())
+                .map(|s| hash_bytes::<Inst>(s.capacity()))
+                .sum::<usize>();
+
+        fp.names = hash_bytes::<(Value, String)>(dfg.names.capacity())
+            + dfg.names.values().map(|s| s.capacity()).sum::<usize>()
+            + hash_bytes::<(Value, u32)>(dfg.anonymous_hints.capacity())
+            + hash_bytes::<(Inst, usize)>(dfg.location_hints.capacity())
+            + hash_bytes::<(Block, u32)>(cfg.anonymous_hints.capacity())
+            + cfg
+                .blocks
+                .values()
+                .flat_map(|bb| bb.name.as_ref())
+                .map(|s| s.capacity())
+                .sum::<usize>();
+
+        fp.layout = layout.allocated_bytes();
+
+        let mut seen = HashSet::new();
+        fp.types = dfg
+            .values
+            .values()
+            .flat_map(|v| match v {
+                ValueData::Inst { ty, .. }
+                | ValueData::Arg { ty, .. }
+                | ValueData::Placeholder { ty } => Some(ty),
+                ValueData::Invalid => None,
+            })
+            .map(|ty| type_bytes(ty, &mut seen))
+            .sum();
+
+        fp
+    }
+}
+
+impl Module {
+    /// Estimate the memory used by the units in the module.
+    pub fn footprint(&self) -> Footprint {
+        self.units().map(|unit| unit.footprint()).sum()
+    }
+}
+
+/// Estimate the bytes allocated by a hash table with a given capacity.
+pub(super) fn hash_bytes<T>(capacity: usize) -> usize {
+    // Each entry is accompanied by one byte of control information.
+    capacity * (size_of::<T>() + 1)
+}
+
+/// Compute the bytes allocated by the operand vectors of an instruction.
+fn operand_bytes(data: &InstData) -> usize {
+    fn vec_bytes<T>(v: &Vec<T>) -> usize {
+        v.capacity() * size_of::<T>()
+    }
+    match data {
+        InstData::Aggregate { args, .. }
+        | InstData::Wait { args, .. }
+        | InstData::Call { args, .. } => vec_bytes(args),
+        InstData::Phi { args, bbs, .. } => vec_bytes(args) + vec_bytes(bbs),
+        InstData::Reg { args, modes, .. } => vec_bytes(args) + vec_bytes(modes),
+        _ => 0,
+    }
+}
+
+/// Compute the bytes allocated by a type, unless it has already been seen.
+fn type_bytes(ty: &Type, seen: &mut HashSet<*const TypeKind>) -> usize {
+    if !seen.insert(Arc::as_ptr(ty)) {
+        return 0;
+    }
+    let mut bytes = 2 * size_of::<usize>() + size_of::<TypeKind>();
+    let inner = |tys: &Vec<Type>, seen: &mut HashSet<_>| {
+        tys.capacity() * size_of::<Type>()
+            + tys.iter().map(|ty| type_bytes(ty, seen)).sum::<usize>()
+    };
+    bytes += match **ty {
+        TypeKind::PointerType(ref ty)
+        | TypeKind::SignalType(ref ty)
+        | TypeKind::ArrayType(_, ref ty) => type_bytes(ty, seen),
+        TypeKind::StructType(ref tys) => inner(tys, seen),
+        TypeKind::FuncType(ref args, ref ret) => inner(args, seen) + type_bytes(ret, seen),
+        TypeKind::EntityType(ref ins, ref outs) => inner(ins, seen) + inner(outs, seen),
+        _ => 0,
+    };
+    bytes
+}
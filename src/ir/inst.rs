@@ -11,7 +11,7 @@ use crate::{
     value::{IntValue, TimeValue},
 };
 use bitflags::bitflags;
-use std::borrow::Cow;
+use std::{borrow::Cow, sync::Arc};
 
 /// A temporary object used to construct a single instruction.
 pub struct InstBuilder<'a, 'b> {
@@ -71,7 +71,7 @@ impl<'a, 'b> InstBuilder<'a, 'b> {
         let ty = value.ty();
         let data = InstData::ConstInt {
             opcode: Opcode::ConstInt,
-            imm: value,
+            imm: Arc::new(value),
         };
         let inst = self.build(data, ty);
         self.inst_result(inst)
@@ -86,7 +86,7 @@ impl<'a, 'b> InstBuilder<'a, 'b> {
         let ty = value.ty();
         let data = InstData::ConstTime {
             opcode: Opcode::ConstTime,
-            imm: value,
+            imm: Arc::new(value),
         };
         let inst = self.build(data, ty);
         self.inst_result(inst)
@@ -699,9 +699,12 @@ impl<'a, 'b> InstBuilder<'a, 'b> {
 #[derive(Debug, Clone, PartialEq, Eq, Hash, Serialize, Deserialize)]
 pub enum InstData {
     /// `a = const iN imm`
-    ConstInt { opcode: Opcode, imm: IntValue },
+    ///
+    /// The constant is shared with the unit's other instructions of the same
+    /// value.
+    ConstInt { opcode: Opcode, imm: Arc<IntValue> },
     /// `a = const time imm`
-    ConstTime { opcode: Opcode, imm: TimeValue },
+    ConstTime { opcode: Opcode, imm: Arc<TimeValue> },
     /// `opcode imm, type x`
     Array {
         opcode: Opcode,
@@ -1050,7 +1053,7 @@ impl InstData {
     /// Return the const int constructed by this instruction.
     pub fn get_const_int(&self) -> Option<&IntValue> {
         match self {
-            InstData::ConstInt { imm, .. } => Some(imm),
+            InstData::ConstInt { imm, .. } => Some(&**imm),
             _ => None,
         }
     }
@@ -1058,7 +1061,7 @@ impl InstData {
     /// Return the const time constructed by this instruction.
     pub fn get_const_time(&self) -> Option<&TimeValue> {
         match self {
-            InstData::ConstTime { imm, .. } => Some(imm),
+            InstData::ConstTime { imm, .. } => Some(&**imm),
             _ => None,
         }
     }
@@ -3,13 +3,13 @@
 //! Instruction and BB ordering.
 
 use crate::{
-    ir::{Block, Inst},
+    ir::{footprint::hash_bytes, Block, Inst},
     table::SecondaryTable,
 };
 use std::collections::HashMap;
 
 /// Determines the order of instructions and BBs in a `Function` or `Process`.
-#[derive(Default, Serialize, Deserialize)]
+#[derive(Default, Clone, Serialize, Deserialize)]
 pub(super) struct FunctionLayout {
     /// A linked list of BBs in layout order.
     pub(super) bbs: SecondaryTable<Block, BlockNode>,
@@ -22,7 +22,7 @@ pub(super) struct FunctionLayout {
 }
 
 /// A node in the layout's double-linked list of BBs.
-#[derive(Default, Serialize, Deserialize)]
+#[derive(Default, Clone, Serialize, Deserialize)]
 pub(super) struct BlockNode {
     pub(super) prev: Option<Block>,
     pub(super) next: Option<Block>,
@@ -30,7 +30,7 @@ pub(super) struct BlockNode {
 }
 
 /// Determines the order of instructions.
-#[derive(Default, Serialize, Deserialize)]
+#[derive(Default, Clone, Serialize, Deserialize)]
 pub(super) struct InstLayout {
     /// A linked list of instructions in layout order.
     insts: SecondaryTable<Inst, InstNode>,
@@ -41,7 +41,7 @@ pub(super) struct InstLayout {
 }
 
 /// A node in the layout's double-linked list of BBs.
-#[derive(Default, Serialize, Deserialize)]
+#[derive(Default, Clone, Serialize, Deserialize)]
 struct InstNode {
     prev: Option<Inst>,
     next: Option<Inst>,
@@ -59,6 +59,18 @@ impl FunctionLayout {
         }
     }
 
+    /// Get the number of bytes allocated by the layout.
+    pub(super) fn allocated_bytes(&self) -> usize {
+        hash_bytes::<(usize, BlockNode)>(self.bbs.storage.capacity())
+            + self
+                .bbs
+                .storage
+                .values()
+                .map(|node| hash_bytes::<(usize, InstNode)>(node.layout.insts.storage.capacity()))
+                .sum::<usize>()
+            + hash_bytes::<(Inst, Block)>(self.inst_map.capacity())
+    }
+
     /// Remove a mapping from an instruction to the block that contains it.
     pub(super) fn unmap_inst(&mut self, inst: Inst) {
         match self.inst_map.remove(&inst) {
@@ -10,6 +10,7 @@ use crate::{impl_table_key, ty::Type};
 
 mod cfg;
 mod dfg;
+mod footprint;
 mod inst;
 mod layout;
 mod module;
@@ -19,6 +20,7 @@ mod unit;
 
 use self::cfg::*;
 use self::dfg::*;
+pub use self::footprint::*;
 pub use self::inst::*;
 use self::layout::*;
 pub use self::module::*;
@@ -9,7 +9,7 @@
 
 use crate::{
     impl_table_key,
-    ir::{ExtUnit, Signature, Unit, UnitBuilder, UnitData, UnitName},
+    ir::{unit::Backup, ExtUnit, Signature, Unit, UnitBuilder, UnitData, UnitName},
     table::{PrimaryTable, TableKey},
     verifier::Verifier,
 };
@@ -37,6 +37,9 @@ pub struct Module {
     /// file, this table *may* contain additional hints on the byte offsets
     /// where the units were located.
     location_hints: HashMap<UnitId, usize>,
+    /// The units removed since the active snapshot was taken, if any.
+    #[serde(skip)]
+    removed_units: Option<Vec<(UnitId, UnitData)>>,
 }
 
 impl Module {
@@ -49,6 +52,7 @@ impl Module {
             decl_order: BTreeSet::new(),
             link_table: None,
             location_hints: Default::default(),
+            removed_units: None,
         }
     }
 
@@ -58,7 +62,8 @@ impl Module {
     }
 
     /// Add a unit to the module.
-    pub fn add_unit(&mut self, data: UnitData) -> UnitId {
+    pub fn add_unit(&mut self, mut data: UnitData) -> UnitId {
+        data.backup = Backup::Untracked;
         let unit = self.units.add(data);
         self.unit_order.insert(unit);
         self.link_table = None;
@@ -67,8 +72,11 @@ impl Module {
 
     /// Remove a unit from the module.
     pub fn remove_unit(&mut self, unit: UnitId) {
-        self.units.remove(unit);
+        let data = self.units.remove(unit);
         self.unit_order.remove(&unit);
+        if let Some(ref mut removed) = self.removed_units {
+            removed.push((unit, data));
+        }
     }
 
     /// Declare an external unit.
@@ -264,6 +272,79 @@ impl Module {
             .cloned()
     }
 
+    /// Take a snapshot of the module.
+    ///
+    /// From now on, units are copied right before they are first modified,
+    /// such that the module can be reverted to the snapshot with `rollback`,
+    /// or the copies discarded with `commit`. Taking a snapshot and rolling
+    /// back thus only costs as much as the units that were actually modified.
+    /// Only one snapshot can be active at a time.
+    pub fn snapshot(&mut self) -> ModuleSnapshot {
+        assert!(
+            self.removed_units.is_none(),
+            "module already has an active snapshot"
+        );
+        for data in self.units.values_mut() {
+            data.backup = Backup::Unmodified;
+        }
+        self.removed_units = Some(vec![]);
+        ModuleSnapshot {
+            unit_order: self.unit_order.clone(),
+            decls: self.decls.clone(),
+            decl_order: self.decl_order.clone(),
+            location_hints: self.location_hints.clone(),
+        }
+    }
+
+    /// Keep the modifications since a snapshot was taken.
+    pub fn commit(&mut self, snapshot: ModuleSnapshot) {
+        self.removed_units
+            .take()
+            .expect("module has no active snapshot");
+        drop(snapshot);
+        for data in self.units.values_mut() {
+            data.backup = Backup::Untracked;
+        }
+    }
+
+    /// Revert the module to a snapshot.
+    pub fn rollback(&mut self, snapshot: ModuleSnapshot) {
+        let removed = self
+            .removed_units
+            .take()
+            .expect("module has no active snapshot");
+
+        // Drop the units that have been added since the snapshot, and bring
+        // back the ones that have been removed.
+        let added: Vec<_> = self
+            .unit_order
+            .difference(&snapshot.unit_order)
+            .cloned()
+            .collect();
+        for unit in added {
+            self.units.remove(unit);
+        }
+        for (unit, data) in removed {
+            if snapshot.unit_order.contains(&unit) {
+                self.units.storage.insert(unit.index(), data);
+            }
+        }
+
+        // Restore the units that have been modified.
+        for data in self.units.values_mut() {
+            if let Backup::Modified(saved) = std::mem::replace(&mut data.backup, Backup::Untracked)
+            {
+                *data = *saved;
+            }
+        }
+
+        self.unit_order = snapshot.unit_order;
+        self.decls = snapshot.decls;
+        self.decl_order = snapshot.decl_order;
+        self.location_hints = snapshot.location_hints;
+        self.link_table = None;
+    }
+
     /// Add a location hint to a unit.
     ///
     /// Annotates the byte offset of a unit in the input file.
@@ -290,7 +371,9 @@ impl std::ops::Index<UnitId> for Module {
 impl std::ops::IndexMut<UnitId> for Module {
     fn index_mut(&mut self, idx: UnitId) -> &mut UnitData {
         self.link_table = None;
-        &mut self.units[idx]
+        let data = &mut self.units[idx];
+        data.save();
+        data
     }
 }
 
@@ -308,6 +391,18 @@ impl std::ops::IndexMut<DeclId> for Module {
     }
 }
 
+/// A snapshot of a module, taken with `Module::snapshot`.
+///
+/// Only holds the module-level tables. The units themselves are copied on
+/// demand as they are modified. Pass the snapshot to `Module::commit` or
+/// `Module::rollback` once done.
+pub struct ModuleSnapshot {
+    unit_order: BTreeSet<UnitId>,
+    decls: PrimaryTable<DeclId, DeclData>,
+    decl_order: BTreeSet<DeclId>,
+    location_hints: HashMap<UnitId, usize>,
+}
+
 /// Temporary object to dump a `Module` in human-readable form for debugging.
 pub struct ModuleDumper<'a>(&'a Module);
 
@@ -346,7 +441,7 @@ impl_table_key! {
 }
 
 /// A unit declaration.
-#[derive(Serialize, Deserialize)]
+#[derive(Clone, Serialize, Deserialize)]
 pub struct DeclData {
     /// The unit signature.
     pub sig: Signature,
@@ -1,7 +1,7 @@
 // Copyright (c) 2017-2021 Fabian Schuiki
 
 use crate::{
-    analysis::{DominatorTree, PredecessorTable, TemporalRegionGraph},
+    analysis::{DominatorTree, LoopInfo, PredecessorTable, TemporalRegionGraph},
     ir::{
         layout::BlockNode, prelude::*, BlockData, ControlFlowGraph, DataFlowGraph, ExtUnit,
         ExtUnitData, FunctionLayout, InstBuilder, InstData, UnitId, ValueData,
@@ -113,6 +113,24 @@ pub struct UnitData {
     pub(super) dfg: DataFlowGraph,
     pub(super) cfg: ControlFlowGraph,
     pub(super) layout: FunctionLayout,
+    #[serde(skip)]
+    pub(super) backup: Backup,
+}
+
+/// The state of a unit while its module has an active snapshot.
+pub(super) enum Backup {
+    /// The module has no active snapshot.
+    Untracked,
+    /// The unit has not been modified since the snapshot was taken.
+    Unmodified,
+    /// The unit as it was when the snapshot was taken.
+    Modified(Box<UnitData>),
+}
+
+impl Default for Backup {
+    fn default() -> Backup {
+        Backup::Untracked
+    }
 }
 
 impl UnitData {
@@ -134,6 +152,7 @@ impl UnitData {
             dfg: Default::default(),
             cfg: Default::default(),
             layout: Default::default(),
+            backup: Default::default(),
         };
         let mut unit = UnitBuilder::new_anonymous(&mut data);
         if kind == UnitKind::Entity {
@@ -144,6 +163,68 @@ impl UnitData {
         unit.make_args_for_signature(&unit.sig().clone());
         data
     }
+
+    /// Overwrite another unit with a copy of this one.
+    ///
+    /// Reuses the tables that have already been allocated in `target`, such
+    /// that repeatedly copying a unit into the same target, for example to
+    /// keep a snapshot around while a transformation is tried speculatively,
+    /// mostly copies memory rather than allocating it anew.
+    pub fn clone_into(&self, target: &mut UnitData) {
+        target.clone_from(self);
+    }
+
+    /// Keep a copy of the unit if this is its first modification since the
+    /// module's snapshot was taken.
+    #[inline]
+    pub(super) fn save(&mut self) {
+        if let Backup::Unmodified = self.backup {
+            self.backup = Backup::Modified(Box::new(self.clone()));
+        }
+    }
+}
+
+impl Clone for UnitData {
+    fn clone(&self) -> Self {
+        Self {
+            kind: self.kind,
+            name: self.name.clone(),
+            sig: self.sig.clone(),
+            dfg: self.dfg.clone(),
+            cfg: self.cfg.clone(),
+            layout: self.layout.clone(),
+            backup: Default::default(),
+        }
+    }
+
+    fn clone_from(&mut self, source: &Self) {
+        self.kind = source.kind;
+        self.name.clone_from(&source.name);
+        self.sig.clone_from(&source.sig);
+
+        // Copy the tables one by one, since the derived `clone_from` of the
+        // containers would allocate them anew.
+        let (dfg, src) = (&mut self.dfg, &source.dfg);
+        dfg.insts.clone_from(&src.insts);
+        dfg.results.clone_from(&src.results);
+        dfg.values.clone_from(&src.values);
+        dfg.args.clone_from(&src.args);
+        dfg.ext_units.clone_from(&src.ext_units);
+        dfg.names.clone_from(&src.names);
+        dfg.anonymous_hints.clone_from(&src.anonymous_hints);
+        dfg.location_hints.clone_from(&src.location_hints);
+        dfg.value_uses.clone_from(&src.value_uses);
+        dfg.block_uses.clone_from(&src.block_uses);
+        dfg.consts.clone_from(&src.consts);
+        self.cfg.blocks.clone_from(&source.cfg.blocks);
+        self.cfg
+            .anonymous_hints
+            .clone_from(&source.cfg.anonymous_hints);
+        self.layout.bbs.clone_from(&source.layout.bbs);
+        self.layout.first_bb = source.layout.first_bb;
+        self.layout.last_bb = source.layout.last_bb;
+        self.layout.inst_map.clone_from(&source.layout.inst_map);
+    }
 }
 
 /// An immutable function, process, or entity.
@@ -318,6 +399,13 @@ impl<'a> Unit<'a> {
         #[allow(deprecated)]
         DominatorTree::new(&self, pt)
     }
+
+    /// Compute the unit's natural loops.
+    pub fn loops(self) -> LoopInfo {
+        let pt = self.predtbl();
+        let dt = self.domtree_with_predtbl(&pt);
+        LoopInfo::new(&self, &pt, &dt)
+    }
 }
 
 /// # Control Flow Graph
@@ -715,6 +803,27 @@ impl<'a> UnitBuilder<'a> {
     /// Get the unit's mutable data.
     #[inline(always)]
     pub fn data(&mut self) -> &mut UnitData {
+        self.data_mut()
+    }
+
+    /// Replace the unit's data.
+    ///
+    /// Use this rather than assigning to `data()`, which would discard the
+    /// copy of the unit kept for `Module::rollback`. Returns the old data.
+    pub fn replace_data(&mut self, data: UnitData) -> UnitData {
+        let slot = self.data_mut();
+        let mut old = std::mem::replace(slot, data);
+        std::mem::swap(&mut slot.backup, &mut old.backup);
+        old
+    }
+
+    /// Get the unit's data for modification.
+    ///
+    /// Keeps a copy of the unit if this is its first modification since the
+    /// module's snapshot was taken.
+    #[inline(always)]
+    fn data_mut(&mut self) -> &mut UnitData {
+        self.data.save();
         self.data
     }
 
@@ -778,7 +887,7 @@ impl<'a> UnitBuilder<'a> {
 
     /// Create a new BB.
     pub fn block(&mut self) -> Block {
-        let bb = self.data.cfg.blocks.add(BlockData { name: None });
+        let bb = self.data_mut().cfg.blocks.add(BlockData { name: None });
         self.append_block(bb);
         bb
     }
@@ -798,14 +907,14 @@ impl<'a> UnitBuilder<'a> {
         let insts: Vec<_> = self.insts(bb).collect();
         self.remove_block_use(bb);
         self.remove_block(bb);
-        self.data.cfg.blocks.remove(bb);
+        self.data_mut().cfg.blocks.remove(bb);
         for inst in insts {
             if self.has_result(inst) {
                 let value = self.inst_result(inst);
                 self.replace_use(value, Value::invalid());
             }
             self.remove_inst_dfg(inst);
-            self.data.layout.unmap_inst(inst);
+            self.data_mut().layout.unmap_inst(inst);
         }
     }
 
@@ -841,7 +950,12 @@ impl<'a> UnitBuilder<'a> {
 
     /// Import an external unit for use within this unit.
     pub fn add_extern(&mut self, name: UnitName, sig: Signature) -> ExtUnit {
-        self.data.dfg.ext_units.add(ExtUnitData { sig, name })
+        self.data_mut().dfg.ext_units.add(ExtUnitData { sig, name })
+    }
+
+    /// Remove an external unit that is no longer used by any instruction.
+    pub fn remove_extern(&mut self, ext: ExtUnit) {
+        self.data_mut().dfg.ext_units.remove(ext);
     }
 
     /// Remove an instruction if its value is not being read.
@@ -871,22 +985,22 @@ impl<'a> UnitBuilder<'a> {
 impl<'a> UnitBuilder<'a> {
     /// Set the name of a BB.
     pub fn set_block_name(&mut self, bb: Block, name: String) {
-        self.data.cfg[bb].name = Some(name);
+        self.data_mut().cfg[bb].name = Some(name);
     }
 
     /// Clear the name of a BB.
     pub fn clear_block_name(&mut self, bb: Block) -> Option<String> {
-        std::mem::replace(&mut self.data.cfg[bb].name, None)
+        std::mem::replace(&mut self.data_mut().cfg[bb].name, None)
     }
 
     /// Set the anonymous name hint of a BB.
     pub fn set_anonymous_block_hint(&mut self, bb: Block, hint: u32) {
-        self.data.cfg.anonymous_hints.insert(bb, hint);
+        self.data_mut().cfg.anonymous_hints.insert(bb, hint);
     }
 
     /// Clear the anonymous name hint of a BB.
     pub fn clear_anonymous_block_hint(&mut self, bb: Block) -> Option<u32> {
-        self.data.cfg.anonymous_hints.remove(&bb)
+        self.data_mut().cfg.anonymous_hints.remove(&bb)
     }
 }
 
@@ -908,22 +1022,22 @@ impl<'a> UnitBuilder<'a> {
 
     /// Add a value.
     fn add_value(&mut self, data: ValueData) -> Value {
-        let v = self.data.dfg.values.add(data);
-        self.data.dfg.value_uses.insert(v, Default::default());
+        let v = self.data_mut().dfg.values.add(data);
+        self.data_mut().dfg.value_uses.insert(v, Default::default());
         v
     }
 
     /// Remove a value.
     fn remove_value(&mut self, value: Value) -> ValueData {
-        let data = self.data.dfg.values.remove(value);
-        self.data.dfg.value_uses.remove(&value);
+        let data = self.data_mut().dfg.values.remove(value);
+        self.data_mut().dfg.value_uses.remove(&value);
         data
     }
 
     /// Register a value use.
     fn update_uses(&mut self, inst: Inst) {
         for value in self[inst].args().to_vec() {
-            self.data
+            self.data_mut()
                 .dfg
                 .value_uses
                 .entry(value)
@@ -931,7 +1045,7 @@ impl<'a> UnitBuilder<'a> {
                 .insert(inst);
         }
         for block in self[inst].blocks().to_vec() {
-            self.data
+            self.data_mut()
                 .dfg
                 .block_uses
                 .entry(block)
@@ -943,7 +1057,7 @@ impl<'a> UnitBuilder<'a> {
     /// Remove a value use.
     fn remove_uses(&mut self, inst: Inst, data: InstData) {
         for value in data.args() {
-            self.data
+            self.data_mut()
                 .dfg
                 .value_uses
                 .get_mut(value)
@@ -951,7 +1065,7 @@ impl<'a> UnitBuilder<'a> {
                 .remove(&inst);
         }
         for block in data.blocks() {
-            self.data
+            self.data_mut()
                 .dfg
                 .block_uses
                 .get_mut(block)
@@ -961,12 +1075,13 @@ impl<'a> UnitBuilder<'a> {
     }
 
     /// Add an instruction.
-    fn add_inst_dfg(&mut self, data: InstData, ty: Type) -> Inst {
+    fn add_inst_dfg(&mut self, mut data: InstData, ty: Type) -> Inst {
         let has_result = data.opcode() == Opcode::Call || !ty.is_void();
-        let inst = self.data.dfg.insts.add(data);
+        self.data_mut().dfg.consts.intern(&mut data);
+        let inst = self.data_mut().dfg.insts.add(data);
         if has_result {
             let result = self.add_value(ValueData::Inst { ty, inst });
-            self.data.dfg.results.add(inst, result);
+            self.data_mut().dfg.results.add(inst, result);
         }
         self.update_uses(inst);
         inst
@@ -979,9 +1094,9 @@ impl<'a> UnitBuilder<'a> {
             assert!(!self.has_uses(value));
             self.remove_value(value);
         }
-        let data = self.data.dfg.insts.remove(inst);
+        let data = self.data_mut().dfg.insts.remove(inst);
         self.remove_uses(inst, data);
-        self.data.dfg.results.remove(inst);
+        self.data_mut().dfg.results.remove(inst);
     }
 
     /// Create values for the arguments in a signature.
@@ -991,28 +1106,28 @@ impl<'a> UnitBuilder<'a> {
                 ty: sig.arg_type(arg),
                 arg: arg,
             });
-            self.data.dfg.args.add(arg, value);
+            self.data_mut().dfg.args.add(arg, value);
         }
     }
 
     /// Set the name of a value.
     pub fn set_name(&mut self, value: Value, name: String) {
-        self.data.dfg.names.insert(value, name);
+        self.data_mut().dfg.names.insert(value, name);
     }
 
     /// Clear the name of a value.
     pub fn clear_name(&mut self, value: Value) -> Option<String> {
-        self.data.dfg.names.remove(&value)
+        self.data_mut().dfg.names.remove(&value)
     }
 
     /// Set the anonymous name hint of a value.
     pub fn set_anonymous_hint(&mut self, value: Value, hint: u32) {
-        self.data.dfg.anonymous_hints.insert(value, hint);
+        self.data_mut().dfg.anonymous_hints.insert(value, hint);
     }
 
     /// Clear the anonymous name hint of a value.
     pub fn clear_anonymous_hint(&mut self, value: Value) -> Option<u32> {
-        self.data.dfg.anonymous_hints.remove(&value)
+        self.data_mut().dfg.anonymous_hints.remove(&value)
     }
 
     /// Replace all uses of a value with another.
@@ -1039,7 +1154,7 @@ impl<'a> UnitBuilder<'a> {
     pub fn replace_value_within_inst(&mut self, from: Value, to: Value, inst: Inst) -> usize {
         #[allow(deprecated)]
         let count = self[inst].replace_value(from, to);
-        self.data
+        self.data_mut()
             .dfg
             .value_uses
             .entry(from)
@@ -1073,7 +1188,7 @@ impl<'a> UnitBuilder<'a> {
     pub fn replace_block_within_inst(&mut self, from: Block, to: Block, inst: Inst) -> usize {
         #[allow(deprecated)]
         let count = self[inst].replace_block(from, to);
-        self.data
+        self.data_mut()
             .dfg
             .block_uses
             .entry(from)
@@ -1113,7 +1228,7 @@ impl<'a> UnitBuilder<'a> {
     pub fn remove_block_from_inst(&mut self, block: Block, inst: Inst) -> usize {
         #[allow(deprecated)]
         let count = self[inst].remove_block(block);
-        self.data
+        self.data_mut()
             .dfg
             .block_uses
             .entry(block)
@@ -1127,7 +1242,7 @@ impl<'a> UnitBuilder<'a> {
     ///
     /// Annotates the byte offset of an instruction in the input file.
     pub fn set_location_hint(&mut self, inst: Inst, loc: usize) {
-        self.data.dfg.location_hints.insert(inst, loc);
+        self.data_mut().dfg.location_hints.insert(inst, loc);
     }
 }
 
@@ -1137,7 +1252,7 @@ impl<'a> UnitBuilder<'a> {
 impl<'a> UnitBuilder<'a> {
     /// Append a BB to the end of the function.
     pub fn append_block(&mut self, bb: Block) {
-        let layout = &mut self.data.layout;
+        let layout = &mut self.data_mut().layout;
         layout.bbs.add(
             bb,
             BlockNode {
@@ -1159,7 +1274,7 @@ impl<'a> UnitBuilder<'a> {
     ///
     /// This effectively makes `bb` the new entry block.
     pub fn prepend_block(&mut self, bb: Block) {
-        let layout = &mut self.data.layout;
+        let layout = &mut self.data_mut().layout;
         layout.bbs.add(
             bb,
             BlockNode {
@@ -1179,7 +1294,7 @@ impl<'a> UnitBuilder<'a> {
 
     /// Insert a BB after another BB.
     pub fn insert_block_after(&mut self, bb: Block, after: Block) {
-        let layout = &mut self.data.layout;
+        let layout = &mut self.data_mut().layout;
         layout.bbs.add(
             bb,
             BlockNode {
@@ -1199,7 +1314,7 @@ impl<'a> UnitBuilder<'a> {
 
     /// Insert a BB before another BB.
     pub fn insert_block_before(&mut self, bb: Block, before: Block) {
-        let layout = &mut self.data.layout;
+        let layout = &mut self.data_mut().layout;
         layout.bbs.add(
             bb,
             BlockNode {
@@ -1219,7 +1334,7 @@ impl<'a> UnitBuilder<'a> {
 
     /// Remove a BB from the function.
     pub fn remove_block(&mut self, bb: Block) {
-        let layout = &mut self.data.layout;
+        let layout = &mut self.data_mut().layout;
         let node = layout.bbs.remove(bb).unwrap();
         if let Some(next) = node.next {
             layout.bbs[next].prev = node.prev;
@@ -1237,7 +1352,7 @@ impl<'a> UnitBuilder<'a> {
 
     /// Swap the position of two BBs.
     pub fn swap_blocks(&mut self, bb0: Block, bb1: Block) {
-        let layout = &mut self.data.layout;
+        let layout = &mut self.data_mut().layout;
         if bb0 == bb1 {
             return;
         }
@@ -1296,39 +1411,39 @@ impl<'a> UnitBuilder<'a> {
 impl<'a> UnitBuilder<'a> {
     /// Append an instruction to the end of a BB.
     pub fn append_inst(&mut self, inst: Inst, bb: Block) {
-        self.data.layout.bbs[bb].layout.append_inst(inst);
-        self.data.layout.map_inst(inst, bb);
+        self.data_mut().layout.bbs[bb].layout.append_inst(inst);
+        self.data_mut().layout.map_inst(inst, bb);
     }
 
     /// Prepend an instruction to the beginning of a BB.
     pub fn prepend_inst(&mut self, inst: Inst, bb: Block) {
-        self.data.layout.bbs[bb].layout.prepend_inst(inst);
-        self.data.layout.map_inst(inst, bb);
+        self.data_mut().layout.bbs[bb].layout.prepend_inst(inst);
+        self.data_mut().layout.map_inst(inst, bb);
     }
 
     /// Insert an instruction after another instruction.
     pub fn insert_inst_after(&mut self, inst: Inst, after: Inst) {
         let bb = self.inst_block(after).expect("`after` not inserted");
-        self.data.layout.bbs[bb]
+        self.data_mut().layout.bbs[bb]
             .layout
             .insert_inst_after(inst, after);
-        self.data.layout.map_inst(inst, bb);
+        self.data_mut().layout.map_inst(inst, bb);
     }
 
     /// Insert an instruction before another instruction.
     pub fn insert_inst_before(&mut self, inst: Inst, before: Inst) {
         let bb = self.inst_block(before).expect("`before` not inserted");
-        self.data.layout.bbs[bb]
+        self.data_mut().layout.bbs[bb]
             .layout
             .insert_inst_before(inst, before);
-        self.data.layout.map_inst(inst, bb);
+        self.data_mut().layout.map_inst(inst, bb);
     }
 
     /// Remove an instruction from the function.
     pub fn remove_inst(&mut self, inst: Inst) {
         let bb = self.inst_block(inst).expect("`inst` not inserted");
-        self.data.layout.bbs[bb].layout.remove_inst(inst);
-        self.data.layout.unmap_inst(inst);
+        self.data_mut().layout.bbs[bb].layout.remove_inst(inst);
+        self.data_mut().layout.unmap_inst(inst);
     }
 }
 
@@ -1402,25 +1517,25 @@ impl Index<Block> for UnitBuilder<'_> {
 
 impl IndexMut<Value> for UnitBuilder<'_> {
     fn index_mut(&mut self, idx: Value) -> &mut ValueData {
-        self.data.dfg.index_mut(idx)
+        self.data_mut().dfg.index_mut(idx)
     }
 }
 
 impl IndexMut<Inst> for UnitBuilder<'_> {
     fn index_mut(&mut self, idx: Inst) -> &mut InstData {
-        self.data.dfg.index_mut(idx)
+        self.data_mut().dfg.index_mut(idx)
     }
 }
 
 impl IndexMut<ExtUnit> for UnitBuilder<'_> {
     fn index_mut(&mut self, idx: ExtUnit) -> &mut ExtUnitData {
-        self.data.dfg.index_mut(idx)
+        self.data_mut().dfg.index_mut(idx)
     }
 }
 
 impl IndexMut<Block> for UnitBuilder<'_> {
     fn index_mut(&mut self, idx: Block) -> &mut BlockData {
-        self.data.cfg.index_mut(idx)
+        self.data_mut().cfg.index_mut(idx)
     }
 }
 
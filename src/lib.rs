@@ -13,6 +13,7 @@ extern crate serde;
 #[macro_use]
 pub mod assembly;
 pub mod analysis;
+pub mod cov;
 pub mod ir;
 pub mod mlir;
 pub mod opt;
@@ -20,6 +21,7 @@ pub mod pass;
 pub mod table;
 pub mod ty;
 pub mod value;
+pub mod vcd;
 pub mod verifier;
 
 pub use crate::{ty::*, value::*};
@@ -555,8 +555,8 @@ impl<'a, T: Write> UnitWriter<'a, T> {
                 self.writer.sink,
                 "{} #llhd.time<{}{}, {}d, {}e> : {}",
                 MLIROpcode(data.opcode()),
-                get_canonicalized_time(&data.get_const_time().unwrap().time).0,
-                get_canonicalized_time(&data.get_const_time().unwrap().time).1,
+                get_canonicalized_time(&data.get_const_time().unwrap().time()).0,
+                get_canonicalized_time(&data.get_const_time().unwrap().time()).1,
                 data.get_const_time().unwrap().delta,
                 data.get_const_time().unwrap().epsilon,
                 MLIRType(&unit.value_type(unit.inst_result(inst)))
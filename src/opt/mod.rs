@@ -5,12 +5,15 @@
 //! This module implements infrastructure used by the optimization system which
 //! operates on LLHD IR.
 
+mod partition;
 mod pass;
 
+pub use partition::*;
 pub use pass::*;
 
 /// Contains common types that can be glob-imported (`*`) for convenience
 /// from pass module.
 pub mod prelude {
+    pub use super::partition::*;
     pub use super::pass::*;
 }
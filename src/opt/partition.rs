@@ -0,0 +1,262 @@
+// Copyright (c) 2017-2021 Fabian Schuiki
+
+//! Partitioning of large entities for parallel optimization.
+
+use crate::{
+    ir::{prelude::*, ExtUnit, InstData},
+    opt::PassContext,
+};
+use rayon::prelude::*;
+use std::collections::HashMap;
+
+/// The number of instructions an entity must have before it is partitioned.
+///
+/// Copying the partitions out of the entity and back in costs about as much as
+/// a simple pass over the entity, so smaller entities are not worth it.
+pub const MIN_PARTITION_INSTS: usize = 4096;
+
+/// Run a dataflow pass on the independent parts of an entity in parallel.
+///
+/// Large entities, such as flattened designs or gate-level netlists, are often
+/// the only unit in a module, which leaves the unit-level parallelism of
+/// `Pass::run_on_module` with nothing to do. This function splits an entity
+/// into partitions of instructions which share no values other than the
+/// entity's arguments and constants, copies each partition into a separate
+/// unit, and runs `f` on all of them concurrently. If any partition changed,
+/// the partitions are then reassembled into the entity in the order of their
+/// first instruction, such that the result does not depend on the scheduling
+/// of the threads. Identical constants and external units of different
+/// partitions are merged, and value names and location hints are preserved.
+///
+/// Since `f` only sees one partition at a time, it must not rely on seeing the
+/// entire unit, and may miss optimizations across partitions. Units that are
+/// not entities, are small, or do not split into multiple partitions are
+/// passed to `f` directly.
+pub fn run_on_partitions(
+    ctx: &PassContext,
+    unit: &mut UnitBuilder,
+    f: fn(&PassContext, &mut UnitBuilder) -> bool,
+) -> bool {
+    if !unit.is_entity() {
+        return f(ctx, unit);
+    }
+    let term = unit.terminator(unit.entry());
+    let insts: Vec<_> = unit.all_insts().filter(|&inst| inst != term).collect();
+    if insts.len() < MIN_PARTITION_INSTS {
+        return f(ctx, unit);
+    }
+    let parts = partition(&unit, &insts);
+    if parts.len() < 2 {
+        return f(ctx, unit);
+    }
+    debug!(
+        "Partitioned {} into {} parts for parallel optimization",
+        unit.name(),
+        parts.len()
+    );
+
+    // Copy each partition into a separate unit and optimize them in parallel.
+    let mut datas: Vec<_> = parts
+        .iter()
+        .map(|part| {
+            let mut data = UnitData::new(UnitKind::Entity, unit.name().clone(), unit.sig().clone());
+            let mut builder = UnitBuilder::new_anonymous(&mut data);
+            let mut copier = Copier::new(&unit, &mut builder);
+            let mut externs = Externs::default();
+            for &inst in part {
+                for &arg in unit[inst].args() {
+                    if arg == Value::invalid() || copier.values.contains_key(&arg) {
+                        continue;
+                    }
+                    match unit.get_value_inst(arg) {
+                        Some(def) if is_shared(&unit, def) => {
+                            copier.copy(&unit, def, &mut builder, &mut externs)
+                        }
+                        _ => (),
+                    }
+                }
+                copier.copy(&unit, inst, &mut builder, &mut externs);
+            }
+            data
+        })
+        .collect();
+    let modified = datas
+        .par_iter_mut()
+        .map(|data| f(ctx, &mut UnitBuilder::new_anonymous(data)))
+        .reduce(|| false, |a, b| a || b);
+    if !modified {
+        return false;
+    }
+
+    // Reassemble the partitions.
+    let mut merged = UnitData::new(UnitKind::Entity, unit.name().clone(), unit.sig().clone());
+    let mut builder = UnitBuilder::new_anonymous(&mut merged);
+    let mut consts = HashMap::<InstData, Value>::new();
+    let mut externs = Externs::default();
+    for data in &datas {
+        let part = Unit::new_anonymous(data);
+        let mut copier = Copier::new(&part, &mut builder);
+        let part_term = part.terminator(part.entry());
+        for inst in part.all_insts().filter(|&inst| inst != part_term) {
+            if !is_shared(&part, inst) {
+                copier.copy(&part, inst, &mut builder, &mut externs);
+                continue;
+            }
+            let value = part.inst_result(inst);
+            match consts.get(&part[inst]) {
+                Some(&existing) => {
+                    copier.values.insert(value, existing);
+                }
+                None => {
+                    copier.copy(&part, inst, &mut builder, &mut externs);
+                    consts.insert(part[inst].clone(), copier.values[&value]);
+                }
+            }
+        }
+    }
+    unit.replace_data(merged);
+    true
+}
+
+/// Group the instructions of an entity into partitions that share no values
+/// other than arguments and constants.
+fn partition(unit: &Unit, insts: &[Inst]) -> Vec<Vec<Inst>> {
+    let index: HashMap<Inst, usize> = insts.iter().enumerate().map(|(i, &x)| (x, i)).collect();
+    let mut parent: Vec<usize> = (0..insts.len()).collect();
+    fn find(parent: &mut Vec<usize>, mut i: usize) -> usize {
+        while parent[i] != i {
+            parent[i] = parent[parent[i]];
+            i = parent[i];
+        }
+        i
+    }
+    for (i, &inst) in insts.iter().enumerate() {
+        if is_shared(unit, inst) {
+            continue;
+        }
+        for &arg in unit[inst].args() {
+            if arg == Value::invalid() {
+                continue;
+            }
+            if let Some(def) = unit.get_value_inst(arg) {
+                if !is_shared(unit, def) {
+                    let (a, b) = (find(&mut parent, i), find(&mut parent, index[&def]));
+                    parent[a.max(b)] = a.min(b);
+                }
+            }
+        }
+    }
+
+    // Collect the partitions in the order of their first instruction.
+    let mut parts: Vec<Vec<Inst>> = vec![];
+    let mut part_of_root = HashMap::new();
+    for (i, &inst) in insts.iter().enumerate() {
+        if is_shared(unit, inst) {
+            continue;
+        }
+        let root = find(&mut parent, i);
+        let part = *part_of_root.entry(root).or_insert_with(|| {
+            parts.push(vec![]);
+            parts.len() - 1
+        });
+        parts[part].push(inst);
+    }
+    parts
+}
+
+/// Check whether an instruction is a constant that is copied into every
+/// partition that uses it.
+fn is_shared(unit: &Unit, inst: Inst) -> bool {
+    unit[inst].opcode().is_const()
+}
+
+/// A copy of instructions from one unit into another.
+struct Copier {
+    /// The copy of each value in the source unit.
+    values: HashMap<Value, Value>,
+    /// The placeholders for values that are used before they are copied.
+    placeholders: HashMap<Value, Value>,
+}
+
+impl Copier {
+    /// Prepare a copy between two units with the same signature.
+    ///
+    /// The names of the source unit's arguments are carried over.
+    fn new(src: &Unit, dst: &mut UnitBuilder) -> Self {
+        let values: HashMap<_, _> = src.args().zip(dst.args()).collect();
+        for (&value, &new_value) in &values {
+            copy_names(src, value, dst, new_value);
+        }
+        Self {
+            values,
+            placeholders: Default::default(),
+        }
+    }
+
+    /// Copy an instruction to the end of the destination unit.
+    fn copy(&mut self, src: &Unit, inst: Inst, dst: &mut UnitBuilder, externs: &mut Externs) {
+        let mut data = src[inst].clone();
+        #[allow(deprecated)]
+        for arg in data.args_mut() {
+            let value = *arg;
+            if value == Value::invalid() {
+                continue;
+            }
+            *arg = match self.values.get(&value) {
+                Some(&v) => v,
+                None => *self
+                    .placeholders
+                    .entry(value)
+                    .or_insert_with(|| dst.add_placeholder(src.value_type(value))),
+            };
+        }
+        if let InstData::Call { unit, .. } = &mut data {
+            *unit = externs.get(dst, src.extern_name(*unit), src.extern_sig(*unit));
+        }
+        let term = dst.terminator(dst.entry());
+        dst.insert_before(term);
+        let new_inst = dst.build_inst(data, src.inst_type(inst));
+        if let Some(loc) = src.location_hint(inst) {
+            dst.set_location_hint(new_inst, loc);
+        }
+        if let Some(value) = src.get_inst_result(inst) {
+            let new_value = dst.inst_result(new_inst);
+            copy_names(src, value, dst, new_value);
+            self.values.insert(value, new_value);
+            if let Some(placeholder) = self.placeholders.remove(&value) {
+                dst.replace_use(placeholder, new_value);
+                dst.remove_placeholder(placeholder);
+            }
+        }
+    }
+}
+
+/// Carry the name and anonymous name hint of a value over to its copy.
+fn copy_names(src: &Unit, value: Value, dst: &mut UnitBuilder, new_value: Value) {
+    if let Some(name) = src.get_name(value) {
+        dst.set_name(new_value, name.to_string());
+    }
+    if let Some(hint) = src.get_anonymous_hint(value) {
+        dst.set_anonymous_hint(new_value, hint);
+    }
+}
+
+/// The external units declared in a destination unit, by name and signature.
+///
+/// Shared across all copies into the same unit, such that every external unit
+/// is declared only once.
+#[derive(Default)]
+struct Externs(HashMap<UnitName, Vec<(Signature, ExtUnit)>>);
+
+impl Externs {
+    /// Find the external unit with a name and signature, or declare it.
+    fn get(&mut self, dst: &mut UnitBuilder, name: &UnitName, sig: &Signature) -> ExtUnit {
+        let decls = self.0.entry(name.clone()).or_default();
+        if let Some(&(_, ext)) = decls.iter().find(|(s, _)| s == sig) {
+            return ext;
+        }
+        let ext = dst.add_extern(name.clone(), sig.clone());
+        decls.push((sig.clone(), ext));
+        ext
+    }
+}
@@ -14,6 +14,10 @@ use std::cmp::min;
 pub struct ConstFolding;
 
 impl Pass for ConstFolding {
+    fn run_on_unit(ctx: &PassContext, unit: &mut UnitBuilder) -> bool {
+        run_on_partitions(ctx, unit, Self::run_on_cfg)
+    }
+
     fn run_on_inst(_ctx: &PassContext, inst: Inst, unit: &mut UnitBuilder) -> bool {
         run_on_inst(unit, inst)
     }
@@ -12,6 +12,10 @@ use std::collections::{HashMap, HashSet};
 pub struct DeadCodeElim;
 
 impl Pass for DeadCodeElim {
+    fn run_on_unit(ctx: &PassContext, unit: &mut UnitBuilder) -> bool {
+        run_on_partitions(ctx, unit, Self::run_on_cfg)
+    }
+
     fn run_on_cfg(_ctx: &PassContext, unit: &mut UnitBuilder) -> bool {
         info!("DCE [{}]", unit.name());
         let mut modified = false;
@@ -0,0 +1,263 @@
+// Copyright (c) 2017-2021 Fabian Schuiki
+
+//! Dead Drive Elimination
+
+use crate::{
+    analysis::{reverse_post_order, Loop, LoopInfo},
+    ir::prelude::*,
+    opt::prelude::*,
+    value::TimeValue,
+};
+use std::collections::{HashMap, HashSet};
+
+/// Dead Drive Elimination
+///
+/// This pass removes drives in processes whose effect is always overridden by
+/// a later drive. A drive is dead if on every path from it to the next `wait`
+/// or `halt`, the same signal is driven again unconditionally with the same
+/// delay. Both drives then schedule an event at the same point in time, and
+/// only the later one takes effect. The later drives may also cover the
+/// signal piecewise, by driving disjoint slices or fields of it which together
+/// span the part of the signal driven by the dead drive.
+///
+/// Control flow that leaves a temporal region without passing through a
+/// temporal instruction stays within the same delta cycle, such that the
+/// analysis follows it into the next region.
+///
+/// Only drives with a constant delay are considered. Drives whose target
+/// signal is computed inside a loop that can repeat without passing through a
+/// temporal instruction are left alone, since the same value may then refer
+/// to a different part of the signal in every iteration.
+pub struct DeadDriveElimination;
+
+impl Pass for DeadDriveElimination {
+    fn run_on_cfg(_ctx: &PassContext, unit: &mut UnitBuilder) -> bool {
+        if !unit.is_process() {
+            return false;
+        }
+        info!("DDE [{}]", unit.name());
+        let ignored = loop_variant_drives(&unit, &unit.loops());
+
+        // Determine which parts of the signals are definitely driven later on
+        // at the start of each block, iterating to a fixpoint to handle loops.
+        // Blocks that have not been visited yet are optimistically assumed to
+        // drive everything.
+        let order = reverse_post_order(&unit);
+        let mut live_in = HashMap::<Block, Coverage>::new();
+        let mut changed = true;
+        while changed {
+            changed = false;
+            for &bb in order.iter().rev() {
+                let mut cover = match live_out(&unit, &live_in, bb) {
+                    Some(cover) => cover,
+                    None => continue,
+                };
+                for inst in unit.insts(bb).collect::<Vec<_>>().into_iter().rev() {
+                    visit_drive(&unit, &ignored, inst, &mut cover);
+                }
+                if live_in.get(&bb) != Some(&cover) {
+                    live_in.insert(bb, cover);
+                    changed = true;
+                }
+            }
+        }
+
+        // Find the drives that are covered by later drives.
+        let mut dead = vec![];
+        for &bb in &order {
+            let mut cover = live_out(&unit, &live_in, bb).unwrap_or_default();
+            for inst in unit.insts(bb).collect::<Vec<_>>().into_iter().rev() {
+                if visit_drive(&unit, &ignored, inst, &mut cover) {
+                    dead.push(inst);
+                }
+            }
+        }
+
+        // Remove them.
+        let modified = !dead.is_empty();
+        for inst in dead {
+            debug!("Removing dead {}", inst.dump(&unit));
+            let args = unit[inst].args().to_vec();
+            unit.delete_inst(inst);
+            for arg in args {
+                if let Some(arg) = unit.get_value_inst(arg) {
+                    unit.prune_if_unused(arg);
+                }
+            }
+        }
+        modified
+    }
+}
+
+/// The parts of signals that are driven, grouped by root signal and delay.
+///
+/// Each entry lists the disjoint, sorted ranges of bits, elements, or fields
+/// of the root signal that are driven.
+type Coverage = HashMap<(Value, TimeValue), Vec<(usize, usize)>>;
+
+/// Compute the coverage at the end of a block.
+///
+/// Returns `None` if none of the block's successors have been visited yet.
+/// Blocks that end in a temporal instruction, and thus in a new delta cycle,
+/// cover nothing.
+fn live_out(unit: &Unit, live_in: &HashMap<Block, Coverage>, bb: Block) -> Option<Coverage> {
+    let term = unit.terminator(bb);
+    if unit[term].opcode().is_temporal() || unit[term].blocks().is_empty() {
+        return Some(Default::default());
+    }
+    let mut result: Option<Coverage> = None;
+    for succ in unit[term].blocks() {
+        let cover = match live_in.get(succ) {
+            Some(cover) => cover,
+            None => continue,
+        };
+        result = Some(match result {
+            Some(result) => intersect(&result, cover),
+            None => cover.clone(),
+        });
+    }
+    result
+}
+
+/// Update the coverage before an instruction, given the coverage after it.
+///
+/// Returns true if the instruction is a drive that is covered. Drives with a
+/// non-constant delay and the `ignored` drives neither are covered nor cover
+/// anything.
+fn visit_drive(unit: &Unit, ignored: &HashSet<Inst>, inst: Inst, cover: &mut Coverage) -> bool {
+    let opcode = unit[inst].opcode();
+    if (opcode != Opcode::Drv && opcode != Opcode::DrvCond) || ignored.contains(&inst) {
+        return false;
+    }
+    let args = unit[inst].args();
+    let delay = match unit.get_const_time(args[2]) {
+        Some(t) => t.clone(),
+        None => return false,
+    };
+    let (root, lo, hi) = locate(unit, args[0]);
+    let key = (root, delay);
+    if let Some(ranges) = cover.get(&key) {
+        if ranges.iter().any(|&(a, b)| a <= lo && hi <= b) {
+            return true;
+        }
+    }
+    if opcode == Opcode::Drv {
+        let ranges = cover.entry(key).or_default();
+        ranges.push((lo, hi));
+        ranges.sort();
+        let mut merged: Vec<(usize, usize)> = vec![];
+        for &(a, b) in ranges.iter() {
+            match merged.last_mut() {
+                Some(last) if a <= last.1 => last.1 = last.1.max(b),
+                _ => merged.push((a, b)),
+            }
+        }
+        *ranges = merged;
+    }
+    false
+}
+
+/// Find the drives whose target signal, or any signal it was extracted from,
+/// is defined inside a loop around the drive that repeats within the same
+/// delta cycle.
+fn loop_variant_drives(unit: &Unit, loops: &LoopInfo) -> HashSet<Inst> {
+    let mut result = HashSet::new();
+    for inst in unit.all_insts() {
+        let opcode = unit[inst].opcode();
+        if opcode != Opcode::Drv && opcode != Opcode::DrvCond {
+            continue;
+        }
+        let bb = unit.inst_block(inst).unwrap();
+        let mut value = unit[inst].args()[0];
+        while let Some(def) = unit.get_value_inst(value) {
+            let def_bb = unit.inst_block(def).unwrap();
+            let variant = loops.loops().iter().any(|lp| {
+                lp.contains(bb) && lp.contains(def_bb) && repeats_in_delta(unit, lp, def_bb)
+            });
+            if variant {
+                trace!("Ignoring loop-variant {}", inst.dump(&unit));
+                result.insert(inst);
+                break;
+            }
+            match unit[def].opcode() {
+                Opcode::ExtSlice | Opcode::ExtField => value = unit[def].args()[0],
+                _ => break,
+            }
+        }
+    }
+    result
+}
+
+/// Check whether a block of a loop can be reached from itself within the loop
+/// without passing through a temporal instruction.
+fn repeats_in_delta(unit: &Unit, lp: &Loop, bb: Block) -> bool {
+    let mut seen = HashSet::new();
+    let mut todo = vec![bb];
+    while let Some(from) = todo.pop() {
+        let term = unit.terminator(from);
+        if unit[term].opcode().is_temporal() {
+            continue;
+        }
+        for &succ in unit[term].blocks() {
+            if succ == bb {
+                return true;
+            }
+            if lp.contains(succ) && seen.insert(succ) {
+                todo.push(succ);
+            }
+        }
+    }
+    false
+}
+
+/// Find the root signal a signal was extracted from, and the range of bits,
+/// elements, or fields of the root that it covers.
+///
+/// Slices compose with each other. A field only composes with the array it
+/// was extracted from if the entire field is covered; otherwise the field
+/// itself is considered the root.
+fn locate(unit: &Unit, signal: Value) -> (Value, usize, usize) {
+    let extent = |value| unit.value_type(value).unwrap_signal().len().max(1);
+    let (mut value, mut lo, mut hi) = (signal, 0, extent(signal));
+    while let Some(inst) = unit.get_value_inst(value) {
+        let offset = unit[inst].imms().first().cloned().unwrap_or(0);
+        match unit[inst].opcode() {
+            Opcode::ExtSlice => {
+                lo += offset;
+                hi += offset;
+            }
+            Opcode::ExtField if lo == 0 && hi == extent(value) => {
+                lo = offset;
+                hi = offset + 1;
+            }
+            _ => break,
+        }
+        value = unit[inst].args()[0];
+    }
+    (value, lo, hi)
+}
+
+/// Compute the parts of signals covered in both of two coverages.
+fn intersect(a: &Coverage, b: &Coverage) -> Coverage {
+    let mut result = Coverage::new();
+    for (key, ra) in a {
+        let rb = match b.get(key) {
+            Some(rb) => rb,
+            None => continue,
+        };
+        let mut ranges = vec![];
+        for &(a0, a1) in ra {
+            for &(b0, b1) in rb {
+                let (lo, hi) = (a0.max(b0), a1.min(b1));
+                if lo < hi {
+                    ranges.push((lo, hi));
+                }
+            }
+        }
+        if !ranges.is_empty() {
+            ranges.sort();
+            result.insert(key.clone(), ranges);
+        }
+    }
+    result
+}
@@ -8,7 +8,10 @@ use crate::{
     opt::prelude::*,
     value::IntValue,
 };
-use std::collections::{BTreeMap, BTreeSet, HashMap, HashSet};
+use std::{
+    collections::{BTreeMap, BTreeSet, HashMap, HashSet},
+    sync::Arc,
+};
 
 /// Desequentialization
 ///
@@ -21,7 +24,7 @@ impl Pass for Desequentialization {
         if unit.kind() == UnitKind::Process {
             match deseq_process(ctx, unit) {
                 Some(entity) => {
-                    *unit.data() = entity;
+                    unit.replace_data(entity);
                     true
                 }
                 _ => false,
@@ -660,13 +663,13 @@ impl<'a, 'b> Migrator<'a, 'b> {
                 if let Some(&level) = ties.get(&(sig, tr)) {
                     let data = InstData::ConstInt {
                         opcode: Opcode::ConstInt,
-                        imm: IntValue::from_usize(
+                        imm: Arc::new(IntValue::from_usize(
                             1,
                             match level {
                                 TriggerLevel::High => 1,
                                 TriggerLevel::Low => 0,
                             },
-                        ),
+                        )),
                     };
                     return Some(self.migrate_inst_data(data, value));
                 }
@@ -3,7 +3,7 @@
 //! Early Code Motion
 
 use crate::{analysis::DominatorTree, ir::prelude::*, opt::prelude::*};
-use std::collections::{HashMap, HashSet};
+use std::collections::{HashMap, HashSet, VecDeque};
 
 /// Early Code Motion
 ///
@@ -21,17 +21,19 @@ impl Pass for EarlyCodeMotion {
         let dt = unit.domtree_with_predtbl(&pred);
 
         // Create a work queue which allows us to process the blocks in control
-        // flow order. Also number the blocks as we go.
+        // flow order. Also number the blocks as we go. The queue is processed
+        // in breadth-first order, such that the result is deterministic.
         let mut block_numbers = HashMap::<Block, usize>::new();
         let mut work_done = HashSet::<Block>::new();
-        let mut work_pending = HashSet::<Block>::new();
+        let mut work_pending = VecDeque::<Block>::new();
         let entry = unit.entry();
-        work_pending.insert(entry);
+        work_pending.push_back(entry);
         block_numbers.insert(entry, 0);
 
-        while let Some(&block) = work_pending.iter().next() {
-            work_pending.remove(&block);
-            work_done.insert(block);
+        while let Some(block) = work_pending.pop_front() {
+            if !work_done.insert(block) {
+                continue;
+            }
             trace!("Working on {}", block.dump(&unit));
 
             // Process the instructions in this block.
@@ -15,6 +15,10 @@ use std::collections::{HashMap, HashSet};
 pub struct GlobalCommonSubexprElim;
 
 impl Pass for GlobalCommonSubexprElim {
+    fn run_on_unit(ctx: &PassContext, unit: &mut UnitBuilder) -> bool {
+        run_on_partitions(ctx, unit, Self::run_on_cfg)
+    }
+
     fn run_on_cfg(_ctx: &PassContext, unit: &mut UnitBuilder) -> bool {
         info!("GCSE [{}]", unit.name());
 
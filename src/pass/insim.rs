@@ -4,77 +4,497 @@
 
 use crate::ir::prelude::*;
 use crate::opt::prelude::*;
+use crate::{ty::Type, value::IntValue};
+use std::{
+    collections::{HashMap, HashSet},
+    sync::atomic::{AtomicUsize, Ordering},
+};
 
 /// Instruction Simplification
 ///
 /// This pass implements various instruction combinations and simplifications.
+/// Most of them are expressed as rewrite rules in the `rules!` table below.
+/// Whenever an instruction is simplified, its users are revisited, such that
+/// simplifications propagate through the unit in a single run of the pass.
 pub struct InstSimplification;
 
 impl Pass for InstSimplification {
-    fn run_on_inst(ctx: &PassContext, inst: Inst, unit: &mut UnitBuilder) -> bool {
-        unit.insert_after(inst);
-        match unit[inst].opcode() {
+    fn run_on_unit(ctx: &PassContext, unit: &mut UnitBuilder) -> bool {
+        run_on_partitions(ctx, unit, Self::run_on_cfg)
+    }
+
+    fn run_on_cfg(ctx: &PassContext, unit: &mut UnitBuilder) -> bool {
+        let rules = RuleIndex::new();
+        let mut worklist: Vec<Inst> = unit.all_insts().collect();
+        worklist.reverse();
+        let mut queued: HashSet<Inst> = worklist.iter().cloned().collect();
+        let mut modified = false;
+        while let Some(inst) = worklist.pop() {
+            queued.remove(&inst);
+
             // drv ... if 0 -> removed
             // drv ... if 1 -> drv ...
-            Opcode::DrvCond => {
-                if let Some(konst) = unit.get_const_int(unit[inst].args()[3]) {
-                    if konst.is_one() {
-                        let signal = unit[inst].args()[0];
-                        let value = unit[inst].args()[1];
-                        let delay = unit[inst].args()[2];
-                        unit.ins().drv(signal, value, delay);
-                    }
-                    unit.delete_inst(inst);
-                }
+            if unit[inst].opcode() == Opcode::DrvCond {
+                modified |= simplify_drv_cond(inst, unit);
+                continue;
             }
-            _ => (),
-        }
-        let value = match unit.get_inst_result(inst) {
-            Some(value) => value,
-            None => return false,
-        };
-        match unit[inst].opcode() {
-            // and %a, %a -> %a
-            // or %a, %a -> %a
-            Opcode::And | Opcode::Or if unit[inst].args()[0] == unit[inst].args()[1] => {
-                replace(inst, value, unit[inst].args()[0], unit)
-            }
-            // xor %a, %a -> 0
-            // [us]rem %a, %a -> 0
-            // [us]mod %a, %a -> 0
-            Opcode::Xor | Opcode::Umod | Opcode::Urem | Opcode::Smod | Opcode::Srem
-                if unit[inst].args()[0] == unit[inst].args()[1] =>
-            {
-                let ty = unit.value_type(value);
-                let zero = unit.ins().const_zero(&ty);
-                replace(inst, value, zero, unit)
+
+            // Find a replacement for the value of the instruction.
+            let value = match unit.get_inst_result(inst) {
+                Some(value) if !unit.uses(value).is_empty() => value,
+                _ => continue,
+            };
+            unit.insert_after(inst);
+            let replacement = match unit[inst].opcode() {
+                Opcode::Mux => simplify_mux(ctx, inst, unit),
+                opcode => rules.apply(opcode, inst, unit),
+            };
+            let replacement = match replacement {
+                Some(r) => r,
+                None => continue,
+            };
+            debug!(
+                "Replace {} with {}",
+                inst.dump(&unit),
+                replacement.dump(&unit)
+            );
+
+            // Revisit the users of the value, and the replacement itself if it
+            // is a new instruction.
+            let mut revisit: Vec<Inst> = unit.uses(value).iter().cloned().collect();
+            revisit.sort();
+            revisit.extend(unit.get_value_inst(replacement));
+            modified |= unit.replace_use(value, replacement) > 0;
+            for inst in revisit.into_iter().rev() {
+                if queued.insert(inst) {
+                    worklist.push(inst);
+                }
             }
-            Opcode::Mux => simplify_mux(ctx, inst, value, unit),
-            _ => false,
         }
+        modified
+    }
+}
+
+impl InstSimplification {
+    /// Get the number of times each rewrite rule has been applied so far.
+    ///
+    /// The counts accumulate over all runs of the pass in the process.
+    pub fn rule_statistics() -> Vec<(&'static str, usize)> {
+        RULES
+            .iter()
+            .map(|rule| (rule.name, rule.fired.load(Ordering::Relaxed)))
+            .collect()
     }
 }
 
-fn replace(from_inst: Inst, from_value: Value, to: Value, unit: &mut UnitBuilder) -> bool {
-    debug!("Replace {} with {}", from_inst.dump(&unit), to.dump(&unit));
-    unit.replace_use(from_value, to) > 0
+fn simplify_drv_cond(inst: Inst, unit: &mut UnitBuilder) -> bool {
+    let konst = match unit.get_const_int(unit[inst].args()[3]) {
+        Some(konst) => konst.is_one(),
+        None => return false,
+    };
+    if konst {
+        let signal = unit[inst].args()[0];
+        let value = unit[inst].args()[1];
+        let delay = unit[inst].args()[2];
+        unit.insert_after(inst);
+        unit.ins().drv(signal, value, delay);
+    }
+    unit.delete_inst(inst);
+    true
 }
 
-fn simplify_mux(_ctx: &PassContext, inst: Inst, value: Value, unit: &mut UnitBuilder) -> bool {
+fn simplify_mux(_ctx: &PassContext, inst: Inst, unit: &mut UnitBuilder) -> Option<Value> {
     // Check if all options are identical, in which case simply replace us with
     // the option directly.
     let array = unit[inst].args()[0];
-    if let Some(array_inst) = unit.get_value_inst(array) {
-        let mut iter = unit[array_inst].args().iter().cloned();
-        let first = match iter.next() {
-            Some(first) => first,
-            None => return false,
-        };
-        let identical = iter.all(|a| a == first);
-        if identical {
-            return replace(inst, value, first, unit);
+    let array_inst = unit.get_value_inst(array)?;
+    let mut iter = unit[array_inst].args().iter().cloned();
+    let first = iter.next()?;
+    if iter.all(|a| a == first) {
+        Some(first)
+    } else {
+        None
+    }
+}
+
+/// A rewrite rule.
+struct Rule {
+    /// The name of the rule.
+    name: &'static str,
+    /// The opcode of the instruction at the root of the pattern.
+    root: Opcode,
+    /// Match an instruction against the pattern, and build the replacement for
+    /// its value if it matches.
+    apply: fn(&mut UnitBuilder, Inst) -> Option<Value>,
+    /// The number of times the rule has been applied.
+    fired: AtomicUsize,
+}
+
+/// The rewrite rules grouped by the opcode at the root of their pattern.
+struct RuleIndex(HashMap<Opcode, Vec<&'static Rule>>);
+
+impl RuleIndex {
+    fn new() -> Self {
+        let mut index = HashMap::<Opcode, Vec<&'static Rule>>::new();
+        for rule in RULES.iter() {
+            index.entry(rule.root).or_default().push(rule);
+        }
+        Self(index)
+    }
+
+    /// Apply the first matching rule to an instruction.
+    fn apply(&self, opcode: Opcode, inst: Inst, unit: &mut UnitBuilder) -> Option<Value> {
+        for rule in self.0.get(&opcode)? {
+            if let Some(value) = (rule.apply)(unit, inst) {
+                trace!("Applied rule {} to {}", rule.name, inst.dump(&unit));
+                rule.fired.fetch_add(1, Ordering::Relaxed);
+                return Some(value);
+            }
         }
+        None
     }
+}
+
+/// The variables bound while matching a pattern.
+struct Bindings {
+    len: usize,
+    vars: [(&'static str, Value); 4],
+}
+
+impl Bindings {
+    fn new() -> Self {
+        Self {
+            len: 0,
+            vars: [("", Value::invalid()); 4],
+        }
+    }
+
+    /// Bind a variable to a value, or check that it is already bound to the
+    /// same value.
+    fn bind(&mut self, name: &'static str, value: Value) -> bool {
+        for &(n, v) in &self.vars[..self.len] {
+            if n == name {
+                return v == value;
+            }
+        }
+        self.vars[self.len] = (name, value);
+        self.len += 1;
+        true
+    }
+
+    /// Get the value bound to a variable.
+    fn get(&self, name: &'static str) -> Value {
+        self.vars[..self.len]
+            .iter()
+            .find(|&&(n, _)| n == name)
+            .map(|&(_, v)| v)
+            .unwrap()
+    }
+}
+
+/// Check whether a type is the integer type called `name`, e.g. `i1`.
+fn is_int_named(ty: &Type, name: &str) -> bool {
+    ty.is_int() && name[1..].parse() == Ok(ty.unwrap_int())
+}
+
+/// Check whether a value is an integer constant that satisfies a predicate.
+fn is_const_int(unit: &Unit, value: Value, pred: fn(&IntValue) -> bool) -> bool {
+    unit.get_const_int(value).map(pred).unwrap_or(false)
+}
+
+/// Build an integer constant of the same width as an integer type.
+fn const_int_like(unit: &mut UnitBuilder, ty: &Type, make: fn(usize) -> IntValue) -> Option<Value> {
+    if ty.is_int() {
+        Some(unit.ins().const_int(make(ty.unwrap_int())))
+    } else {
+        None
+    }
+}
+
+/// Map the mnemonic of an instruction to its opcode.
+macro_rules! opcode {
+    (not) => {
+        Opcode::Not
+    };
+    (neg) => {
+        Opcode::Neg
+    };
+    (add) => {
+        Opcode::Add
+    };
+    (sub) => {
+        Opcode::Sub
+    };
+    (and) => {
+        Opcode::And
+    };
+    (or) => {
+        Opcode::Or
+    };
+    (xor) => {
+        Opcode::Xor
+    };
+    (smul) => {
+        Opcode::Smul
+    };
+    (sdiv) => {
+        Opcode::Sdiv
+    };
+    (smod) => {
+        Opcode::Smod
+    };
+    (srem) => {
+        Opcode::Srem
+    };
+    (umul) => {
+        Opcode::Umul
+    };
+    (udiv) => {
+        Opcode::Udiv
+    };
+    (umod) => {
+        Opcode::Umod
+    };
+    (urem) => {
+        Opcode::Urem
+    };
+    (eq) => {
+        Opcode::Eq
+    };
+    (neq) => {
+        Opcode::Neq
+    };
+    (slt) => {
+        Opcode::Slt
+    };
+    (sgt) => {
+        Opcode::Sgt
+    };
+    (sle) => {
+        Opcode::Sle
+    };
+    (sge) => {
+        Opcode::Sge
+    };
+    (ult) => {
+        Opcode::Ult
+    };
+    (ugt) => {
+        Opcode::Ugt
+    };
+    (ule) => {
+        Opcode::Ule
+    };
+    (uge) => {
+        Opcode::Uge
+    };
+    (shl) => {
+        Opcode::Shl
+    };
+    (shr) => {
+        Opcode::Shr
+    };
+}
+
+/// Expand a pattern into a boolean expression that checks whether it matches.
+///
+/// A pattern is one of:
+///
+/// - `?a` to match any value and bind it to `a`, or check that it is the value
+///   already bound to `a`;
+/// - `?a:iN` to do the same, but only for values of type `iN`;
+/// - `0`, `1`, and `-1` to match an integer constant that is zero, one, or all
+///   ones, respectively;
+/// - `(op p0 p1 ...)` to match an instruction with opcode `op` whose arguments
+///   match the patterns `p0`, `p1`, etc.
+macro_rules! pattern {
+    (@inst $unit:ident, $b:ident, $inst:expr; $op:ident $($p:tt)*) => {{
+        let data = &$unit[$inst];
+        data.opcode() == opcode!($op) && {
+            let args = data.args();
+            pattern!(@args $unit, $b, args, 0; $($p)*)
+        }
+    }};
+    (@args $unit:ident, $b:ident, $args:ident, $i:expr;) => {
+        $args.len() == $i
+    };
+    (@args $unit:ident, $b:ident, $args:ident, $i:expr; ? $x:ident : $ty:ident $($rest:tt)*) => {
+        $args.len() > $i
+            && pattern!(@value $unit, $b, $args[$i]; ? $x : $ty)
+            && pattern!(@args $unit, $b, $args, $i + 1; $($rest)*)
+    };
+    (@args $unit:ident, $b:ident, $args:ident, $i:expr; ? $x:ident $($rest:tt)*) => {
+        $args.len() > $i
+            && pattern!(@value $unit, $b, $args[$i]; ? $x)
+            && pattern!(@args $unit, $b, $args, $i + 1; $($rest)*)
+    };
+    (@args $unit:ident, $b:ident, $args:ident, $i:expr; - $lit:literal $($rest:tt)*) => {
+        $args.len() > $i
+            && pattern!(@value $unit, $b, $args[$i]; - $lit)
+            && pattern!(@args $unit, $b, $args, $i + 1; $($rest)*)
+    };
+    (@args $unit:ident, $b:ident, $args:ident, $i:expr; $p:tt $($rest:tt)*) => {
+        $args.len() > $i
+            && pattern!(@value $unit, $b, $args[$i]; $p)
+            && pattern!(@args $unit, $b, $args, $i + 1; $($rest)*)
+    };
+    (@value $unit:ident, $b:ident, $v:expr; ? $x:ident : $ty:ident) => {
+        is_int_named(&$unit.value_type($v), stringify!($ty)) && $b.bind(stringify!($x), $v)
+    };
+    (@value $unit:ident, $b:ident, $v:expr; ? $x:ident) => {
+        $b.bind(stringify!($x), $v)
+    };
+    (@value $unit:ident, $b:ident, $v:expr; 0) => {
+        is_const_int(&$unit, $v, IntValue::is_zero)
+    };
+    (@value $unit:ident, $b:ident, $v:expr; 1) => {
+        is_const_int(&$unit, $v, IntValue::is_one)
+    };
+    (@value $unit:ident, $b:ident, $v:expr; - 1) => {
+        is_const_int(&$unit, $v, IntValue::is_all_ones)
+    };
+    (@value $unit:ident, $b:ident, $v:expr; ($op:ident $($p:tt)*)) => {
+        match $unit.get_value_inst($v) {
+            Some(inst) => pattern!(@inst $unit, $b, inst; $op $($p)*),
+            None => false,
+        }
+    };
+}
+
+/// Expand the result of a rule into an expression that builds it.
+///
+/// A result is either a variable bound by the pattern, a constant `0`, `1`, or
+/// `-1` of the same type as the replaced value, or `(op ?a ...)` to build a
+/// new instruction from bound variables.
+macro_rules! result {
+    ($unit:ident, $b:ident, $ty:ident; ? $x:ident) => {
+        Some($b.get(stringify!($x)))
+    };
+    ($unit:ident, $b:ident, $ty:ident; 0) => {
+        Some($unit.ins().const_zero(&$ty))
+    };
+    ($unit:ident, $b:ident, $ty:ident; 1) => {
+        const_int_like($unit, &$ty, |w| IntValue::from_usize(w, 1))
+    };
+    ($unit:ident, $b:ident, $ty:ident; - 1) => {
+        const_int_like($unit, &$ty, IntValue::all_ones)
+    };
+    ($unit:ident, $b:ident, $ty:ident; ($op:ident $(? $x:ident)+)) => {
+        Some($unit.ins().$op($($b.get(stringify!($x))),+))
+    };
+}
+
+/// Define the table of rewrite rules.
+///
+/// Each rule has the form `name: pattern => result;`. Every rule is expanded
+/// into a function that matches the pattern from its root instruction down,
+/// and builds the result if it matches.
+macro_rules! rules {
+    (@rule $name:ident, ($root:ident $($p:tt)*), $($r:tt)+) => {
+        fn $name(unit: &mut UnitBuilder, inst: Inst) -> Option<Value> {
+            let mut b = Bindings::new();
+            if !pattern!(@inst unit, b, inst; $root $($p)*) {
+                return None;
+            }
+            let ty = unit.inst_type(inst);
+            result!(unit, b, ty; $($r)+)
+        }
+    };
+    (@munch [$(($name:ident $root:ident))*]) => {
+        static RULES: [Rule; [$(stringify!($name)),*].len()] = [$(Rule {
+            name: stringify!($name),
+            root: opcode!($root),
+            apply: $name,
+            fired: AtomicUsize::new(0),
+        }),*];
+    };
+    (@munch [$($done:tt)*] $name:ident: ($root:ident $($p:tt)*) => ? $x:ident; $($rest:tt)*) => {
+        rules!(@rule $name, ($root $($p)*), ? $x);
+        rules!(@munch [$($done)* ($name $root)] $($rest)*);
+    };
+    (@munch [$($done:tt)*] $name:ident: ($root:ident $($p:tt)*) => - $r:literal; $($rest:tt)*) => {
+        rules!(@rule $name, ($root $($p)*), - $r);
+        rules!(@munch [$($done)* ($name $root)] $($rest)*);
+    };
+    (@munch [$($done:tt)*] $name:ident: ($root:ident $($p:tt)*) => $r:tt; $($rest:tt)*) => {
+        rules!(@rule $name, ($root $($p)*), $r);
+        rules!(@munch [$($done)* ($name $root)] $($rest)*);
+    };
+    ($($rules:tt)*) => {
+        rules!(@munch [] $($rules)*);
+    };
+}
+
+rules! {
+    // Idempotence and self-cancellation.
+    and_self: (and ?a ?a) => ?a;
+    or_self: (or ?a ?a) => ?a;
+    xor_self: (xor ?a ?a) => 0;
+    sub_self: (sub ?a ?a) => 0;
+    umod_self: (umod ?a ?a) => 0;
+    urem_self: (urem ?a ?a) => 0;
+    smod_self: (smod ?a ?a) => 0;
+    srem_self: (srem ?a ?a) => 0;
+
+    // Identity and absorbing elements.
+    and_zero: (and ?a 0) => 0;
+    and_zero_lhs: (and 0 ?a) => 0;
+    and_ones: (and ?a -1) => ?a;
+    and_ones_lhs: (and -1 ?a) => ?a;
+    or_zero: (or ?a 0) => ?a;
+    or_zero_lhs: (or 0 ?a) => ?a;
+    or_ones: (or ?a -1) => -1;
+    or_ones_lhs: (or -1 ?a) => -1;
+    xor_zero: (xor ?a 0) => ?a;
+    xor_zero_lhs: (xor 0 ?a) => ?a;
+    xor_ones: (xor ?a -1) => (not ?a);
+    xor_ones_lhs: (xor -1 ?a) => (not ?a);
+    add_zero: (add ?a 0) => ?a;
+    add_zero_lhs: (add 0 ?a) => ?a;
+    sub_zero: (sub ?a 0) => ?a;
+    umul_zero: (umul ?a 0) => 0;
+    umul_zero_lhs: (umul 0 ?a) => 0;
+    umul_one: (umul ?a 1) => ?a;
+    umul_one_lhs: (umul 1 ?a) => ?a;
+    smul_zero: (smul ?a 0) => 0;
+    smul_zero_lhs: (smul 0 ?a) => 0;
+    udiv_one: (udiv ?a 1) => ?a;
+    shl_zero: (shl ?a ?h 0) => ?a;
+    shr_zero: (shr ?a ?h 0) => ?a;
+
+    // Complements.
+    not_not: (not (not ?a)) => ?a;
+    neg_neg: (neg (neg ?a)) => ?a;
+    and_not: (and ?a (not ?a)) => 0;
+    and_not_lhs: (and (not ?a) ?a) => 0;
+    or_not: (or ?a (not ?a)) => -1;
+    or_not_lhs: (or (not ?a) ?a) => -1;
+    xor_not: (xor ?a (not ?a)) => -1;
+    xor_not_lhs: (xor (not ?a) ?a) => -1;
+
+    // Absorption.
+    and_or: (and ?a (or ?a ?b)) => ?a;
+    and_or_rhs: (and ?a (or ?b ?a)) => ?a;
+    and_or_lhs: (and (or ?a ?b) ?a) => ?a;
+    and_or_lhs_rhs: (and (or ?b ?a) ?a) => ?a;
+    or_and: (or ?a (and ?a ?b)) => ?a;
+    or_and_rhs: (or ?a (and ?b ?a)) => ?a;
+    or_and_lhs: (or (and ?a ?b) ?a) => ?a;
+    or_and_lhs_rhs: (or (and ?b ?a) ?a) => ?a;
 
-    false
+    // Comparisons.
+    eq_self: (eq ?a ?a) => 1;
+    neq_self: (neq ?a ?a) => 0;
+    ule_self: (ule ?a ?a) => 1;
+    uge_self: (uge ?a ?a) => 1;
+    sle_self: (sle ?a ?a) => 1;
+    sge_self: (sge ?a ?a) => 1;
+    ult_self: (ult ?a ?a) => 0;
+    ugt_self: (ugt ?a ?a) => 0;
+    slt_self: (slt ?a ?a) => 0;
+    sgt_self: (sgt ?a ?a) => 0;
+    eq_true: (eq ?a:i1 1) => ?a;
+    eq_false: (eq ?a:i1 0) => (not ?a);
+    neq_false: (neq ?a:i1 0) => ?a;
+    neq_true: (neq ?a:i1 1) => (not ?a);
 }
@@ -0,0 +1,198 @@
+// Copyright (c) 2017-2021 Fabian Schuiki
+
+//! Loop-Invariant Code Motion
+
+use crate::{analysis::Loop, ir::prelude::*, opt::prelude::*};
+use std::collections::HashSet;
+
+/// Loop-Invariant Code Motion
+///
+/// This pass moves instructions whose arguments do not change within a loop
+/// into the loop's preheader, such that they are computed once before the loop
+/// is entered rather than in every iteration. Since the loop that a process
+/// executes once per wakeup is a natural loop formed by its `wait`, this also
+/// hoists computations that do not depend on probed signals out of the process
+/// body, such that they are computed once when the process starts.
+///
+/// Only instructions without side effects that cannot fail are moved, which
+/// excludes memory accesses, calls, and divisions. Probes are moved out of
+/// loops that contain no `wait`, as long as the preheader does not end in a
+/// `wait` either, since signals cannot change within the same instant.
+///
+/// Loops without a preheader get a new block inserted in front of their
+/// header, which all edges into the loop are redirected to. This covers the
+/// common process shape whose entry block ends in a `wait` on itself. Loops
+/// whose header has phi nodes with several incoming edges from outside the
+/// loop are left untouched.
+pub struct LoopInvariantCodeMotion;
+
+impl Pass for LoopInvariantCodeMotion {
+    fn run_on_cfg(_ctx: &PassContext, unit: &mut UnitBuilder) -> bool {
+        if unit.is_entity() {
+            return false;
+        }
+        info!("LICM [{}]", unit.name());
+        let mut modified = false;
+
+        // Insert the missing preheaders. Each new preheader becomes part of
+        // the loops around its header, so the loops are recomputed every time.
+        loop {
+            let info = unit.loops();
+            let (header, outside) = match info
+                .loops()
+                .iter()
+                .find_map(|lp| missing_preheader(&unit, lp))
+            {
+                Some(x) => x,
+                None => break,
+            };
+            insert_preheader(unit, header, &outside);
+            modified = true;
+        }
+
+        // Loops are listed innermost first, such that instructions hoisted out
+        // of an inner loop may subsequently be hoisted out of an outer one.
+        let info = unit.loops();
+        for lp in info.loops() {
+            let preheader = match lp.preheader {
+                Some(bb) => bb,
+                None => {
+                    trace!("Skipping loop {} (no preheader)", lp.header.dump(&unit));
+                    continue;
+                }
+            };
+            let is_temporal = |bb| unit[unit.terminator(bb)].opcode().is_temporal();
+            let probes = !is_temporal(preheader) && !lp.blocks.iter().any(|&bb| is_temporal(bb));
+
+            // Find the invariant instructions. The blocks are in reverse
+            // post-order, such that arguments are visited before their users.
+            let mut invariant = HashSet::new();
+            let mut hoist = vec![];
+            for &bb in &lp.blocks {
+                for inst in unit.insts(bb) {
+                    if !is_hoistable(unit[inst].opcode(), probes) {
+                        continue;
+                    }
+                    let args = unit[inst].args();
+                    if args
+                        .iter()
+                        .all(|&arg| is_invariant(&unit, lp, &invariant, arg))
+                    {
+                        invariant.insert(inst);
+                        hoist.push(inst);
+                    }
+                }
+            }
+
+            // Move them into the preheader.
+            let term = unit.terminator(preheader);
+            for inst in hoist {
+                debug!("Hoist {} into {}", inst.dump(&unit), preheader.dump(&unit));
+                unit.remove_inst(inst);
+                unit.insert_inst_before(inst, term);
+                modified = true;
+            }
+        }
+
+        modified
+    }
+}
+
+/// Find the header of a loop that lacks a preheader, and the blocks outside
+/// the loop that branch to it.
+///
+/// Returns `None` if the loop has a preheader, or if one cannot be inserted
+/// because the header's phi nodes would have to merge several of the edges.
+fn missing_preheader(unit: &Unit, lp: &Loop) -> Option<(Block, Vec<Block>)> {
+    if lp.preheader.is_some() {
+        return None;
+    }
+    let header = lp.header;
+    let outside: Vec<_> = unit
+        .blocks()
+        .filter(|&bb| !lp.contains(bb) && unit[unit.terminator(bb)].blocks().contains(&header))
+        .collect();
+    let has_phis = unit
+        .insts(header)
+        .any(|inst| unit[inst].opcode() == Opcode::Phi);
+    if outside.len() > 1 && has_phis {
+        trace!("Cannot insert preheader for {}", header.dump(&unit));
+        return None;
+    }
+    Some((header, outside))
+}
+
+/// Insert a block in front of a loop header, and redirect the edges from
+/// outside the loop to it.
+fn insert_preheader(unit: &mut UnitBuilder, header: Block, outside: &[Block]) {
+    let bb = unit.named_block("preheader");
+    unit.remove_block(bb);
+    unit.insert_block_before(bb, header);
+    debug!(
+        "Insert preheader {} for {}",
+        bb.dump(&unit),
+        header.dump(&unit)
+    );
+    for &pred in outside {
+        let term = unit.terminator(pred);
+        unit.replace_block_within_inst(header, bb, term);
+        let phis: Vec<_> = unit
+            .insts(header)
+            .filter(|&inst| unit[inst].opcode() == Opcode::Phi)
+            .collect();
+        for phi in phis {
+            unit.replace_block_within_inst(pred, bb, phi);
+        }
+    }
+    unit.append_to(bb);
+    unit.ins().br(header);
+}
+
+/// Check whether a value is defined outside a loop, or by an instruction that
+/// has been found to be invariant.
+fn is_invariant(unit: &Unit, lp: &Loop, invariant: &HashSet<Inst>, value: Value) -> bool {
+    match unit.get_value_inst(value) {
+        Some(inst) => invariant.contains(&inst) || !lp.contains(unit.inst_block(inst).unwrap()),
+        None => true,
+    }
+}
+
+/// Check whether an instruction can be executed speculatively.
+fn is_hoistable(op: Opcode, probes: bool) -> bool {
+    match op {
+        Opcode::Prb => probes,
+        Opcode::ConstInt
+        | Opcode::ConstTime
+        | Opcode::Alias
+        | Opcode::ArrayUniform
+        | Opcode::Array
+        | Opcode::Struct
+        | Opcode::Not
+        | Opcode::Neg
+        | Opcode::Add
+        | Opcode::Sub
+        | Opcode::And
+        | Opcode::Or
+        | Opcode::Xor
+        | Opcode::Smul
+        | Opcode::Umul
+        | Opcode::Eq
+        | Opcode::Neq
+        | Opcode::Slt
+        | Opcode::Sgt
+        | Opcode::Sle
+        | Opcode::Sge
+        | Opcode::Ult
+        | Opcode::Ugt
+        | Opcode::Ule
+        | Opcode::Uge
+        | Opcode::Shl
+        | Opcode::Shr
+        | Opcode::Mux
+        | Opcode::InsField
+        | Opcode::InsSlice
+        | Opcode::ExtField
+        | Opcode::ExtSlice => true,
+        _ => false,
+    }
+}
@@ -0,0 +1,436 @@
+// Copyright (c) 2017-2021 Fabian Schuiki
+
+//! Lookup Table Conversion
+
+use crate::{analysis::PredecessorTable, ir::prelude::*, opt::prelude::*};
+use std::collections::HashSet;
+
+/// Lookup Table Conversion
+///
+/// This pass replaces decisions that compare one selector against a series of
+/// constants with a `mux` that indexes an array of the possible outcomes by the
+/// selector. Decoders and `case` statements commonly turn into such series of
+/// comparisons, each of which is evaluated separately in a simulation.
+///
+/// Two forms are converted. The first is a chain of `mux` instructions, each
+/// of which picks between the result of the next one and a value depending on
+/// `eq %sel, K`:
+///
+/// ```text
+/// %c0 = eq i2 %sel, %k0
+/// %a0 = [i8 %default, %v0]
+/// %m0 = mux [2 x i8] %a0, i1 %c0
+/// %c1 = eq i2 %sel, %k1
+/// %a1 = [i8 %m0, %v1]
+/// %m1 = mux [2 x i8] %a1, i1 %c1
+/// ```
+///
+/// The second is a chain of blocks in a function or process, each of which
+/// branches on `eq %sel, K` to a block that only branches on to a common join
+/// block, or directly to the join block. The `phi` instructions in the join
+/// block are replaced with lookups in the first block of the chain, which then
+/// branches to the join block directly.
+///
+/// The lookup table has one entry for every value of the selector. To keep the
+/// tables small, the selector may be at most `MAX_SELECTOR_WIDTH` bits wide,
+/// and at least a quarter of the table must be covered by explicit comparisons.
+pub struct LookupTableConversion;
+
+/// The maximum width of a selector that is converted to a lookup table.
+pub const MAX_SELECTOR_WIDTH: usize = 8;
+
+/// The minimum number of comparisons that are converted to a lookup table.
+pub const MIN_CASES: usize = 3;
+
+impl Pass for LookupTableConversion {
+    fn run_on_unit(_ctx: &PassContext, unit: &mut UnitBuilder) -> bool {
+        info!("LUT [{}]", unit.name());
+        let mut modified = false;
+
+        // Convert the mux chains, starting at the outermost mux of each.
+        let chains = find_mux_chains(unit);
+        for chain in chains {
+            convert_mux_chain(unit, chain);
+            modified = true;
+        }
+
+        // Convert the switch-like branch chains.
+        if !unit.is_entity() {
+            let switches = find_switches(unit);
+            for switch in switches {
+                convert_switch(unit, switch);
+                modified = true;
+            }
+        }
+
+        modified
+    }
+}
+
+/// A chain of `mux` instructions that compare one selector against constants.
+struct MuxChain {
+    /// The outermost `mux`.
+    root: Inst,
+    /// The value being compared.
+    selector: Value,
+    /// The constants compared against and the corresponding values, starting
+    /// with the outermost `mux`.
+    cases: Vec<(usize, Value)>,
+    /// The value if none of the comparisons match.
+    default: Value,
+}
+
+/// Find the `mux` chains in a unit that can be converted to lookup tables.
+fn find_mux_chains(unit: &Unit) -> Vec<MuxChain> {
+    let mut chains = vec![];
+    let mut inner = HashSet::new();
+    for inst in unit.all_insts() {
+        if let Some(chain) = follow_mux_chain(unit, inst) {
+            inner.extend(chain.inner.iter().cloned());
+            chains.push(chain.chain);
+        }
+    }
+    chains.retain(|c| !inner.contains(&c.root) && is_dense(unit, c.selector, c.cases.len()));
+    chains
+}
+
+/// A `mux` chain together with the `mux` instructions below its root.
+struct MuxChainWithInner {
+    chain: MuxChain,
+    inner: Vec<Inst>,
+}
+
+/// Follow the `mux` chain starting at an instruction.
+fn follow_mux_chain(unit: &Unit, root: Inst) -> Option<MuxChainWithInner> {
+    let mut selector = None;
+    let mut cases = vec![];
+    let mut inner = vec![];
+    let mut default = None;
+    let mut next = Some(root);
+    while let Some(inst) = next {
+        let (sel, k, if_false, if_true) = match mux_link(unit, inst) {
+            Some(link) => link,
+            None => break,
+        };
+        if *selector.get_or_insert(sel) != sel {
+            break;
+        }
+        if inst != root {
+            inner.push(inst);
+        }
+        cases.push((k, if_true));
+        default = Some(if_false);
+        next = unit.get_value_inst(if_false);
+    }
+    if cases.len() < MIN_CASES {
+        return None;
+    }
+    Some(MuxChainWithInner {
+        chain: MuxChain {
+            root,
+            selector: selector?,
+            cases,
+            default: default?,
+        },
+        inner,
+    })
+}
+
+/// Match a `mux` between two values based on `eq %sel, K`.
+///
+/// Returns the selector, the constant, and the values chosen if the
+/// comparison is false or true, respectively.
+fn mux_link(unit: &Unit, inst: Inst) -> Option<(Value, usize, Value, Value)> {
+    if unit[inst].opcode() != Opcode::Mux {
+        return None;
+    }
+    let choices = unit.get_value_inst(unit[inst].args()[0])?;
+    if unit[choices].opcode() != Opcode::Array || unit[choices].args().len() != 2 {
+        return None;
+    }
+    let (sel, k) = comparison(unit, unit[inst].args()[1])?;
+    let args = unit[choices].args();
+    Some((sel, k, args[0], args[1]))
+}
+
+/// Replace a `mux` chain with a lookup table.
+fn convert_mux_chain(unit: &mut UnitBuilder, chain: MuxChain) {
+    debug!(
+        "Converting mux chain {} with {} cases",
+        chain.root.dump(&unit),
+        chain.cases.len()
+    );
+    let table = build_table(unit, chain.selector, &chain.cases, chain.default);
+    unit.insert_before(chain.root);
+    let value = build_lookup(unit, chain.selector, table);
+    let old = unit.inst_result(chain.root);
+    if let Some(name) = unit.get_name(old).map(String::from) {
+        unit.clear_name(old);
+        unit.set_name(value, name);
+    }
+    unit.replace_use(old, value);
+    unit.prune_if_unused(chain.root);
+}
+
+/// A chain of blocks that branch on comparisons of one selector against
+/// constants.
+struct Switch {
+    /// The first block of the chain.
+    head: Block,
+    /// The value being compared.
+    selector: Value,
+    /// The constants compared against and the block through which each case
+    /// arrives at the join block.
+    cases: Vec<(usize, Block)>,
+    /// The block through which the default case arrives at the join block.
+    default: Block,
+    /// The block where all cases meet.
+    join: Block,
+    /// The blocks of the chain other than the head.
+    blocks: Vec<Block>,
+}
+
+/// Find the branch chains in a unit that can be converted to lookup tables.
+fn find_switches(unit: &Unit) -> Vec<Switch> {
+    let preds = unit.predtbl();
+    let mut switches = vec![];
+    let mut inner = HashSet::new();
+    for bb in unit.blocks() {
+        if let Some(switch) = follow_switch(unit, &preds, bb) {
+            inner.extend(switch.blocks.iter().cloned());
+            switches.push(switch);
+        }
+    }
+    switches.retain(|s| !inner.contains(&s.head) && is_dense(unit, s.selector, s.cases.len()));
+    switches
+}
+
+/// Follow the branch chain starting at a block.
+fn follow_switch(unit: &Unit, preds: &PredecessorTable, head: Block) -> Option<Switch> {
+    let mut selector = None;
+    let mut cases = vec![];
+    let mut blocks = vec![];
+    let mut join = None;
+    let mut bb = head;
+    let default = loop {
+        let term = unit.terminator(bb);
+        let (sel, k) = match unit[term].opcode() {
+            Opcode::BrCond => comparison(unit, unit[term].args()[0])?,
+            _ => return None,
+        };
+        if *selector.get_or_insert(sel) != sel {
+            return None;
+        }
+        let (if_false, if_true) = (unit[term].blocks()[0], unit[term].blocks()[1]);
+        cases.push((k, edge(unit, preds, bb, if_true, &mut join, &mut blocks)?));
+
+        // Continue with the next comparison, or stop at the default case.
+        if is_test_block(unit, preds, bb, if_false, sel) {
+            blocks.push(if_false);
+            bb = if_false;
+        } else {
+            break edge(unit, preds, bb, if_false, &mut join, &mut blocks)?;
+        }
+    };
+
+    // Make sure the chain arrives at the join block through distinct blocks,
+    // and that the selector is available in the head block.
+    let mut edges: HashSet<Block> = cases.iter().map(|&(_, bb)| bb).collect();
+    if !edges.insert(default) || edges.len() != cases.len() + 1 {
+        return None;
+    }
+    let selector = selector?;
+    if let Some(inst) = unit.get_value_inst(selector) {
+        if blocks.contains(&unit.inst_block(inst)?) {
+            return None;
+        }
+    }
+    let join = join?;
+    if join == head || blocks.contains(&join) || cases.len() < MIN_CASES {
+        return None;
+    }
+    Some(Switch {
+        head,
+        selector,
+        cases,
+        default,
+        join,
+        blocks,
+    })
+}
+
+/// Determine the block through which a branch from `from` to `to` arrives at
+/// the join block.
+///
+/// This is `to` itself if it only branches to the join block, or `from` if
+/// `to` is the join block.
+fn edge(
+    unit: &Unit,
+    preds: &PredecessorTable,
+    from: Block,
+    to: Block,
+    join: &mut Option<Block>,
+    blocks: &mut Vec<Block>,
+) -> Option<Block> {
+    let term = unit.terminator(to);
+    let forwards = unit.first_inst(to) == Some(term)
+        && unit[term].opcode() == Opcode::Br
+        && preds.is_sole_pred(from, to);
+    let (target, edge) = if forwards {
+        (unit[term].blocks()[0], to)
+    } else {
+        (to, from)
+    };
+    if *join.get_or_insert(target) != target {
+        return None;
+    }
+    if forwards {
+        blocks.push(to);
+    }
+    Some(edge)
+}
+
+/// Check whether a block only compares the selector against a constant and
+/// branches on the result, and is only reached from `from`.
+fn is_test_block(
+    unit: &Unit,
+    preds: &PredecessorTable,
+    from: Block,
+    bb: Block,
+    sel: Value,
+) -> bool {
+    if !preds.is_sole_pred(from, bb) {
+        return false;
+    }
+    let term = unit.terminator(bb);
+    if unit[term].opcode() != Opcode::BrCond
+        || comparison(unit, unit[term].args()[0]).map(|c| c.0) != Some(sel)
+    {
+        return false;
+    }
+    unit.insts(bb).filter(|&inst| inst != term).all(|inst| {
+        matches!(unit[inst].opcode(), Opcode::Eq | Opcode::ConstInt)
+            && unit
+                .uses(unit.inst_result(inst))
+                .iter()
+                .all(|&user| unit.inst_block(user) == Some(bb))
+    })
+}
+
+/// Replace a branch chain with lookup tables.
+fn convert_switch(unit: &mut UnitBuilder, switch: Switch) {
+    let term = unit.terminator(switch.head);
+    debug!(
+        "Converting branch chain {} with {} cases",
+        term.dump(&unit),
+        switch.cases.len()
+    );
+    let edges: HashSet<Block> = switch
+        .cases
+        .iter()
+        .map(|&(_, bb)| bb)
+        .chain(Some(switch.default))
+        .collect();
+
+    // Replace the incoming values of the phi instructions along the chain with
+    // a lookup in the head block.
+    let phis: Vec<Inst> = unit
+        .insts(switch.join)
+        .filter(|&inst| unit[inst].opcode().is_phi())
+        .collect();
+    for phi in phis {
+        let cases: Vec<(usize, Value)> = switch
+            .cases
+            .iter()
+            .map(|&(k, bb)| (k, incoming(&unit, phi, bb)))
+            .collect();
+        let default = incoming(&unit, phi, switch.default);
+        let table = build_table(unit, switch.selector, &cases, default);
+        unit.insert_before(term);
+        let value = build_lookup(unit, switch.selector, table);
+
+        let mut args = vec![value];
+        let mut bbs = vec![switch.head];
+        for (&arg, &bb) in unit[phi].args().iter().zip(unit[phi].blocks()) {
+            if !edges.contains(&bb) {
+                args.push(arg);
+                bbs.push(bb);
+            }
+        }
+        unit.insert_before(phi);
+        let new_value = unit.ins().phi(args, bbs);
+        let old_value = unit.inst_result(phi);
+        if let Some(name) = unit.get_name(old_value).map(String::from) {
+            unit.clear_name(old_value);
+            unit.set_name(new_value, name);
+        }
+        unit.replace_use(old_value, new_value);
+        unit.delete_inst(phi);
+    }
+
+    // Branch to the join block directly and remove the chain.
+    let cond = unit.get_value_inst(unit[term].args()[0]);
+    unit.insert_before(term);
+    unit.ins().br(switch.join);
+    unit.delete_inst(term);
+    if let Some(cond) = cond {
+        unit.prune_if_unused(cond);
+    }
+    for bb in switch.blocks {
+        unit.delete_block(bb);
+    }
+}
+
+/// Get the value a `phi` instruction selects when coming from a block.
+fn incoming(unit: &Unit, phi: Inst, bb: Block) -> Value {
+    let data = &unit[phi];
+    let index = data.blocks().iter().position(|&b| b == bb).unwrap();
+    data.args()[index]
+}
+
+/// Match `eq %sel, K` or `eq K, %sel`, where `K` is a constant.
+fn comparison(unit: &Unit, cond: Value) -> Option<(Value, usize)> {
+    let inst = unit.get_value_inst(cond)?;
+    if unit[inst].opcode() != Opcode::Eq {
+        return None;
+    }
+    let (a, b) = (unit[inst].args()[0], unit[inst].args()[1]);
+    let (sel, k) = match (unit.get_const_int(a), unit.get_const_int(b)) {
+        (None, Some(k)) => (a, k),
+        (Some(k), None) => (b, k),
+        _ => return None,
+    };
+    if k.width > MAX_SELECTOR_WIDTH {
+        return None;
+    }
+    Some((sel, k.to_usize()))
+}
+
+/// Check whether enough entries of a lookup table would be covered by
+/// explicit comparisons.
+fn is_dense(unit: &Unit, selector: Value, num_cases: usize) -> bool {
+    num_cases * 4 >= 1 << unit.value_type(selector).unwrap_int()
+}
+
+/// Assemble the entries of a lookup table. The first matching case wins.
+fn build_table(
+    unit: &Unit,
+    selector: Value,
+    cases: &[(usize, Value)],
+    default: Value,
+) -> Vec<Value> {
+    let mut table = vec![None; 1 << unit.value_type(selector).unwrap_int()];
+    for &(k, value) in cases {
+        table[k].get_or_insert(value);
+    }
+    table.into_iter().map(|v| v.unwrap_or(default)).collect()
+}
+
+/// Build a lookup of the selector in a table.
+fn build_lookup(unit: &mut UnitBuilder, selector: Value, table: Vec<Value>) -> Value {
+    if table.iter().all(|&v| v == table[0]) {
+        return table[0];
+    }
+    let array = unit.ins().array(table);
+    unit.ins().mux(array, selector)
+}
@@ -8,21 +8,35 @@
 pub mod cf;
 pub mod cfs;
 pub mod dce;
+pub mod dde;
 pub mod deseq;
 pub mod ecm;
 pub mod gcse;
 pub mod insim;
+pub mod licm;
+pub mod lut;
 pub mod proclower;
+pub mod procmerge;
+pub mod sigcoal;
+pub mod sigsplit;
 pub mod tcm;
 pub mod vtpp;
+pub mod wsm;
 
 pub use cf::ConstFolding;
 pub use cfs::ControlFlowSimplification;
 pub use dce::DeadCodeElim;
+pub use dde::DeadDriveElimination;
 pub use deseq::Desequentialization;
 pub use ecm::EarlyCodeMotion;
 pub use gcse::GlobalCommonSubexprElim;
 pub use insim::InstSimplification;
+pub use licm::LoopInvariantCodeMotion;
+pub use lut::LookupTableConversion;
 pub use proclower::ProcessLowering;
+pub use procmerge::ProcessMerging;
+pub use sigcoal::SignalCoalescing;
+pub use sigsplit::SignalSplitting;
 pub use tcm::TemporalCodeMotion;
 pub use vtpp::VarToPhiPromotion;
+pub use wsm::WaitSensitivityMinimization;
@@ -0,0 +1,371 @@
+// Copyright (c) 2017-2021 Fabian Schuiki
+
+//! Process Merging
+
+use crate::{
+    ir::{prelude::*, ExtUnit, InstData},
+    opt::prelude::*,
+    pass::wsm::{probed_on_resume, signal_base},
+};
+use std::collections::{HashMap, HashSet};
+
+/// Process Merging
+///
+/// This pass merges processes instantiated side by side in an entity into a
+/// single process if they wait on the same signals. Every process instance is
+/// scheduled separately in a simulation, with its own wakeup and dispatch, such
+/// that designs with many small processes sensitive to the same clock or inputs
+/// benefit from executing them back to back in one process.
+///
+/// A process qualifies if it is a single loop that ends in a `wait` on its
+/// entry block, is only sensitive to its arguments, and has no `phi`
+/// instructions in its entry block. Two instances are merged if:
+///
+/// - neither drives a signal that the other probes or drives, such that the
+///   order in which they execute within a delta cycle does not matter;
+/// - their sensitivity lists are identical, or the smaller list is contained
+///   in the larger one and the process waiting on it is not affected by
+///   spurious wakeups.
+///
+/// The merged process executes the bodies one after another and waits on the
+/// union of the sensitivity lists. Local processes that are no longer
+/// instantiated anywhere after merging are removed. Global ones are kept,
+/// since they may be instantiated outside of the module.
+pub struct ProcessMerging;
+
+impl Pass for ProcessMerging {
+    fn run_on_module(_ctx: &PassContext, module: &mut Module) -> bool {
+        info!("ProcMerge");
+
+        // Find the processes that can be merged.
+        let candidates: HashMap<UnitName, (UnitId, Candidate)> = module
+            .processes()
+            .flat_map(|unit| Some((unit.name().clone(), (unit.id(), analyze(unit)?))))
+            .collect();
+        let mut names: HashSet<UnitName> = module.symbols().map(|(n, ..)| n.clone()).collect();
+
+        // Group the process instances in each entity.
+        let mut merges = vec![];
+        for entity in module.entities() {
+            for group in find_groups(entity, &candidates) {
+                merges.push((entity.id(), group));
+            }
+        }
+
+        // Merge each group into a new process.
+        let modified = !merges.is_empty();
+        let merged: HashSet<UnitId> = merges
+            .iter()
+            .flat_map(|(_, group)| group.members.iter().map(|&(_, unit, _)| unit))
+            .collect();
+        for (entity, group) in merges {
+            merge_group(module, entity, group, &mut names);
+        }
+
+        // Remove the local processes that are no longer instantiated.
+        let used: HashSet<UnitName> = module
+            .units()
+            .flat_map(|unit| unit.extern_units().map(|(_, data)| data.name.clone()))
+            .collect();
+        for unit in merged {
+            let name = module.unit(unit).name();
+            if name.is_local() && !used.contains(name) {
+                debug!("Removing merged process {}", name);
+                module.remove_unit(unit);
+            }
+        }
+        modified
+    }
+}
+
+/// A process that can be merged with others.
+struct Candidate {
+    /// The wait instruction at the end of the process.
+    wait: Inst,
+    /// The positions of the arguments in the sensitivity list.
+    sens: Vec<usize>,
+    /// Whether spurious wakeups have no effect on the process.
+    idempotent: bool,
+}
+
+/// A group of process instances to be merged.
+struct Group {
+    /// The instances and the process they instantiate.
+    members: Vec<(Inst, UnitId, Inst)>,
+    /// The union of the sensitivity lists.
+    sens: Vec<Value>,
+    /// Whether spurious wakeups have no effect on any of the members.
+    idempotent: bool,
+    /// The signals probed by the members.
+    inputs: HashSet<Value>,
+    /// The signals driven by the members.
+    outputs: HashSet<Value>,
+}
+
+/// Check whether a process can be merged with others.
+fn analyze(unit: Unit) -> Option<Candidate> {
+    let entry = unit.entry();
+    let mut wait = None;
+    for bb in unit.blocks() {
+        let term = unit.terminator(bb);
+        match unit[term].opcode() {
+            Opcode::Wait if wait.is_none() && unit[term].blocks() == [entry] => wait = Some(term),
+            op if op.is_temporal() => return None,
+            _ => (),
+        }
+    }
+    let wait = wait?;
+    if unit.insts(entry).any(|inst| unit[inst].opcode().is_phi()) {
+        return None;
+    }
+    let args: HashMap<Value, usize> = unit.args().enumerate().map(|(i, v)| (v, i)).collect();
+    let sens = unit[wait]
+        .args()
+        .iter()
+        .map(|v| args.get(v).cloned())
+        .collect::<Option<Vec<_>>>()?;
+    let idempotent = match probed_on_resume(&unit, &unit.trg(), wait) {
+        Some(probed) => probed.iter().all(|sig| unit[wait].args().contains(sig)),
+        None => false,
+    };
+    Some(Candidate {
+        wait,
+        sens,
+        idempotent,
+    })
+}
+
+/// Group the process instances in an entity that can be merged.
+fn find_groups(entity: Unit, candidates: &HashMap<UnitName, (UnitId, Candidate)>) -> Vec<Group> {
+    let mut groups: Vec<Group> = vec![];
+    for inst in entity.all_insts() {
+        let data = &entity[inst];
+        if data.opcode() != Opcode::Inst {
+            continue;
+        }
+        let (unit, cand) = match candidates.get(entity.extern_name(data.get_ext_unit().unwrap())) {
+            Some((unit, cand)) => (*unit, cand),
+            None => continue,
+        };
+
+        // Determine the signals the instance is connected to.
+        let bases = |values: &[Value]| -> Option<HashSet<Value>> {
+            values.iter().map(|&v| signal_base(&entity, v)).collect()
+        };
+        let (inputs, outputs) = match (bases(data.input_args()), bases(data.output_args())) {
+            (Some(i), Some(o)) => (i, o),
+            _ => continue,
+        };
+        let mut sens: Vec<Value> = cand.sens.iter().map(|&i| data.args()[i]).collect();
+        sens.sort();
+        sens.dedup();
+
+        // Find a group the instance can join.
+        let group = groups.iter_mut().find(|g| {
+            if !outputs.is_disjoint(&g.inputs)
+                || !outputs.is_disjoint(&g.outputs)
+                || !inputs.is_disjoint(&g.outputs)
+            {
+                return false;
+            }
+            if sens == g.sens {
+                true
+            } else if sens.iter().all(|v| g.sens.contains(v)) {
+                cand.idempotent
+            } else if g.sens.iter().all(|v| sens.contains(v)) {
+                g.idempotent
+            } else {
+                false
+            }
+        });
+        match group {
+            Some(g) => {
+                trace!("Merging {} into group", inst.dump(&entity));
+                if sens.len() > g.sens.len() {
+                    g.sens = sens;
+                }
+                g.idempotent &= cand.idempotent;
+                g.inputs.extend(inputs);
+                g.outputs.extend(outputs);
+                g.members.push((inst, unit, cand.wait));
+            }
+            None => groups.push(Group {
+                members: vec![(inst, unit, cand.wait)],
+                sens,
+                idempotent: cand.idempotent,
+                inputs,
+                outputs,
+            }),
+        }
+    }
+    groups.retain(|g| g.members.len() > 1);
+    groups
+}
+
+/// Merge a group of process instances into a new process.
+fn merge_group(module: &mut Module, entity: UnitId, group: Group, names: &mut HashSet<UnitName>) {
+    // Assemble the signature of the merged process, with one argument per
+    // distinct signal the members are connected to.
+    let ent = module.unit(entity);
+    let mut sig = Signature::new();
+    let mut inputs = vec![];
+    let mut outputs = vec![];
+    let mut ports = HashMap::new();
+    for &(inst, _, _) in &group.members {
+        for &value in ent[inst].input_args() {
+            if !ports.contains_key(&value) {
+                ports.insert(value, sig.add_input(ent.value_type(value)));
+                inputs.push(value);
+            }
+        }
+        for &value in ent[inst].output_args() {
+            if !ports.contains_key(&value) {
+                ports.insert(value, sig.add_output(ent.value_type(value)));
+                outputs.push(value);
+            }
+        }
+    }
+    let first = module.unit(group.members[0].1);
+    let name = unique_name(first.name().get_name().unwrap_or("proc"), names);
+    debug!(
+        "Merging {} processes in {} into {}",
+        group.members.len(),
+        ent.name(),
+        name
+    );
+
+    // Concatenate the bodies of the members.
+    let mut data = UnitData::new(UnitKind::Process, name.clone(), sig.clone());
+    let mut builder = UnitBuilder::new_anonymous(&mut data);
+    let mut waits = vec![];
+    for &(inst, unit, wait) in &group.members {
+        let unit = module.unit(unit);
+        let mut map: HashMap<Value, Value> = unit
+            .args()
+            .zip(ent[inst].args())
+            .map(|(from, to)| (from, builder.arg_value(ports[to])))
+            .collect();
+        let blocks = copy_body(unit, &mut builder, &mut map);
+        waits.push((
+            blocks[&unit.entry()],
+            blocks[&unit.inst_block(wait).unwrap()],
+        ));
+    }
+
+    // Chain the bodies together and wait on the union of the sensitivities.
+    let entry = waits[0].0;
+    for i in 0..waits.len() {
+        let wait = builder.terminator(waits[i].1);
+        builder.insert_before(wait);
+        if i + 1 < waits.len() {
+            builder.ins().br(waits[i + 1].0);
+        } else {
+            let sens = group
+                .sens
+                .iter()
+                .map(|v| builder.arg_value(ports[v]))
+                .collect();
+            builder.ins().wait(entry, sens);
+        }
+        builder.delete_inst(wait);
+    }
+    module.add_unit(data);
+
+    // Replace the instances.
+    let mut ent = module.unit_mut(entity);
+    let ext = ent.add_extern(name, sig);
+    // The members are in layout order. Inserting after the last one ensures
+    // that all signals the merged instance connects to are defined before it.
+    ent.insert_after(group.members.last().unwrap().0);
+    ent.ins().inst(ext, inputs, outputs);
+    let mut exts = HashSet::new();
+    for &(inst, _, _) in &group.members {
+        exts.insert(ent[inst].get_ext_unit().unwrap());
+        ent.delete_inst(inst);
+    }
+
+    // Drop the references to processes that are no longer instantiated.
+    let used: HashSet<ExtUnit> = ent
+        .all_insts()
+        .flat_map(|inst| ent[inst].get_ext_unit())
+        .collect();
+    for ext in exts.difference(&used) {
+        ent.remove_extern(*ext);
+    }
+}
+
+/// Copy the blocks and instructions of a unit into another.
+///
+/// The `map` provides the replacement for the arguments of `src`, and is
+/// extended with the values of the copied instructions. Returns the copy of
+/// each block.
+fn copy_body(
+    src: Unit,
+    dst: &mut UnitBuilder,
+    map: &mut HashMap<Value, Value>,
+) -> HashMap<Block, Block> {
+    let mut blocks = HashMap::new();
+    for bb in src.blocks() {
+        let new_bb = dst.block();
+        if let Some(name) = src.get_block_name(bb) {
+            dst.set_block_name(new_bb, name.to_string());
+        }
+        blocks.insert(bb, new_bb);
+    }
+
+    // Values used before they are defined, such as in `phi` instructions, are
+    // represented as placeholders until their definition has been copied.
+    let mut placeholders = HashMap::new();
+    let mut exts = HashMap::new();
+    for bb in src.blocks() {
+        dst.append_to(blocks[&bb]);
+        for inst in src.insts(bb) {
+            let mut data = src[inst].clone();
+            #[allow(deprecated)]
+            for arg in data.args_mut() {
+                let value = *arg;
+                *arg = match map.get(&value) {
+                    Some(&v) => v,
+                    None => *placeholders
+                        .entry(value)
+                        .or_insert_with(|| dst.add_placeholder(src.value_type(value))),
+                };
+            }
+            #[allow(deprecated)]
+            for bb in data.blocks_mut() {
+                *bb = blocks[&*bb];
+            }
+            if let InstData::Call { unit, .. } = &mut data {
+                let ext = *unit;
+                *unit = *exts.entry(ext).or_insert_with(|| {
+                    dst.add_extern(src.extern_name(ext).clone(), src.extern_sig(ext).clone())
+                });
+            }
+            let new_inst = dst.build_inst(data, src.inst_type(inst));
+            if let Some(value) = src.get_inst_result(inst) {
+                let new_value = dst.inst_result(new_inst);
+                if let Some(name) = src.get_name(value) {
+                    dst.set_name(new_value, name.to_string());
+                }
+                map.insert(value, new_value);
+            }
+        }
+    }
+    for (value, placeholder) in placeholders {
+        dst.replace_use(placeholder, map[&value]);
+        dst.remove_placeholder(placeholder);
+    }
+    blocks
+}
+
+/// Pick a name for a merged process that is not yet used in the module.
+fn unique_name(base: &str, names: &mut HashSet<UnitName>) -> UnitName {
+    let mut name = UnitName::local(format!("{}.merged", base));
+    let mut i = 0;
+    while names.contains(&name) {
+        i += 1;
+        name = UnitName::local(format!("{}.merged{}", base, i));
+    }
+    names.insert(name.clone());
+    name
+}
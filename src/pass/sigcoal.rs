@@ -0,0 +1,283 @@
+// Copyright (c) 2017-2021 Fabian Schuiki
+
+//! Signal Coalescing
+
+use crate::{
+    ir::prelude::*,
+    opt::prelude::*,
+    ty::{int_ty, signal_ty},
+    value::IntValue,
+};
+use std::collections::{HashMap, HashSet};
+
+/// Signal Coalescing
+///
+/// This pass packs single-bit signals of an entity that are always driven
+/// together into one integer signal. Gate-level netlists represent buses as
+/// individual `i1` signals, each of which is a separate signal and event in a
+/// simulation. A group of signals `%s0` to `%sN` is packed into an `iN+1`
+/// signal if every drive of the group has the form
+///
+/// ```text
+/// %b0 = exts i1 %v, 0, 1
+/// drv i1$ %s0, %b0, %t
+/// ...
+/// %bN = exts i1 %v, N, 1
+/// drv i1$ %sN, %bN, %t
+/// ```
+///
+/// for a common value `%v` and delay `%t`, and the signals are only probed and
+/// driven otherwise. The drives are replaced with a single drive of `%v`, and
+/// the probes with slices of the packed signal. Values that reassemble all bits
+/// of such a probe by means of `inss` are replaced with the probe itself.
+pub struct SignalCoalescing;
+
+impl Pass for SignalCoalescing {
+    fn run_on_unit(_ctx: &PassContext, unit: &mut UnitBuilder) -> bool {
+        if !unit.is_entity() {
+            return false;
+        }
+        info!("SigCoal [{}]", unit.name());
+        let mut modified = false;
+        for (bits, drives) in find_buses(unit) {
+            pack_bus(unit, &bits, drives);
+            modified = true;
+        }
+        if modified {
+            let insts: Vec<_> = unit.all_insts().collect();
+            for inst in insts {
+                if !unit.has_result(inst) || unit[inst].opcode() != Opcode::InsSlice {
+                    continue;
+                }
+                let value = unit.inst_result(inst);
+                if let Some(source) = repacked(unit, value) {
+                    debug!("Replacing {} with {}", inst.dump(&unit), source.dump(&unit));
+                    unit.replace_use(value, source);
+                    unit.prune_if_unused(inst);
+                }
+            }
+        }
+        modified
+    }
+}
+
+/// A group of drives that assign one value to all bits of a bus.
+struct BusDrive {
+    value: Value,
+    delay: Value,
+    insts: Vec<Inst>,
+}
+
+/// Find the groups of single-bit signals that can be packed.
+///
+/// Returns the signals of each bus, ordered by bit position, together with the
+/// drives of the bus.
+fn find_buses(unit: &Unit) -> Vec<(Vec<Value>, Vec<BusDrive>)> {
+    // Group the drives of single-bit signals by the value they are sliced from.
+    let mut groups = HashMap::<(Value, Value), Vec<(usize, Value, Inst)>>::new();
+    for inst in unit.all_insts() {
+        let data = &unit[inst];
+        if data.opcode() != Opcode::Drv {
+            continue;
+        }
+        let (signal, value, delay) = (data.args()[0], data.args()[1], data.args()[2]);
+        if !is_bit_signal(unit, signal) {
+            continue;
+        }
+        let slice = match unit.get_value_inst(value) {
+            Some(slice) if unit[slice].opcode() == Opcode::ExtSlice => slice,
+            _ => continue,
+        };
+        let source = unit[slice].args()[0];
+        if !unit.value_type(source).is_int() {
+            continue;
+        }
+        let offset = unit[slice].imms()[0];
+        groups
+            .entry((source, delay))
+            .or_default()
+            .push((offset, signal, inst));
+    }
+
+    // Keep the groups that drive every bit of their value exactly once, and
+    // collect them by the signals they drive.
+    let mut buses = HashMap::<Vec<Value>, Vec<BusDrive>>::new();
+    for ((value, delay), mut drives) in groups {
+        let width = unit.value_type(value).unwrap_int();
+        drives.sort();
+        let bits: Vec<_> = drives.iter().map(|&(_, signal, _)| signal).collect();
+        if width < 2
+            || drives.len() != width
+            || drives.iter().enumerate().any(|(i, &(o, _, _))| i != o)
+            || bits.iter().collect::<HashSet<_>>().len() != width
+        {
+            continue;
+        }
+        buses.entry(bits).or_default().push(BusDrive {
+            value,
+            delay,
+            insts: drives.into_iter().map(|(_, _, inst)| inst).collect(),
+        });
+    }
+
+    // Make sure the signals are not used in any other way, and belong to only
+    // one bus.
+    let mut owners = HashMap::<Value, usize>::new();
+    for bits in buses.keys() {
+        for &bit in bits {
+            *owners.entry(bit).or_insert(0) += 1;
+        }
+    }
+    let mut result: Vec<_> = buses
+        .into_iter()
+        .filter(|(bits, drives)| {
+            bits.iter().all(|&bit| {
+                let mut num_drives = 0;
+                let only_prb_drv = unit
+                    .uses(bit)
+                    .iter()
+                    .all(|&user| match unit[user].opcode() {
+                        Opcode::Prb => true,
+                        Opcode::Drv if unit[user].args()[0] == bit => {
+                            num_drives += 1;
+                            unit[user].args()[1] != bit && unit[user].args()[2] != bit
+                        }
+                        _ => false,
+                    });
+                only_prb_drv && num_drives == drives.len() && owners[&bit] == 1
+            })
+        })
+        .collect();
+    result.sort_by_key(|(bits, _)| bits[0]);
+    result
+}
+
+/// Check whether a value is an `i1` signal created by a `sig` with a constant
+/// initial value.
+fn is_bit_signal(unit: &Unit, value: Value) -> bool {
+    let inst = match unit.get_value_inst(value) {
+        Some(inst) => inst,
+        None => return false,
+    };
+    unit[inst].opcode() == Opcode::Sig
+        && unit.value_type(value) == signal_ty(int_ty(1))
+        && unit.get_const_int(unit[inst].args()[0]).is_some()
+}
+
+/// Replace a group of single-bit signals with one packed signal.
+fn pack_bus(unit: &mut UnitBuilder, bits: &[Value], drives: Vec<BusDrive>) {
+    let sigs: Vec<_> = bits.iter().map(|&bit| unit.value_inst(bit)).collect();
+    debug!(
+        "Packing {} signals {} .. {}",
+        bits.len(),
+        bits[0].dump(&unit),
+        bits[bits.len() - 1].dump(&unit)
+    );
+
+    // Create the packed signal before the first of the bits.
+    let mut init = IntValue::zero(bits.len());
+    for (i, &inst) in sigs.iter().enumerate() {
+        let bit = unit.get_const_int(unit[inst].args()[0]).unwrap().clone();
+        init.insert_slice(i, 1, &bit);
+    }
+    let first = unit.all_insts().find(|inst| sigs.contains(inst)).unwrap();
+    unit.insert_before(first);
+    let init = unit.ins().const_int(init);
+    let bus = unit.ins().sig(init);
+    if let Some(name) = bus_name(unit, bits) {
+        unit.set_name(bus, name);
+    }
+    let probed = unit.ins().prb(bus);
+
+    // Replace the probes of the individual bits with slices.
+    for (i, &bit) in bits.iter().enumerate() {
+        let probes: Vec<_> = unit.uses(bit).iter().cloned().collect();
+        for inst in probes {
+            if unit[inst].opcode() != Opcode::Prb {
+                continue;
+            }
+            let value = unit.inst_result(inst);
+            unit.insert_before(inst);
+            let slice = unit.ins().ext_slice(probed, i, 1);
+            if let Some(name) = unit.get_name(value).map(String::from) {
+                unit.set_name(slice, name);
+            }
+            unit.replace_use(value, slice);
+            unit.delete_inst(inst);
+        }
+    }
+    let probe = unit.value_inst(probed);
+    unit.prune_if_unused(probe);
+
+    // Replace the drives of the individual bits with one drive of the entire
+    // value.
+    for drive in drives {
+        unit.insert_before(drive.insts[0]);
+        unit.ins().drv(bus, drive.value, drive.delay);
+        for inst in drive.insts {
+            let slice = unit.value_inst(unit[inst].args()[1]);
+            unit.delete_inst(inst);
+            unit.prune_if_unused(slice);
+        }
+    }
+
+    // Remove the individual bits.
+    for inst in sigs {
+        unit.prune_if_unused(inst);
+    }
+}
+
+/// Derive the name of a packed signal from the names of its bits, such as
+/// `data` for `data_0`, `data_1`, etc.
+fn bus_name(unit: &Unit, bits: &[Value]) -> Option<String> {
+    let names = bits
+        .iter()
+        .map(|&bit| unit.get_name(bit))
+        .collect::<Option<Vec<_>>>()?;
+    let mut prefix = names[0];
+    for name in &names[1..] {
+        let len = prefix
+            .chars()
+            .zip(name.chars())
+            .take_while(|(a, b)| a == b)
+            .count();
+        prefix = &prefix[..len];
+    }
+    let prefix = prefix.trim_end_matches(|c: char| c.is_ascii_digit() || "_.[".contains(c));
+    if prefix.is_empty() {
+        None
+    } else {
+        Some(prefix.to_string())
+    }
+}
+
+/// Check whether `value` reassembles all bits of another value from slices at
+/// the same positions, as in `inss (inss %z, exts %x, 0, 1), exts %x, 1, 1`.
+fn repacked(unit: &Unit, mut value: Value) -> Option<Value> {
+    let ty = unit.value_type(value);
+    if !ty.is_int() {
+        return None;
+    }
+    let mut covered = vec![false; ty.unwrap_int()];
+    let mut source = None;
+    while covered.contains(&false) {
+        let inst = unit.get_value_inst(value)?;
+        if unit[inst].opcode() != Opcode::InsSlice {
+            return None;
+        }
+        let slice = unit.get_value_inst(unit[inst].args()[1])?;
+        if unit[slice].opcode() != Opcode::ExtSlice || unit[slice].imms() != unit[inst].imms() {
+            return None;
+        }
+        let src = unit[slice].args()[0];
+        if *source.get_or_insert(src) != src {
+            return None;
+        }
+        let (offset, length) = (unit[inst].imms()[0], unit[inst].imms()[1]);
+        for c in &mut covered[offset..offset + length] {
+            *c = true;
+        }
+        value = unit[inst].args()[0];
+    }
+    source.filter(|&src| unit.value_type(src) == ty)
+}
@@ -0,0 +1,106 @@
+// Copyright (c) 2017-2021 Fabian Schuiki
+
+//! Signal Splitting
+
+use crate::{ir::prelude::*, opt::prelude::*};
+
+/// Signal Splitting
+///
+/// This pass splits struct and array signals of an entity into one signal per
+/// field or element. Every drive of an element of an aggregate signal marks the
+/// entire signal as changed in a simulation, and wakes up all readers of any
+/// element. Splitting the signal makes the sensitivity element-precise.
+///
+/// A signal is split if it has at most `MAX_FIELDS` fields or elements, and is
+/// only used by `extf`. The field signals then replace the `extf`. Signals
+/// that are probed or driven as a whole are left alone, since every such probe
+/// would have to reassemble the fields and every such drive would wake up the
+/// readers of all fields again. Fields that are aggregates themselves are
+/// split recursively.
+pub struct SignalSplitting;
+
+/// The maximum number of fields or elements a signal is split into.
+pub const MAX_FIELDS: usize = 64;
+
+impl Pass for SignalSplitting {
+    fn run_on_unit(_ctx: &PassContext, unit: &mut UnitBuilder) -> bool {
+        if !unit.is_entity() {
+            return false;
+        }
+        info!("SigSplit [{}]", unit.name());
+        let mut modified = false;
+        let mut worklist: Vec<_> = unit
+            .all_insts()
+            .filter(|&inst| unit[inst].opcode() == Opcode::Sig)
+            .collect();
+        while let Some(inst) = worklist.pop() {
+            if is_splittable(unit, inst) {
+                worklist.extend(split_signal(unit, inst));
+                modified = true;
+            }
+        }
+        modified
+    }
+}
+
+/// Check whether a `sig` instruction can be split into its fields.
+fn is_splittable(unit: &Unit, inst: Inst) -> bool {
+    let signal = unit.inst_result(inst);
+    let ty = unit.value_type(signal);
+    let ty = ty.unwrap_signal();
+    let num_fields = if ty.is_struct() {
+        ty.unwrap_struct().len()
+    } else if ty.is_array() {
+        ty.unwrap_array().0
+    } else {
+        return false;
+    };
+    if num_fields > MAX_FIELDS {
+        return false;
+    }
+    let users = unit.uses(signal);
+    !users.is_empty()
+        && users
+            .iter()
+            .all(|&user| unit[user].opcode() == Opcode::ExtField)
+}
+
+/// Split a `sig` instruction into one signal per field.
+///
+/// Returns the `sig` instructions of the fields.
+fn split_signal(unit: &mut UnitBuilder, inst: Inst) -> Vec<Inst> {
+    let signal = unit.inst_result(inst);
+    let init = unit[inst].args()[0];
+    let ty = unit.value_type(signal);
+    let ty = ty.unwrap_signal();
+    let num_fields = if ty.is_struct() {
+        ty.unwrap_struct().len()
+    } else {
+        ty.unwrap_array().0
+    };
+    debug!("Splitting {} into {} signals", inst.dump(&unit), num_fields);
+
+    // Create a signal for each field.
+    let name = unit.get_name(signal).map(String::from);
+    let mut fields = vec![];
+    unit.insert_before(inst);
+    for i in 0..num_fields {
+        let field_init = unit.ins().ext_field(init, i);
+        let field = unit.ins().sig(field_init);
+        if let Some(ref name) = name {
+            unit.set_name(field, format!("{}.{}", name, i));
+        }
+        fields.push(field);
+    }
+
+    // Replace the field selections with the field signals.
+    let users: Vec<_> = unit.uses(signal).iter().cloned().collect();
+    for user in users {
+        let field = fields[unit[user].imms()[0]];
+        unit.replace_use(unit.inst_result(user), field);
+        unit.delete_inst(user);
+    }
+    unit.prune_if_unused(inst);
+
+    fields.into_iter().map(|f| unit.value_inst(f)).collect()
+}
@@ -0,0 +1,189 @@
+// Copyright (c) 2017-2021 Fabian Schuiki
+
+//! Wait Sensitivity Minimization
+
+use crate::{analysis::TemporalRegionGraph, ir::prelude::*, opt::prelude::*};
+use std::collections::HashSet;
+
+/// Wait Sensitivity Minimization
+///
+/// This pass removes signals from the sensitivity list of `wait` instructions
+/// which the process does not probe after it resumes. Frontends commonly emit
+/// waits that are sensitive to every input of a process, such that each change
+/// of an unprobed signal wakes up the process only to recompute and redrive
+/// the same values.
+///
+/// A signal is only removed if re-executing the resumed temporal region can be
+/// shown to have no effect unless one of the probed signals changed. This is
+/// the case if:
+///
+/// - the region can only be entered through the wait's target block, and only
+///   exits through `wait` or `halt` instructions;
+/// - the wait itself is located in that region;
+/// - the target block has no `phi` instructions, and the region creates no
+///   signals, performs no calls, and only accesses memory allocated within
+///   itself;
+/// - every probed signal appears as-is in the sensitivity list.
+///
+/// Signals obtained in any other way than as an argument, a `sig` instruction,
+/// or a field or slice thereof, are treated conservatively and leave the wait
+/// unchanged.
+pub struct WaitSensitivityMinimization;
+
+impl Pass for WaitSensitivityMinimization {
+    fn run_on_cfg(_ctx: &PassContext, unit: &mut UnitBuilder) -> bool {
+        if !unit.is_process() {
+            return false;
+        }
+        info!("WSM [{}]", unit.name());
+        let trg = unit.trg();
+
+        // Determine the reduced sensitivity list of each wait.
+        let mut rewrites = vec![];
+        for bb in unit.blocks() {
+            let inst = unit.terminator(bb);
+            let skip = match unit[inst].opcode() {
+                Opcode::Wait => 0,
+                Opcode::WaitTime => 1,
+                _ => continue,
+            };
+            let target = unit[inst].blocks()[0];
+            let probed = match probed_on_resume(&unit, &trg, inst) {
+                Some(p) => p,
+                None => {
+                    trace!("Skipping {} (unsuitable region)", inst.dump(&unit));
+                    continue;
+                }
+            };
+
+            // Make sure all signals can be traced back to their origin, and
+            // that every probed signal is in the sensitivity list.
+            let args = &unit[inst].args()[skip..];
+            if args.iter().any(|&arg| signal_base(&unit, arg).is_none()) {
+                trace!("Skipping {} (untraceable signal)", inst.dump(&unit));
+                continue;
+            }
+            if probed.iter().any(|sig| !args.contains(sig)) {
+                trace!("Skipping {} (incomplete sensitivity)", inst.dump(&unit));
+                continue;
+            }
+
+            // Keep only the signals whose origin is probed.
+            let probed_bases: HashSet<_> = probed
+                .iter()
+                .flat_map(|&sig| signal_base(&unit, sig))
+                .collect();
+            let keep: Vec<_> = args
+                .iter()
+                .cloned()
+                .filter(|&arg| probed_bases.contains(&signal_base(&unit, arg).unwrap()))
+                .collect();
+            if keep.len() < args.len() {
+                rewrites.push((inst, target, keep));
+            }
+        }
+
+        // Replace the waits.
+        let modified = !rewrites.is_empty();
+        for (inst, target, keep) in rewrites {
+            debug!(
+                "Reducing sensitivity of {} to {} signals",
+                inst.dump(&unit),
+                keep.len()
+            );
+            let opcode = unit[inst].opcode();
+            let time = unit[inst].args().first().cloned();
+            unit.insert_before(inst);
+            match opcode {
+                Opcode::WaitTime => unit.ins().wait_time(target, time.unwrap(), keep),
+                _ => unit.ins().wait(target, keep),
+            };
+            unit.delete_inst(inst);
+        }
+        modified
+    }
+}
+
+/// Determine the signals a process probes after resuming from a wait.
+///
+/// Returns `None` if re-executing the temporal region the wait resumes could
+/// have an effect beyond what is determined by the probed signals, or if the
+/// wait is not located in that region.
+pub(crate) fn probed_on_resume(
+    unit: &Unit,
+    trg: &TemporalRegionGraph,
+    wait: Inst,
+) -> Option<HashSet<Value>> {
+    let target = unit[wait].blocks()[0];
+    let region = &trg[trg[target]];
+    if region.head_blocks.len() != 1
+        || !region.is_head(target)
+        || !region.blocks.contains(&unit.inst_block(wait)?)
+    {
+        return None;
+    }
+    probed_signals(unit, &region.blocks, target)
+}
+
+/// Collect the signals probed within a temporal region.
+///
+/// Returns `None` if re-executing the region could have an effect beyond what
+/// is determined by the probed signals.
+fn probed_signals(unit: &Unit, blocks: &HashSet<Block>, target: Block) -> Option<HashSet<Value>> {
+    let mut probed = HashSet::new();
+    for &bb in blocks {
+        let term = unit.terminator(bb);
+        match unit[term].opcode() {
+            Opcode::Wait | Opcode::WaitTime | Opcode::Halt => (),
+            _ if unit[term].blocks().iter().all(|bb| blocks.contains(bb)) => (),
+            _ => return None,
+        }
+        for inst in unit.insts(bb) {
+            let data = &unit[inst];
+            match data.opcode() {
+                Opcode::Phi if bb == target => return None,
+                Opcode::Call | Opcode::Sig => return None,
+                Opcode::Ld | Opcode::St => {
+                    let var = pointer_base(unit, data.args()[0])?;
+                    if !blocks.contains(&unit.inst_block(var)?) {
+                        return None;
+                    }
+                }
+                Opcode::Prb => {
+                    signal_base(unit, data.args()[0])?;
+                    probed.insert(data.args()[0]);
+                }
+                _ => (),
+            }
+        }
+    }
+    Some(probed)
+}
+
+/// Trace a signal back to the argument or `sig` instruction it originates
+/// from.
+pub(crate) fn signal_base(unit: &Unit, mut value: Value) -> Option<Value> {
+    loop {
+        let inst = match unit.get_value_inst(value) {
+            Some(inst) => inst,
+            None => return Some(value),
+        };
+        match unit[inst].opcode() {
+            Opcode::Sig => return Some(value),
+            Opcode::ExtField | Opcode::ExtSlice => value = unit[inst].args()[0],
+            _ => return None,
+        }
+    }
+}
+
+/// Trace a pointer back to the `var` instruction it originates from.
+fn pointer_base(unit: &Unit, mut value: Value) -> Option<Inst> {
+    loop {
+        let inst = unit.get_value_inst(value)?;
+        match unit[inst].opcode() {
+            Opcode::Var => return Some(inst),
+            Opcode::ExtField | Opcode::ExtSlice => value = unit[inst].args()[0],
+            _ => return None,
+        }
+    }
+}
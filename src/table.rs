@@ -130,8 +130,8 @@ impl<I: TableKey, V> PrimaryTable<I, V> {
     /// Remove an entry from the table.
     ///
     /// Panics if the entry does not exist.
-    pub fn remove(&mut self, key: I) {
-        self.storage.remove(&key.index()).expect("key not in table");
+    pub fn remove(&mut self, key: I) -> V {
+        self.storage.remove(&key.index()).expect("key not in table")
     }
 
     /// Return an iterator over the keys and values in the table.
@@ -178,12 +178,25 @@ impl<I: TableKey, V> IndexMut<I> for PrimaryTable<I, V> {
 
 /// A secondary table that associates additional information with entries in a
 /// primary table.
-#[derive(Clone, Serialize, Deserialize)]
+#[derive(Serialize, Deserialize)]
 pub struct SecondaryTable<I, V> {
     pub(crate) storage: HashMap<usize, V>,
     unused: PhantomData<I>,
 }
 
+impl<I, V: Clone> Clone for SecondaryTable<I, V> {
+    fn clone(&self) -> Self {
+        Self {
+            storage: self.storage.clone(),
+            unused: PhantomData,
+        }
+    }
+
+    fn clone_from(&mut self, source: &Self) {
+        self.storage.clone_from(&source.storage);
+    }
+}
+
 impl<I, V> SecondaryTable<I, V> {
     /// Create a new empty table.
     pub fn new() -> Self {
@@ -250,7 +263,6 @@ impl<I: TableKey, V> IndexMut<I> for SecondaryTable<I, V> {
 }
 
 /// A primary table that provides dense key-based storage.
-#[derive(Clone)]
 pub struct PrimaryTable2<I, V> {
     storage: Vec<V>,
     count: usize,
@@ -259,6 +271,27 @@ pub struct PrimaryTable2<I, V> {
     unused: PhantomData<I>,
 }
 
+impl<I, V: Clone> Clone for PrimaryTable2<I, V> {
+    fn clone(&self) -> Self {
+        Self {
+            storage: self.storage.clone(),
+            count: self.count,
+            used: self.used.clone(),
+            free: self.free.clone(),
+            unused: PhantomData,
+        }
+    }
+
+    /// Overwrite the table with a copy of another one, reusing the storage
+    /// that has already been allocated.
+    fn clone_from(&mut self, source: &Self) {
+        self.storage.clone_from(&source.storage);
+        self.count = source.count;
+        self.used.clone_from(&source.used);
+        self.free.clone_from(&source.free);
+    }
+}
+
 impl<I, V> PrimaryTable2<I, V> {
     /// Create a new primary table.
     pub fn new() -> Self {
@@ -313,6 +346,14 @@ impl<I: TableKey, V: Default> PrimaryTable2<I, V> {
         self.storage.len()
     }
 
+    /// Get the number of bytes allocated by the table.
+    ///
+    /// Does not include the memory owned by the entries themselves.
+    pub fn allocated_bytes(&self) -> usize {
+        // The used and free bitsets each need roughly one bit per entry.
+        self.storage.capacity() * std::mem::size_of::<V>() + (self.storage.len() + 7) / 8 * 2
+    }
+
     /// Return an iterator over the keys and values in the table.
     pub fn iter<'a>(&'a self) -> impl Iterator<Item = (I, &'a V)> + 'a {
         (&self.used)
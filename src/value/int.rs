@@ -6,6 +6,7 @@
 
 use crate::ir::prelude::*;
 use crate::ty::{int_ty, Type};
+use crate::value::PackedInt;
 use num::{bigint::ToBigInt, traits::*, BigInt, BigUint};
 use std::fmt::{Debug, Display};
 
@@ -130,6 +131,22 @@ impl From<(usize, BigUint)> for IntValue {
     }
 }
 
+/// Packing.
+impl IntValue {
+    /// Convert the value into packed limbs.
+    pub fn to_packed(&self) -> PackedInt {
+        PackedInt::from_biguint(self.width, &self.value)
+    }
+
+    /// Create a value from packed limbs.
+    pub fn from_packed(packed: &PackedInt) -> IntValue {
+        IntValue {
+            width: packed.width(),
+            value: packed.to_biguint(),
+        }
+    }
+}
+
 /// Slicing.
 impl IntValue {
     /// Extract a slice of bits from the value.
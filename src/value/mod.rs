@@ -6,12 +6,14 @@
 
 mod array;
 mod int;
+mod packed;
 mod r#struct;
 mod time;
 
 pub use self::time::*;
 pub use array::*;
 pub use int::*;
+pub use packed::*;
 pub use r#struct::*;
 
 use crate::ty::Type;
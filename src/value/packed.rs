@@ -0,0 +1,453 @@
+// Copyright (c) 2017-2021 Fabian Schuiki
+
+//! Packed integer values
+//!
+//! This module implements integers of arbitrary width as a sequence of 64 bit
+//! limbs, least significant limb first. Bits above the width are always kept
+//! zero. In contrast to `IntValue`, all operations modify the value in place
+//! and do not allocate. The kernels are plain loops over the limbs, which the
+//! compiler is free to vectorize for the target at hand.
+
+use num::BigUint;
+use std::{
+    cmp::Ordering,
+    fmt::{Binary, Debug, Display, LowerHex},
+};
+
+/// An integer value stored as packed 64 bit limbs.
+#[derive(Clone, PartialEq, Eq, Hash)]
+pub struct PackedInt {
+    width: usize,
+    limbs: Vec<u64>,
+}
+
+/// Determine the number of limbs needed to store `width` bits.
+fn num_limbs(width: usize) -> usize {
+    (width + 63) / 64
+}
+
+/// Determine the mask of valid bits in the most significant limb.
+fn top_mask(width: usize) -> u64 {
+    match width % 64 {
+        0 => !0,
+        n => !0 >> (64 - n),
+    }
+}
+
+/// Read 64 bits from a sequence of limbs, starting at bit `off`.
+///
+/// Bits outside the limbs, including those at negative offsets, read as zero.
+fn word_at(limbs: &[u64], off: isize) -> u64 {
+    if off <= -64 {
+        return 0;
+    }
+    if off < 0 {
+        return limbs.first().copied().unwrap_or(0) << -off;
+    }
+    let (idx, shift) = (off as usize / 64, off as usize % 64);
+    let lo = limbs.get(idx).copied().unwrap_or(0) >> shift;
+    let hi = match shift {
+        0 => 0,
+        _ => limbs.get(idx + 1).copied().unwrap_or(0) << (64 - shift),
+    };
+    lo | hi
+}
+
+/// Construction and access.
+impl PackedInt {
+    /// Create a zero value.
+    pub fn zero(width: usize) -> Self {
+        Self {
+            width,
+            limbs: vec![0; num_limbs(width)],
+        }
+    }
+
+    /// Create a value with all bits set to one.
+    pub fn all_ones(width: usize) -> Self {
+        let mut v = Self {
+            width,
+            limbs: vec![!0; num_limbs(width)],
+        };
+        v.truncate();
+        v
+    }
+
+    /// Create a value from a `u64`, truncated to `width` bits.
+    pub fn from_u64(width: usize, value: u64) -> Self {
+        let mut v = Self::zero(width);
+        if let Some(l) = v.limbs.first_mut() {
+            *l = value;
+        }
+        v.truncate();
+        v
+    }
+
+    /// Create a value from its limbs, least significant first.
+    ///
+    /// Missing limbs are zero, and excess bits are discarded.
+    pub fn from_limbs(width: usize, limbs: &[u64]) -> Self {
+        let mut v = Self::zero(width);
+        for (d, s) in v.limbs.iter_mut().zip(limbs) {
+            *d = *s;
+        }
+        v.truncate();
+        v
+    }
+
+    /// Create a value from a `BigUint`, truncated to `width` bits.
+    pub fn from_biguint(width: usize, value: &BigUint) -> Self {
+        Self::from_limbs(width, &value.to_u64_digits())
+    }
+
+    /// Convert the value to a `BigUint`.
+    pub fn to_biguint(&self) -> BigUint {
+        BigUint::new(
+            self.limbs
+                .iter()
+                .flat_map(|&l| std::iter::once(l as u32).chain(std::iter::once((l >> 32) as u32)))
+                .collect(),
+        )
+    }
+
+    /// Get the width of the value in bits.
+    pub fn width(&self) -> usize {
+        self.width
+    }
+
+    /// Get the limbs of the value, least significant first.
+    pub fn limbs(&self) -> &[u64] {
+        &self.limbs
+    }
+
+    /// Get a single bit of the value.
+    pub fn bit(&self, idx: usize) -> bool {
+        assert!(idx < self.width);
+        self.limbs[idx / 64] >> (idx % 64) & 1 != 0
+    }
+
+    /// Get the sign bit of the value.
+    pub fn sign(&self) -> bool {
+        self.width > 0 && self.bit(self.width - 1)
+    }
+
+    /// Check if the value is zero.
+    pub fn is_zero(&self) -> bool {
+        self.limbs.iter().all(|&l| l == 0)
+    }
+
+    /// Clear the bits above the width.
+    fn truncate(&mut self) {
+        let mask = top_mask(self.width);
+        if let Some(l) = self.limbs.last_mut() {
+            *l &= mask;
+        }
+    }
+}
+
+impl Display for PackedInt {
+    fn fmt(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
+        write!(f, "i{} 0x", self.width)?;
+        let mut limbs = self.limbs.iter().rev();
+        write!(f, "{:x}", limbs.next().copied().unwrap_or(0))?;
+        for l in limbs {
+            write!(f, "{:016x}", l)?;
+        }
+        Ok(())
+    }
+}
+
+impl Debug for PackedInt {
+    fn fmt(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
+        write!(f, "{}", self)
+    }
+}
+
+impl LowerHex for PackedInt {
+    fn fmt(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
+        let mut limbs = self.limbs.iter().rev().skip_while(|&&l| l == 0);
+        let mut digits = format!("{:x}", limbs.next().copied().unwrap_or(0));
+        for l in limbs {
+            digits += &format!("{:016x}", l);
+        }
+        f.pad_integral(true, "0x", &digits)
+    }
+}
+
+impl Binary for PackedInt {
+    fn fmt(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
+        let mut limbs = self.limbs.iter().rev().skip_while(|&&l| l == 0);
+        let mut digits = format!("{:b}", limbs.next().copied().unwrap_or(0));
+        for l in limbs {
+            digits += &format!("{:064b}", l);
+        }
+        f.pad_integral(true, "0b", &digits)
+    }
+}
+
+/// Bitwise operators.
+impl PackedInt {
+    /// Compute `not` in place.
+    pub fn not_assign(&mut self) {
+        for l in &mut self.limbs {
+            *l = !*l;
+        }
+        self.truncate();
+    }
+
+    /// Compute `and` in place.
+    pub fn and_assign(&mut self, other: &Self) {
+        assert_eq!(self.width, other.width);
+        for (a, b) in self.limbs.iter_mut().zip(&other.limbs) {
+            *a &= b;
+        }
+    }
+
+    /// Compute `or` in place.
+    pub fn or_assign(&mut self, other: &Self) {
+        assert_eq!(self.width, other.width);
+        for (a, b) in self.limbs.iter_mut().zip(&other.limbs) {
+            *a |= b;
+        }
+    }
+
+    /// Compute `xor` in place.
+    pub fn xor_assign(&mut self, other: &Self) {
+        assert_eq!(self.width, other.width);
+        for (a, b) in self.limbs.iter_mut().zip(&other.limbs) {
+            *a ^= b;
+        }
+    }
+}
+
+/// Arithmetic operators.
+impl PackedInt {
+    /// Compute `add` in place.
+    pub fn add_assign(&mut self, other: &Self) {
+        assert_eq!(self.width, other.width);
+        let mut carry = false;
+        for (a, &b) in self.limbs.iter_mut().zip(&other.limbs) {
+            let (s, c0) = a.overflowing_add(b);
+            let (s, c1) = s.overflowing_add(carry as u64);
+            *a = s;
+            carry = c0 | c1;
+        }
+        self.truncate();
+    }
+
+    /// Compute `sub` in place.
+    pub fn sub_assign(&mut self, other: &Self) {
+        assert_eq!(self.width, other.width);
+        let mut borrow = false;
+        for (a, &b) in self.limbs.iter_mut().zip(&other.limbs) {
+            let (d, b0) = a.overflowing_sub(b);
+            let (d, b1) = d.overflowing_sub(borrow as u64);
+            *a = d;
+            borrow = b0 | b1;
+        }
+        self.truncate();
+    }
+
+    /// Compute `neg` in place.
+    pub fn neg_assign(&mut self) {
+        let mut carry = true;
+        for l in &mut self.limbs {
+            let (s, c) = (!*l).overflowing_add(carry as u64);
+            *l = s;
+            carry = c;
+        }
+        self.truncate();
+    }
+}
+
+/// Comparisons.
+impl PackedInt {
+    /// Compare two values as unsigned integers.
+    pub fn cmp_unsigned(&self, other: &Self) -> Ordering {
+        assert_eq!(self.width, other.width);
+        self.limbs.iter().rev().cmp(other.limbs.iter().rev())
+    }
+
+    /// Compare two values as signed integers.
+    pub fn cmp_signed(&self, other: &Self) -> Ordering {
+        match (self.sign(), other.sign()) {
+            (false, true) => Ordering::Greater,
+            (true, false) => Ordering::Less,
+            _ => self.cmp_unsigned(other),
+        }
+    }
+}
+
+/// Shifts.
+impl PackedInt {
+    /// Shift left in place, filling in the most significant bits of `hidden`.
+    ///
+    /// This corresponds to the `shl` instruction: the value and the hidden
+    /// bits are concatenated, shifted left, and the upper bits are kept.
+    pub fn funnel_shl_assign(&mut self, hidden: &Self, amount: usize) {
+        let amount = std::cmp::min(amount, self.width + hidden.width) as isize;
+        let hw = hidden.width as isize;
+        // Each limb only reads from limbs at or below it, so going downwards
+        // never reads a limb that has already been overwritten.
+        for i in (0..self.limbs.len()).rev() {
+            let p = (i * 64) as isize - amount;
+            self.limbs[i] = word_at(&self.limbs, p) | word_at(&hidden.limbs, p + hw);
+        }
+        self.truncate();
+    }
+
+    /// Shift right in place, filling in the least significant bits of
+    /// `hidden`.
+    ///
+    /// This corresponds to the `shr` instruction: the hidden bits and the
+    /// value are concatenated, shifted right, and the lower bits are kept.
+    pub fn funnel_shr_assign(&mut self, hidden: &Self, amount: usize) {
+        let amount = std::cmp::min(amount, self.width + hidden.width) as isize;
+        let w = self.width as isize;
+        // Each limb only reads from limbs at or above it, so going upwards
+        // never reads a limb that has already been overwritten.
+        for i in 0..self.limbs.len() {
+            let p = (i * 64) as isize + amount;
+            self.limbs[i] = word_at(&self.limbs, p) | word_at(&hidden.limbs, p - w);
+        }
+        self.truncate();
+    }
+
+    /// Shift left in place, filling in zeros.
+    pub fn shl_assign(&mut self, amount: usize) {
+        self.funnel_shl_assign(&Self::zero(0), amount);
+    }
+
+    /// Shift right in place, filling in zeros.
+    pub fn shr_assign(&mut self, amount: usize) {
+        self.funnel_shr_assign(&Self::zero(0), amount);
+    }
+}
+
+/// Slicing.
+impl PackedInt {
+    /// Extract a slice of bits from the value into `into`, whose width
+    /// determines the length of the slice.
+    pub fn extract_slice_into(&self, off: usize, into: &mut Self) {
+        for (i, l) in into.limbs.iter_mut().enumerate() {
+            *l = word_at(&self.limbs, (off + i * 64) as isize);
+        }
+        into.truncate();
+    }
+
+    /// Insert a slice of bits into the value.
+    pub fn insert_slice(&mut self, off: usize, value: &Self) {
+        assert!(off + value.width <= self.width);
+        let mut done = 0;
+        while done < value.width {
+            let bit = off + done;
+            let (idx, shift) = (bit / 64, bit % 64);
+            let n = std::cmp::min(64 - shift, value.width - done);
+            let mask = top_mask(n) << shift;
+            let bits = word_at(&value.limbs, done as isize) << shift;
+            self.limbs[idx] = (self.limbs[idx] & !mask) | (bits & mask);
+            done += n;
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn packed(width: usize, value: u128) -> PackedInt {
+        PackedInt::from_limbs(width, &[value as u64, (value >> 64) as u64])
+    }
+
+    #[test]
+    fn bitwise() {
+        let mut a = packed(70, 0b1100);
+        a.not_assign();
+        assert_eq!(a, packed(70, (1 << 70) - 1 - 0b1100));
+        a.and_assign(&packed(70, 0b1010));
+        assert_eq!(a, packed(70, 0b0010));
+        a.or_assign(&packed(70, 1 << 65));
+        a.xor_assign(&packed(70, 0b0011));
+        assert_eq!(a, packed(70, 1 << 65 | 0b0001));
+    }
+
+    #[test]
+    fn add_sub() {
+        let mut a = packed(100, u64::max_value() as u128);
+        a.add_assign(&packed(100, 1));
+        assert_eq!(a, packed(100, 1 << 64));
+        a.sub_assign(&packed(100, 2));
+        assert_eq!(a, packed(100, (1 << 64) - 2));
+        let mut b = packed(100, 1);
+        b.sub_assign(&packed(100, 2));
+        assert_eq!(b, PackedInt::all_ones(100));
+        b.neg_assign();
+        assert_eq!(b, packed(100, 1));
+        let mut c = packed(8, 0xff);
+        c.add_assign(&packed(8, 2));
+        assert_eq!(c, packed(8, 1));
+    }
+
+    #[test]
+    fn compare() {
+        let a = packed(80, 1 << 70);
+        let b = packed(80, 5);
+        let mut c = packed(80, 5);
+        c.neg_assign();
+        assert_eq!(a.cmp_unsigned(&b), Ordering::Greater);
+        assert_eq!(c.cmp_unsigned(&a), Ordering::Greater);
+        assert_eq!(c.cmp_signed(&b), Ordering::Less);
+        assert_eq!(b.cmp_signed(&b), Ordering::Equal);
+    }
+
+    #[test]
+    fn shift() {
+        let mut a = packed(100, 0b1011);
+        a.shl_assign(63);
+        assert_eq!(a, packed(100, 0b1011 << 63));
+        a.shr_assign(62);
+        assert_eq!(a, packed(100, 0b10110));
+        a.shl_assign(100);
+        assert!(a.is_zero());
+
+        let mut b = packed(72, 0x81);
+        b.funnel_shl_assign(&packed(8, 0xa5), 4);
+        assert_eq!(b, packed(72, 0x81a));
+        b.funnel_shr_assign(&packed(8, 0xa5), 8);
+        assert_eq!(b, packed(72, 0xa5 << 64 | 0x8));
+        b.funnel_shr_assign(&packed(8, 0x3c), 80);
+        assert_eq!(b, packed(72, 0));
+        b.funnel_shl_assign(&packed(8, 0x3c), 68);
+        assert_eq!(b, packed(72, 0x3c << 60));
+    }
+
+    #[test]
+    fn convert_and_format() {
+        let big = BigUint::from(0xdead_beef_u64) << 70;
+        let a = PackedInt::from_biguint(110, &big);
+        assert_eq!(a, packed(110, 0xdead_beef << 70));
+        assert_eq!(a.to_biguint(), big);
+        assert_eq!(PackedInt::from_biguint(72, &big), packed(72, 0b11 << 70));
+        assert_eq!(
+            format!("{:x}", packed(100, 0xab << 60)),
+            "ab000000000000000"
+        );
+        assert_eq!(format!("{:06x}", packed(8, 0xab)), "0000ab");
+        assert_eq!(
+            format!("{:b}", packed(70, 0b101 << 63)),
+            format!("101{}", "0".repeat(63))
+        );
+        assert_eq!(format!("{:x}", PackedInt::zero(128)), "0");
+    }
+
+    #[test]
+    fn slice() {
+        let a = packed(128, 0xdead_beef << 60);
+        let mut s = PackedInt::zero(32);
+        a.extract_slice_into(60, &mut s);
+        assert_eq!(s, packed(32, 0xdead_beef));
+        let mut b = PackedInt::all_ones(128);
+        b.insert_slice(60, &PackedInt::zero(8));
+        assert_eq!(b, packed(128, !0 ^ 0xff << 60));
+    }
+}
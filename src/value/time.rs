@@ -6,46 +6,141 @@
 
 use crate::ty::{time_ty, Type};
 use num::{traits::*, BigInt, BigRational};
-use std::fmt::{Debug, Display};
+use std::{
+    borrow::Cow,
+    cmp::Ordering,
+    fmt::{Debug, Display},
+};
+
+/// The number of femtoseconds in a second.
+const FS_PER_SECOND: u64 = 1_000_000_000_000_000;
 
 /// A constant time value.
 #[derive(Clone, PartialOrd, Ord, PartialEq, Eq, Hash, Serialize, Deserialize)]
 pub struct TimeValue {
-    /// The real time value, in seconds, as a rational number.
-    pub time: BigRational,
+    /// The real time value.
+    time: RealTime,
     /// The number of delta steps.
     pub delta: usize,
     /// The number of epsilon steps.
     pub epsilon: usize,
 }
 
+/// The real time component of a time value.
+///
+/// Times that are a whole number of femtoseconds and fit into a `u64` are
+/// stored as such, which covers the times of virtually every design. All other
+/// times are stored as a rational number of seconds. Only times that cannot be
+/// stored as femtoseconds are stored as rationals, such that equality and
+/// hashing can rely on the representation.
+#[derive(Clone, PartialEq, Eq, Hash, Serialize, Deserialize)]
+enum RealTime {
+    Femtoseconds(u64),
+    Seconds(BigRational),
+}
+
+impl RealTime {
+    /// Create a canonical real time from a number of seconds.
+    fn from_seconds(time: BigRational) -> Self {
+        if !time.is_negative() {
+            let fs = &time * BigRational::from_integer(FS_PER_SECOND.into());
+            if fs.is_integer() {
+                if let Some(fs) = fs.to_integer().to_u64() {
+                    return RealTime::Femtoseconds(fs);
+                }
+            }
+        }
+        RealTime::Seconds(time)
+    }
+
+    /// Get the time in seconds.
+    fn to_seconds(&self) -> Cow<BigRational> {
+        match *self {
+            RealTime::Femtoseconds(fs) => {
+                Cow::Owned(BigRational::new(fs.into(), FS_PER_SECOND.into()))
+            }
+            RealTime::Seconds(ref s) => Cow::Borrowed(s),
+        }
+    }
+
+    /// Check whether the time is zero.
+    fn is_zero(&self) -> bool {
+        match *self {
+            RealTime::Femtoseconds(fs) => fs == 0,
+            RealTime::Seconds(ref s) => s.is_zero(),
+        }
+    }
+
+    /// Add two times.
+    fn add(&self, other: &Self) -> Self {
+        if let (&RealTime::Femtoseconds(a), &RealTime::Femtoseconds(b)) = (self, other) {
+            if let Some(fs) = a.checked_add(b) {
+                return RealTime::Femtoseconds(fs);
+            }
+        }
+        RealTime::from_seconds(self.to_seconds().into_owned() + &*other.to_seconds())
+    }
+}
+
+impl PartialOrd for RealTime {
+    fn partial_cmp(&self, other: &Self) -> Option<Ordering> {
+        Some(self.cmp(other))
+    }
+}
+
+impl Ord for RealTime {
+    fn cmp(&self, other: &Self) -> Ordering {
+        match (self, other) {
+            (RealTime::Femtoseconds(a), RealTime::Femtoseconds(b)) => a.cmp(b),
+            _ => self.to_seconds().cmp(&other.to_seconds()),
+        }
+    }
+}
+
 impl TimeValue {
     /// Create a new time.
     pub fn new(time: BigRational, delta: usize, epsilon: usize) -> Self {
         TimeValue {
-            time,
+            time: RealTime::from_seconds(time),
             delta,
             epsilon,
         }
     }
 
-    /// Create the zero time.
-    pub fn zero() -> Self {
+    /// Create a new time from a number of femtoseconds.
+    pub fn from_femtoseconds(time: u64, delta: usize, epsilon: usize) -> Self {
         TimeValue {
-            time: BigRational::zero(),
-            delta: 0,
-            epsilon: 0,
+            time: RealTime::Femtoseconds(time),
+            delta,
+            epsilon,
         }
     }
 
+    /// Create the zero time.
+    pub fn zero() -> Self {
+        Self::from_femtoseconds(0, 0, 0)
+    }
+
     /// Get the type of the value.
     pub fn ty(&self) -> Type {
         time_ty()
     }
 
-    /// Get the physical time of the time.
-    pub fn time(&self) -> &BigRational {
-        &self.time
+    /// Get the physical time of the time, in seconds.
+    ///
+    /// This allocates a rational number. Use `femtoseconds` to access the
+    /// physical time without allocation.
+    pub fn time(&self) -> BigRational {
+        self.time.to_seconds().into_owned()
+    }
+
+    /// Get the physical time of the time in femtoseconds, if it is a whole
+    /// number of femtoseconds that fits into a `u64`.
+    pub fn femtoseconds(&self) -> Option<u64> {
+        match self.time {
+            RealTime::Femtoseconds(fs) => Some(fs),
+            RealTime::Seconds(_) => None,
+        }
     }
 
     /// Get the delta time of the time.
@@ -62,11 +157,59 @@ impl TimeValue {
     pub fn is_zero(&self) -> bool {
         self.time.is_zero() && self.delta.is_zero() && self.epsilon.is_zero()
     }
+
+    /// Check whether the physical time is zero.
+    pub fn is_zero_time(&self) -> bool {
+        self.time.is_zero()
+    }
+
+    /// Check whether two times refer to the same physical time, regardless of
+    /// their delta and epsilon steps.
+    pub fn same_time(&self, other: &Self) -> bool {
+        self.time == other.time
+    }
+
+    /// Determine the time at which a delay starting at this time expires.
+    ///
+    /// A non-zero physical delay resets the delta and epsilon steps, and a
+    /// non-zero delta delay resets the epsilon steps.
+    pub fn after(&self, delay: &TimeValue) -> TimeValue {
+        let mut time = Cow::Borrowed(&self.time);
+        let mut delta = self.delta;
+        let mut epsilon = self.epsilon;
+        if !delay.time.is_zero() {
+            time = Cow::Owned(self.time.add(&delay.time));
+            delta = 0;
+            epsilon = 0;
+        }
+        if delay.delta != 0 {
+            delta += delay.delta;
+            epsilon = 0;
+        }
+        epsilon += delay.epsilon;
+        TimeValue {
+            time: time.into_owned(),
+            delta,
+            epsilon,
+        }
+    }
+
+    /// Determine the time of the next delta step.
+    pub fn next_delta(&self) -> TimeValue {
+        TimeValue {
+            time: self.time.clone(),
+            delta: self.delta + 1,
+            epsilon: 0,
+        }
+    }
 }
 
 impl Display for TimeValue {
     fn fmt(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
-        write_ratio_as_si(&self.time, f)?;
+        match self.time {
+            RealTime::Femtoseconds(fs) => write_fs_as_si(fs, f)?,
+            RealTime::Seconds(ref s) => write_ratio_as_si(s, f)?,
+        }
         if !self.delta.is_zero() {
             write!(f, " {}d", self.delta)?;
         }
@@ -83,6 +226,45 @@ impl Debug for TimeValue {
     }
 }
 
+/// Format a number of femtoseconds the same way `write_ratio_as_si` does,
+/// without allocating.
+fn write_fs_as_si(fs: u64, f: &mut std::fmt::Formatter) -> std::fmt::Result {
+    if fs == 0 {
+        return write!(f, "0s");
+    }
+    let prefices = ["", "m", "u", "n", "p", "f"];
+
+    // Pick the largest unit in which the time is at least one.
+    let mut prefix = 0;
+    let mut unit = FS_PER_SECOND;
+    while fs < unit {
+        prefix += 1;
+        unit /= 1000;
+    }
+
+    // Add groups of three fractional digits until the time is represented
+    // exactly, up to nine digits.
+    let mut shift = 0;
+    while shift < 9 && fs % unit != 0 {
+        shift += 3;
+        unit /= 1000;
+    }
+    let rounded = fs / unit + (fs % unit * 2 >= unit) as u64;
+    if shift > 0 {
+        let scale = 10u64.pow(shift as u32);
+        write!(
+            f,
+            "{}.{:0width$}{}s",
+            rounded / scale,
+            rounded % scale,
+            prefices[prefix],
+            width = shift
+        )
+    } else {
+        write!(f, "{}{}s", rounded, prefices[prefix])
+    }
+}
+
 fn write_ratio_as_si(ratio: &BigRational, f: &mut std::fmt::Formatter) -> std::fmt::Result {
     if ratio.is_zero() {
         return write!(f, "0s");
@@ -171,5 +353,39 @@ mod tests {
         assert_eq!(make(5, 1000, 0, 0), "5ms");
 
         assert_eq!(make(1, 3, 0, 0), "333.333333333ms");
+        assert_eq!(make(2, 3, 0, 0), "666.666666667ms");
+        assert_eq!(make(1234567, 1000000000, 0, 0), "1.234567ms");
+        assert_eq!(make(1234567891, 1000, 0, 0), "1234567.891s");
+        assert_eq!(make(2000000001, 2000000000, 0, 0), "1.000000001s");
+    }
+
+    #[test]
+    fn compact_time() {
+        let ns = |n: usize| TimeValue::new(BigRational::new(n.into(), 1000000000.into()), 0, 0);
+        let a = TimeValue::new(BigRational::new(1.into(), 3.into()), 0, 0);
+        assert_eq!(ns(5).femtoseconds(), Some(5000000));
+        assert_eq!(a.femtoseconds(), None);
+        assert_eq!(ns(5), TimeValue::from_femtoseconds(5000000, 0, 0));
+        assert!(ns(5) < ns(6));
+        assert!(ns(400000000) > a);
+        assert!(ns(300000000) < a);
+
+        let t = TimeValue::from_femtoseconds(7, 2, 1);
+        assert_eq!(
+            t.after(&TimeValue::new(Zero::zero(), 0, 3)),
+            TimeValue::from_femtoseconds(7, 2, 4)
+        );
+        assert_eq!(
+            t.after(&TimeValue::new(Zero::zero(), 1, 3)),
+            TimeValue::from_femtoseconds(7, 3, 3)
+        );
+        assert_eq!(t.after(&ns(1)), TimeValue::from_femtoseconds(1000007, 0, 0));
+        assert_eq!(t.next_delta(), TimeValue::from_femtoseconds(7, 3, 0));
+        let big = TimeValue::from_femtoseconds(u64::max_value(), 0, 0);
+        assert_eq!(
+            big.after(&big).time(),
+            BigRational::from_integer(u64::max_value().into())
+                * BigRational::new(2.into(), FS_PER_SECOND.into())
+        );
     }
 }
@@ -0,0 +1,118 @@
+// Copyright (c) 2017-2021 Fabian Schuiki
+
+//! Reading of Value Change Dump traces
+//!
+//! This module provides the building blocks shared by the tools that read VCD
+//! files, such as the stimulus replay of the simulator and the trace
+//! comparison tool.
+
+use num::{pow, BigInt, BigRational};
+use std::{
+    collections::VecDeque,
+    io::{BufRead, Error, ErrorKind, Result},
+};
+
+/// A lazy stream of whitespace-separated tokens, or entire lines.
+///
+/// Tokens and lines may be read interchangeably, such that the same reader can
+/// be used for line-based formats.
+pub struct Tokens<R> {
+    reader: R,
+    line: VecDeque<String>,
+}
+
+impl<R: BufRead> Tokens<R> {
+    /// Create a new token stream.
+    pub fn new(reader: R) -> Self {
+        Self {
+            reader,
+            line: VecDeque::new(),
+        }
+    }
+
+    /// Read the next raw line, including leading whitespace.
+    pub fn next_line(&mut self) -> Result<Option<String>> {
+        let mut line = String::new();
+        if self.reader.read_line(&mut line)? == 0 {
+            return Ok(None);
+        }
+        Ok(Some(line.trim_end().to_string()))
+    }
+
+    /// Read the next token.
+    pub fn next_token(&mut self) -> Result<Option<String>> {
+        while self.line.is_empty() {
+            match self.next_line()? {
+                Some(line) => self.line.extend(line.split_whitespace().map(String::from)),
+                None => return Ok(None),
+            }
+        }
+        Ok(self.line.pop_front())
+    }
+
+    /// Read the next token, or fail at the end of the input.
+    pub fn expect_token(&mut self) -> Result<String> {
+        self.next_token()?
+            .ok_or_else(|| Error::new(ErrorKind::UnexpectedEof, "unexpected end of input"))
+    }
+
+    /// Skip tokens up to and including the next `$end`, and return the tokens
+    /// skipped.
+    pub fn skip_to_end(&mut self) -> Result<Vec<String>> {
+        let mut skipped = vec![];
+        loop {
+            let token = self.expect_token()?;
+            if token == "$end" {
+                return Ok(skipped);
+            }
+            skipped.push(token);
+        }
+    }
+}
+
+/// Parse a time of the form `<number><unit>`, as used by `$timescale`.
+///
+/// Returns the time in seconds.
+pub fn parse_timescale(spec: &str) -> std::result::Result<BigRational, String> {
+    let split = spec
+        .find(|c: char| !c.is_ascii_digit())
+        .unwrap_or(spec.len());
+    let (num, unit) = spec.split_at(split);
+    let exp = match unit {
+        "s" => 0,
+        "ms" => 3,
+        "us" => 6,
+        "ns" => 9,
+        "ps" => 12,
+        "fs" => 15,
+        _ => return Err(format!("unknown timescale unit `{}`", unit)),
+    };
+    let num: BigInt = num
+        .parse()
+        .map_err(|_| format!("invalid timescale `{}`", spec))?;
+    Ok(BigRational::new(num, pow(BigInt::from(10), exp)))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn timescale() {
+        let ps = BigRational::new(BigInt::from(1), pow(BigInt::from(10), 12));
+        assert_eq!(parse_timescale("1ps"), Ok(ps.clone()));
+        assert_eq!(parse_timescale("100ps"), Ok(ps * BigInt::from(100)));
+        assert!(parse_timescale("1xs").is_err());
+        assert!(parse_timescale("ns").is_err());
+    }
+
+    #[test]
+    fn tokens() {
+        let mut tokens = Tokens::new("$var wire 1 ! a $end\n  #10\n".as_bytes());
+        assert_eq!(tokens.expect_token().unwrap(), "$var");
+        assert_eq!(tokens.skip_to_end().unwrap(), vec!["wire", "1", "!", "a"]);
+        assert_eq!(tokens.next_line().unwrap().as_deref(), Some("  #10"));
+        assert_eq!(tokens.next_token().unwrap(), None);
+        assert!(tokens.expect_token().is_err());
+    }
+}
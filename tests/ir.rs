@@ -41,3 +41,151 @@ fn call_with_return_value() {
         println!("{}", builder.unit());
     });
 }
+
+#[test]
+fn clone_into_reuses_target() {
+    let src = within_func(llhd::int_ty(32), |builder| {
+        let v = builder.ins().name("x").const_int((32, 42));
+        builder.ins().ret_value(v);
+    });
+    let mut dst = within_func(llhd::void_ty(), |builder| {
+        builder.ins().ret();
+    });
+    src.clone_into(&mut dst);
+    let (src, dst) = (Unit::new_anonymous(&src), Unit::new_anonymous(&dst));
+    assert_eq!(src.to_string(), dst.to_string());
+    assert_eq!(dst.sig().return_type(), llhd::int_ty(32));
+}
+
+#[test]
+fn module_snapshot_rollback() {
+    let mut module = Module::new();
+    let kept = module.add_unit(within_func(llhd::void_ty(), |builder| {
+        builder.ins().ret();
+    }));
+    let changed = module.add_unit(within_func(llhd::int_ty(32), |builder| {
+        let v = builder.ins().const_int((32, 42));
+        builder.ins().ret_value(v);
+    }));
+    let before = module.dump().to_string();
+
+    // Modify one unit, remove another, and add a new one.
+    let snapshot = module.snapshot();
+    {
+        let mut unit = module.unit_mut(changed);
+        let bb = unit.first_block().unwrap();
+        unit.prepend_to(bb);
+        unit.ins().const_int((8, 1));
+    }
+    module.remove_unit(kept);
+    module.add_unit(within_func(llhd::void_ty(), |builder| {
+        builder.ins().ret();
+    }));
+    assert_ne!(module.dump().to_string(), before);
+
+    module.rollback(snapshot);
+    assert_eq!(module.dump().to_string(), before);
+
+    // Changes made after a commit are kept.
+    let snapshot = module.snapshot();
+    module.remove_unit(kept);
+    module.commit(snapshot);
+    assert_eq!(module.units().count(), 1);
+}
+
+#[test]
+fn footprint() {
+    let mut module = Module::new();
+    module.add_unit(within_func(llhd::int_ty(32), |builder| {
+        let mut sig = Signature::new();
+        sig.add_input(llhd::int_ty(32));
+        sig.set_return_type(llhd::int_ty(32));
+        let ext = builder.add_extern(UnitName::global("foo"), sig);
+        let v1 = builder.ins().name("x").const_int((32, 42));
+        let v2 = builder.ins().call(ext, vec![v1]);
+        builder.ins().ret_value(v2);
+    }));
+    let fp = module.footprint();
+    assert!(fp.insts > 0);
+    assert!(fp.operands >= 4);
+    assert!(fp.uses > 0);
+    assert!(fp.names >= 1);
+    assert!(fp.layout > 0);
+    assert!(fp.types > 0);
+    let total: usize = module.units().map(|u| u.footprint().total()).sum();
+    assert_eq!(fp.total(), total);
+}
+
+#[test]
+fn partitioned_const_folding() {
+    use llhd::{opt::prelude::*, pass::ConstFolding};
+    let mut sig = Signature::new();
+    let output = sig.add_output(llhd::signal_ty(llhd::int_ty(32)));
+    let mut data = UnitData::new(UnitKind::Entity, UnitName::global("test"), sig);
+    let mut builder = UnitBuilder::new_anonymous(&mut data);
+    let y = builder.arg_value(output);
+    let term = builder.terminator(builder.entry());
+    builder.insert_before(term);
+    let delay = builder.ins().const_time(llhd::TimeValue::zero());
+    for i in 0..MIN_PARTITION_INSTS {
+        let a = builder.ins().const_int((32, i));
+        let b = builder.ins().const_int((32, 1));
+        let c = builder.ins().add(a, b);
+        builder.ins().drv(y, c, delay);
+    }
+    assert!(ConstFolding::run_on_unit(&PassContext, &mut builder));
+    let unit = builder.unit();
+    let mut verifier = llhd::verifier::Verifier::new();
+    verifier.verify_unit(unit);
+    verifier.finish_panic();
+    let drives: Vec<_> = unit
+        .all_insts()
+        .filter(|&inst| unit[inst].opcode() == Opcode::Drv)
+        .map(|inst| unit.get_const_int(unit[inst].args()[1]).unwrap().to_usize())
+        .collect();
+    assert_eq!(drives, (1..=MIN_PARTITION_INSTS).collect::<Vec<_>>());
+}
+
+#[test]
+fn partitioned_externs_and_names() {
+    use llhd::{opt::prelude::*, pass::ConstFolding};
+    let mut sig = Signature::new();
+    let output = sig.add_output(llhd::signal_ty(llhd::int_ty(32)));
+    let mut data = UnitData::new(UnitKind::Entity, UnitName::global("test"), sig);
+    let mut builder = UnitBuilder::new_anonymous(&mut data);
+    let y = builder.arg_value(output);
+    builder.set_name(y, "y".to_string());
+    let mut child_sig = Signature::new();
+    child_sig.add_input(llhd::signal_ty(llhd::int_ty(32)));
+    let child = builder.add_extern(UnitName::global("child"), child_sig);
+    let term = builder.terminator(builder.entry());
+    builder.insert_before(term);
+    let delay = builder.ins().const_time(llhd::TimeValue::zero());
+    for i in 0..MIN_PARTITION_INSTS / 4 {
+        let a = builder.ins().const_int((32, i));
+        let b = builder.ins().const_int((32, 1));
+        let c = builder.ins().add(a, b);
+        let s = builder.ins().name("s").sig(c);
+        let inst = builder.value_inst(s);
+        builder.set_location_hint(inst, i);
+        builder.ins().inst(child, vec![s], vec![]);
+        builder.ins().drv(y, c, delay);
+    }
+    assert!(ConstFolding::run_on_unit(&PassContext, &mut builder));
+    let unit = builder.unit();
+    let mut verifier = llhd::verifier::Verifier::new();
+    verifier.verify_unit(unit);
+    verifier.finish_panic();
+    assert_eq!(unit.extern_units().count(), 1);
+    assert_eq!(unit.get_name(unit.arg_value(output)), Some("y"));
+    let hints: Vec<_> = unit
+        .all_insts()
+        .filter(|&inst| unit[inst].opcode() == Opcode::Sig)
+        .inspect(|&inst| assert_eq!(unit.get_name(unit.inst_result(inst)), Some("s")))
+        .map(|inst| unit.location_hint(inst))
+        .collect();
+    assert_eq!(
+        hints,
+        (0..MIN_PARTITION_INSTS / 4).map(Some).collect::<Vec<_>>()
+    );
+}